@@ -0,0 +1,1008 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../common/src/assetImporter.h"
+#include "../../common/src/kdTree.h"
+#include "../../common/src/photonFile.h"
+#include "../../common/src/photonMapFile.h"
+#include "../../common/src/photonWriter.h"
+#include "../../common/src/photonStorage.h"
+#include "../../common/src/hashGrid.h"
+#include "../../common/src/lightTree.h"
+#include "../../common/src/shadingMath.h"
+#include "../../common/src/triangleRecord.h"
+#include "../../cpu-renderer/include/bvh.h"
+#include "../../cpu-renderer/include/chunkedPhotonMap.h"
+#include "../../cpu-renderer/include/photonMap.h"
+#include "../../cpu-renderer/include/photonSplatter.h"
+#include "../../cpu-renderer/include/photonTracer.h"
+#include "../../cpu-renderer/include/renderer.h"
+#include "../../cpu-renderer/include/textureCache.h"
+#include "../../photon-viewer/include/photon.h"
+#include "../../photon-viewer/include/photonProjection.h"
+#include "../../ray-tracer/include/photon.h"
+#include <assimp/Importer.hpp>
+#include <cukd/builder.h>
+#include <cukd/knn.h>
+#include "glm/ext/matrix_clip_space.hpp"
+#include "glm/ext/matrix_transform.hpp"
+
+/* Micro-benchmarks for the photon pipeline.
+ *
+ * Everything except the `gpu_*` entries runs on the CPU so the suite can be
+ * tracked on machines without a GPU. Results are written as JSON, one entry
+ * per (benchmark, parameters) pair.
+ *
+ * usage: photonBenchmark [--assets DIR] [--photons N] [--queries N]
+ *                        [--repeat N] [--output FILE]
+ */
+
+struct Options {
+  std::string assetsDir = "../assets/models";
+  std::string output = "benchmark_results.json";
+  size_t numPhotons = 1'000'000;
+  size_t numQueries = 100'000;
+  int repeat = 3;
+};
+
+const std::vector<std::pair<std::string, std::string>> SCENES = {
+  {"sphere", "sphere/sphere.glb"},
+  {"cornell-box", "cornell-box/cornell-box.glb"},
+  {"dragon", "dragon/dragon-box.glb"},
+};
+
+const float KNN_RADII[] = {1.f, 10.f, 100.f};
+/* Fixed-radius gathers return every photon in range, so they are only
+ * benchmarked at radii that keep the counts close to K. */
+const float GATHER_RADII[] = {0.5f, 1.f, 2.f};
+/* Synthetic point lights for the direct lighting benchmark, which traces a
+ * shadow ray per light and shading point without a light tree. */
+const int LIGHT_COUNTS[] = {16, 256, 1024};
+/* Copies of the largest scene for the instancing benchmark; the flattened
+ * layout is only built up to the smaller counts. */
+const int INSTANCE_COUNTS[] = {1, 8, 64};
+const int MAX_FLATTENED_COPIES = 8;
+const size_t LIGHT_SHADING_POINTS = 4096;
+/* Resident tile budgets and lookup footprints (in uv units, 0 is the
+ * finest level) for the texture cache benchmark. */
+const size_t TEXTURE_BUDGETS[] = {256u << 10, 4u << 20, 64u << 20};
+const float TEXTURE_FOOTPRINTS[] = {0.f, 1.f / 64.f};
+/* Resident chunk budgets for the chunked photon map benchmark, from a few
+ * chunks to the whole map. */
+const size_t PHOTON_CHUNK_BUDGETS[] = {1u << 20, 16u << 20, 256u << 20};
+
+struct BenchPhoton {
+  owl::vec3f pos;
+  owl::vec3f dir;
+  owl::vec3f color;
+  uint8_t split_dim;
+};
+
+struct BenchPhoton_traits {
+  static inline owl::vec3f get_point(const BenchPhoton &p) { return p.pos; }
+  static inline int get_dim(const BenchPhoton &p) { return p.split_dim; }
+  static inline void set_dim(BenchPhoton &p, int dim) { p.split_dim = dim; }
+};
+
+struct PackedPhoton_traits {
+  static inline owl::vec3f get_point(const PhotonNode &p) { return p.pos; }
+  static inline int get_dim(const PhotonNode &p) { return photon_storage::getDim(p); }
+  static inline void set_dim(PhotonNode &p, int dim) { photon_storage::setDim(p, dim); }
+};
+
+/* ------------------------------------------------------------------ */
+/* Result collection                                                  */
+/* ------------------------------------------------------------------ */
+
+struct Result {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> params;
+  double minMs;
+  double medianMs;
+  double throughput;
+  std::string unit;
+};
+
+std::vector<Result> results;
+
+template<typename T>
+std::string jsonValue(const T &v) {
+  std::ostringstream s;
+  s << v;
+  return s.str();
+}
+
+template<>
+std::string jsonValue(const std::string &v) { return "\"" + v + "\""; }
+
+/* Runs `fn` `repeat` times and records min/median wall time. `work` is the
+ * number of items processed per run, used for the throughput figure. */
+void measure(const Options &options, const std::string &name,
+             std::vector<std::pair<std::string, std::string>> params,
+             double work, const std::string &unit,
+             const std::function<void()> &fn) {
+  std::vector<double> times;
+  for (int r = 0; r < options.repeat; r++) {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const auto end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  std::sort(times.begin(), times.end());
+
+  Result result;
+  result.name = name;
+  result.params = std::move(params);
+  result.minMs = times.front();
+  result.medianMs = times[times.size() / 2];
+  result.throughput = work / (result.medianMs * 1e-3);
+  result.unit = unit;
+
+  std::cout << name;
+  for (const auto &[k, v] : result.params) std::cout << " " << k << "=" << v;
+  std::cout << ": " << result.medianMs << " ms (" << result.throughput << " " << unit << ")" << std::endl;
+
+  results.push_back(result);
+}
+
+void writeResults(const Options &options, bool gpuAvailable) {
+  std::ofstream out(options.output);
+  if (!out.is_open()) {
+    std::cerr << "Error opening file: " << options.output << std::endl;
+    return;
+  }
+
+  out << "{\n  \"photons\": " << options.numPhotons
+      << ",\n  \"queries\": " << options.numQueries
+      << ",\n  \"repeat\": " << options.repeat
+      << ",\n  \"gpu\": " << (gpuAvailable ? "true" : "false")
+      << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto &r = results[i];
+    out << (i == 0 ? "" : ",") << "\n    {\"name\": \"" << r.name << "\", \"params\": {";
+    for (size_t p = 0; p < r.params.size(); p++) {
+      out << (p == 0 ? "" : ", ") << "\"" << r.params[p].first << "\": " << r.params[p].second;
+    }
+    out << "}, \"min_ms\": " << r.minMs
+        << ", \"median_ms\": " << r.medianMs
+        << ", \"throughput\": " << r.throughput
+        << ", \"unit\": \"" << r.unit << "\"}";
+  }
+  out << "\n  ]\n}\n";
+
+  std::cout << "Wrote " << results.size() << " results to " << options.output << std::endl;
+}
+
+/* ------------------------------------------------------------------ */
+/* Synthetic photon clouds                                            */
+/* ------------------------------------------------------------------ */
+
+owl::vec3f randomUnit(std::mt19937 &rng) {
+  std::normal_distribution<float> n(0.f, 1.f);
+  return normalize(owl::vec3f(n(rng), n(rng), n(rng)));
+}
+
+/* Photons spread uniformly through a cube the size of the cornell box. */
+std::vector<BenchPhoton> uniformCloud(size_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> u(-50.f, 50.f);
+  std::uniform_real_distribution<float> c(0.f, 1.f);
+
+  std::vector<BenchPhoton> photons(count);
+  for (auto &p : photons) {
+    p.pos = owl::vec3f(u(rng), u(rng), u(rng));
+    p.dir = randomUnit(rng);
+    p.color = owl::vec3f(c(rng), c(rng), c(rng));
+  }
+  return photons;
+}
+
+/* Photons distributed over the scene's triangles proportionally to area,
+ * which is how the photon mapper actually deposits them. */
+std::vector<BenchPhoton> surfaceCloud(const World &world, size_t count, uint32_t seed) {
+  std::vector<owl::vec3f> a, b, c;
+  std::vector<double> cdf;
+  double total = 0.0;
+  for (const auto &instance : world.instances) {
+    const auto &mesh = world.meshes[instance.meshID];
+    for (const auto &tri : mesh.indices) {
+      a.push_back(xfmPoint(instance.transform, mesh.vertices[tri.x]));
+      b.push_back(xfmPoint(instance.transform, mesh.vertices[tri.y]));
+      c.push_back(xfmPoint(instance.transform, mesh.vertices[tri.z]));
+      total += 0.5 * length(cross(b.back() - a.back(), c.back() - a.back()));
+      cdf.push_back(total);
+    }
+  }
+
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> pick(0.0, total);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+
+  std::vector<BenchPhoton> photons(count);
+  for (auto &p : photons) {
+    const auto tri = std::lower_bound(cdf.begin(), cdf.end(), pick(rng)) - cdf.begin();
+    float s = u(rng), t = u(rng);
+    if (s + t > 1.f) { s = 1.f - s; t = 1.f - t; }
+    p.pos = a[tri] + s * (b[tri] - a[tri]) + t * (c[tri] - a[tri]);
+    p.dir = randomUnit(rng);
+    p.color = owl::vec3f(u(rng), u(rng), u(rng));
+  }
+  return photons;
+}
+
+/* Query points are jittered photon positions so they land where gathers
+ * happen in practice. */
+std::vector<owl::vec3f> queryPoints(const std::vector<BenchPhoton> &photons, size_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<size_t> pick(0, photons.size() - 1);
+  std::normal_distribution<float> jitter(0.f, 0.5f);
+
+  std::vector<owl::vec3f> queries(count);
+  for (auto &q : queries) {
+    q = photons[pick(rng)].pos + owl::vec3f(jitter(rng), jitter(rng), jitter(rng));
+  }
+  return queries;
+}
+
+/* ------------------------------------------------------------------ */
+/* CPU benchmarks                                                     */
+/* ------------------------------------------------------------------ */
+
+/* Closest-hit and shadow rays from inside the scene bounds in random
+ * directions, roughly what the photon tracer and the renderer issue. */
+void benchCpuBvh(const Options &options, const std::string &scene, const World &world) {
+  cpu::Bvh bvh;
+  measure(options, "cpu_bvh_build", {{"scene", jsonValue(scene)}}, 1.0, "builds/s", [&] {
+    bvh = cpu::buildBvh(world);
+  });
+
+  const owl::box3f bounds = bvh.nodes.front().bounds;
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+  std::vector<owl::vec3f> origins(options.numQueries), directions(options.numQueries);
+  for (size_t i = 0; i < origins.size(); i++) {
+    const owl::vec3f t(u(rng), u(rng), u(rng));
+    origins[i] = bounds.lower + t * (bounds.upper - bounds.lower);
+    directions[i] = randomUnit(rng);
+  }
+
+  size_t numHits = 0;
+  measure(options, "cpu_rays", {{"scene", jsonValue(scene)}, {"type", jsonValue(std::string("closest"))}},
+          static_cast<double>(origins.size()), "rays/s", [&] {
+    numHits = 0;
+    cpu::Hit hit;
+    for (size_t i = 0; i < origins.size(); i++) {
+      numHits += cpu::intersect(bvh, origins[i], directions[i], 1e-3f, INFINITY, hit);
+    }
+  });
+
+  measure(options, "cpu_rays", {{"scene", jsonValue(scene)}, {"type", jsonValue(std::string("shadow"))}},
+          static_cast<double>(origins.size()), "rays/s", [&] {
+    numHits = 0;
+    for (size_t i = 0; i < origins.size(); i++) {
+      numHits += cpu::occluded(bvh, origins[i], directions[i], 1e-3f, INFINITY);
+    }
+  });
+  // keep the traversals from being optimised away
+  if (numHits > origins.size()) std::cout << numHits << std::endl;
+}
+
+/* BVH build over copies of a scene placed side by side, once as instances
+ * of the shared prototypes and once with every copy baked into its own
+ * meshes, which is what import produced before instancing. */
+void benchCpuInstancing(const Options &options, const World &world) {
+  const owl::box3f bounds = cpu::buildBvh(world).nodes.front().bounds;
+  const float spacing = 1.1f * (bounds.upper.x - bounds.lower.x);
+
+  for (const int copies : INSTANCE_COUNTS) {
+    World instanced;
+    instanced.meshes = world.meshes;
+    instanced.materials = world.materials;
+    World flattened;
+    flattened.materials = world.materials;
+    for (int copy = 0; copy < copies; copy++) {
+      for (auto instance : world.instances) {
+        instance.transform.p += owl::vec3f(copy * spacing, 0.f, 0.f);
+        instanced.instances.push_back(instance);
+        if (copies > MAX_FLATTENED_COPIES) continue;
+
+        Mesh mesh = world.meshes[instance.meshID];
+        for (auto &v : mesh.vertices) v = xfmPoint(instance.transform, v);
+        flattened.instances.push_back({static_cast<int>(flattened.meshes.size()), identityTransform()});
+        flattened.meshes.push_back(std::move(mesh));
+      }
+    }
+
+    for (const World *layout : {&instanced, &flattened}) {
+      if (layout->instances.empty()) continue;
+      const std::string name = layout == &instanced ? "instanced" : "flattened";
+      size_t storedTriangles = 0;
+      measure(options, "cpu_bvh_build_copies", {{"copies", jsonValue(copies)}, {"layout", jsonValue(name)}}, 1.0, "builds/s", [&] {
+        const cpu::Bvh bvh = cpu::buildBvh(*layout);
+        storedTriangles = 0;
+        for (const auto &mesh : bvh.meshes) storedTriangles += mesh.triangles.size();
+      });
+      std::cout << "  triangles stored: " << storedTriangles << std::endl;
+    }
+  }
+}
+
+/* Per-hit normal of random instanced triangles, recomputed from the packed
+ * vertex and index pools as getPrimitiveNormal does without precomputed
+ * normals, and read from the precomputed normal pool. The extra memory is
+ * the normal pool against the vertex and index pools it saves loads from. */
+void benchTriangleNormals(const Options &options, const World &world) {
+  if (world.instances.empty()) return;
+  const PackedScene packed = packScene(world, true);
+
+  std::vector<owl::affine3f> toObject(world.instances.size());
+  for (size_t i = 0; i < toObject.size(); i++) toObject[i] = rcp(world.instances[i].transform);
+
+  struct NormalQuery { uint32_t instance; uint32_t triangle; };
+  std::mt19937 rng(13);
+  std::vector<NormalQuery> queries;
+  queries.reserve(options.numQueries);
+  while (queries.size() < options.numQueries) {
+    const uint32_t instance = static_cast<uint32_t>(rng() % world.instances.size());
+    const PackedMesh &mesh = packed.meshes[world.instances[instance].meshID];
+    if (mesh.indexCount == 0) continue;
+    queries.push_back({instance, mesh.indexOffset + static_cast<uint32_t>(rng() % mesh.indexCount)});
+  }
+
+  for (const bool precomputed : {false, true}) {
+    owl::vec3f checksum(0.f);
+    measure(options, "triangle_normals", {{"source", jsonValue(std::string(precomputed ? "precomputed" : "vertices"))}},
+            static_cast<double>(queries.size()), "hits/s", [&] {
+      for (const auto &query : queries) {
+        const PackedMesh &mesh = packed.meshes[world.instances[query.instance].meshID];
+        if (precomputed) {
+          const auto &l = toObject[query.instance].l;
+          checksum += instanceNormal(packed.normals[query.triangle], owl::vec3f(l.vx.x, l.vy.x, l.vz.x),
+                                     owl::vec3f(l.vx.y, l.vy.y, l.vz.y), owl::vec3f(l.vx.z, l.vy.z, l.vz.z));
+          continue;
+        }
+        const owl::vec3i index = packed.indices[query.triangle];
+        const owl::vec3f &a = packed.vertices[mesh.vertexOffset + index.x];
+        const owl::vec3f &b = packed.vertices[mesh.vertexOffset + index.y];
+        const owl::vec3f &c = packed.vertices[mesh.vertexOffset + index.z];
+        const auto &toWorld = world.instances[query.instance].transform;
+        checksum += normalize(cross(xfmVector(toWorld, b - a), xfmVector(toWorld, c - a)));
+      }
+    });
+    if (checksum.x > 1e30f) std::cout << checksum.x << std::endl;
+  }
+
+  const size_t poolBytes = packed.vertices.size() * sizeof(owl::vec3f) + packed.indices.size() * sizeof(owl::vec3i);
+  const size_t normalBytes = packed.normals.size() * sizeof(owl::vec3f);
+  std::cout << "  normal pool: " << normalBytes / 1024 << " KiB, "
+            << 100.0 * static_cast<double>(normalBytes) / static_cast<double>(std::max<size_t>(poolBytes, 1))
+            << "% of the vertex and index pools" << std::endl;
+}
+
+void benchImport(const Options &options, std::unique_ptr<World> &largestWorld) {
+  size_t largestTriangles = 0;
+  for (const auto &[name, file] : SCENES) {
+    std::string path = options.assetsDir + "/" + file;
+
+    size_t numTriangles = 0;
+    std::unique_ptr<World> world;
+    measure(options, "import_scene", {{"scene", jsonValue(name)}}, 1.0, "scenes/s", [&] {
+      Assimp::Importer importer;
+      world = assets::import_scene(&importer, path);
+    });
+    benchCpuBvh(options, name, *world);
+    measure(options, "pack_scene", {{"scene", jsonValue(name)}, {"meshes", jsonValue(world->meshes.size())}}, 1.0, "scenes/s", [&] {
+      const PackedScene packed = packScene(*world);
+      if (packed.meshes.size() != world->meshes.size()) std::cout << packed.meshes.size() << std::endl;
+    });
+
+    numTriangles = numInstancedTriangles(*world);
+    if (numTriangles > largestTriangles) {
+      largestTriangles = numTriangles;
+      largestWorld = std::move(world);
+    }
+  }
+}
+
+template<int K, typename T, typename Traits>
+void benchCpuKnn(const Options &options, const std::string &cloud, const std::string &layout,
+                 const std::vector<T> &tree, const std::vector<owl::vec3f> &queries) {
+  for (const float radius : KNN_RADII) {
+    float checksum = 0.f;
+    measure(options, "cpu_knn",
+            {{"cloud", jsonValue(cloud)}, {"layout", jsonValue(layout)}, {"k", jsonValue(K)}, {"radius", jsonValue(radius)}},
+            static_cast<double>(queries.size()), "queries/s", [&] {
+      for (const auto &q : queries) {
+        kdtree::CandidateList<K> closest(radius);
+        checksum += kdtree::knn<kdtree::CandidateList<K>, T, Traits>(
+          closest, q, tree.data(), tree.size());
+      }
+    });
+    // keep the queries from being optimised away
+    if (checksum < 0.f) std::cout << checksum << std::endl;
+  }
+}
+
+void benchCpuPhotonMap(const Options &options, const std::string &cloud, const std::vector<BenchPhoton> &photons) {
+  std::vector<BenchPhoton> tree;
+  measure(options, "cpu_kdtree_build", {{"cloud", jsonValue(cloud)}, {"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    tree = photons;
+    kdtree::buildTree<BenchPhoton, BenchPhoton_traits>(tree.data(), tree.size());
+  });
+
+  // the layout the ray tracer uses: 16 byte nodes, payloads kept apart
+  std::vector<photon_storage::PhotonRecord> records(photons.size());
+  for (size_t i = 0; i < photons.size(); i++) records[i] = {photons[i].pos, photons[i].dir, photons[i].color};
+  std::vector<PhotonNode> packed(photons.size());
+  std::vector<uint32_t> flux(photons.size());
+  measure(options, "cpu_kdtree_build_packed", {{"cloud", jsonValue(cloud)}, {"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    photon_storage::prepareNodes(records, packed.data());
+    kdtree::buildTree<PhotonNode, PackedPhoton_traits>(packed.data(), packed.size());
+    photon_storage::packPayloads(records, packed.data(), flux.data());
+  });
+
+  // the same map loaded pre-built, as the ray tracer's photon map cache does
+  const std::string cacheFile = "benchmark_photons.pmap";
+  photon_map_file::write(cacheFile, 1, {{packed.data(), flux.data(), static_cast<uint32_t>(packed.size()), owl::box3f()}});
+  std::vector<PhotonNode> loaded(photons.size());
+  std::vector<uint32_t> loadedFlux(photons.size());
+  measure(options, "cpu_kdtree_load_packed", {{"cloud", jsonValue(cloud)}, {"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    photon_map_file::Reader cache(cacheFile, 1, 1);
+    if (cache.valid()) cache.read(0, loaded.data(), loadedFlux.data());
+  });
+  std::remove(cacheFile.c_str());
+
+  const auto queries = queryPoints(photons, options.numQueries, 7);
+  benchCpuKnn<10, BenchPhoton, BenchPhoton_traits>(options, cloud, "aos", tree, queries);
+  benchCpuKnn<50, BenchPhoton, BenchPhoton_traits>(options, cloud, "aos", tree, queries);
+  benchCpuKnn<100, BenchPhoton, BenchPhoton_traits>(options, cloud, "aos", tree, queries);
+  benchCpuKnn<10, PhotonNode, PackedPhoton_traits>(options, cloud, "packed", packed, queries);
+  benchCpuKnn<50, PhotonNode, PackedPhoton_traits>(options, cloud, "packed", packed, queries);
+  benchCpuKnn<100, PhotonNode, PackedPhoton_traits>(options, cloud, "packed", packed, queries);
+}
+
+/* Fixed-radius gathers need the grid's cell size to match the radius, so
+ * the grid is rebuilt per radius. That rebuild is also what a progressive
+ * pass pays. */
+void benchCpuHashGrid(const Options &options, const std::string &cloud, const std::vector<BenchPhoton> &photons) {
+  std::vector<photon_storage::PhotonRecord> records(photons.size());
+  for (size_t i = 0; i < photons.size(); i++) records[i] = {photons[i].pos, photons[i].dir, photons[i].color};
+
+  const uint32_t tableSize = hash_grid::tableSizeFor(photons.size());
+  std::vector<PhotonNode> nodes(photons.size());
+  std::vector<uint32_t> flux(photons.size());
+  std::vector<uint32_t> cellStart(tableSize + 1);
+  const auto queries = queryPoints(photons, options.numQueries, 7);
+
+  for (const float radius : GATHER_RADII) {
+    const hash_grid::HashGrid grid{cellStart.data(), tableSize, hash_grid::cellSizeFor(radius)};
+    measure(options, "cpu_hash_grid_build",
+            {{"cloud", jsonValue(cloud)}, {"photons", jsonValue(photons.size())}, {"radius", jsonValue(radius)}},
+            static_cast<double>(photons.size()), "photons/s", [&] {
+      hash_grid::build(records, grid.cellSize, tableSize, nodes.data(), cellStart.data());
+      photon_storage::packPayloads(records, nodes.data(), flux.data());
+    });
+
+    size_t found = 0;
+    measure(options, "cpu_radius_query", {{"cloud", jsonValue(cloud)}, {"radius", jsonValue(radius)}},
+            static_cast<double>(queries.size()), "queries/s", [&] {
+      found = 0;
+      for (const auto &q : queries) {
+        hash_grid::forEachInRadius(grid, nodes.data(), q, radius, [&](uint32_t, float) { found++; });
+      }
+    });
+    std::cout << "  mean photons per query: " << static_cast<double>(found) / queries.size() << std::endl;
+  }
+}
+
+/* Final gather cost with and without precomputed irradiance. The query
+ * normals are taken from the closest irradiance point beforehand so the
+ * normal check passes, as it does on real surfaces. */
+void benchCpuFinalGather(const Options &options, const std::string &cloud, const std::vector<BenchPhoton> &photons) {
+  std::vector<cpu::Photon> global(photons.size());
+  for (size_t i = 0; i < photons.size(); i++) global[i] = {photons[i].pos, photons[i].dir, photons[i].color};
+
+  cpu::PhotonMapSettings settings;
+  settings.precomputeIrradiance = true;
+  cpu::PhotonMaps maps;
+  measure(options, "cpu_precompute_irradiance", {{"cloud", jsonValue(cloud)}, {"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    maps = cpu::buildPhotonMaps(global, {}, settings);
+  });
+
+  const auto queries = queryPoints(photons, options.numQueries, 7);
+  std::vector<owl::vec3f> normals(queries.size());
+  for (size_t i = 0; i < queries.size(); i++) {
+    kdtree::CandidateList<1> closest(INFINITY);
+    kdtree::knn<kdtree::CandidateList<1>, PhotonNode, PackedPhoton_traits>(
+      closest, queries[i], maps.irradiance.nodes.data(), maps.irradiance.nodes.size());
+    normals[i] = photon_storage::direction(maps.irradiance.nodes[closest.pointID[0]]);
+  }
+
+  cpu::PhotonMaps withoutIrradiance;
+  withoutIrradiance.global = maps.global;
+  withoutIrradiance.caustic = maps.caustic;
+
+  for (const bool precomputed : {false, true}) {
+    const cpu::PhotonMaps &gatherMaps = precomputed ? maps : withoutIrradiance;
+    float checksum = 0.f;
+    measure(options, "cpu_final_gather", {{"cloud", jsonValue(cloud)}, {"precomputed", precomputed ? "true" : "false"}},
+            static_cast<double>(queries.size()), "queries/s", [&] {
+      for (size_t i = 0; i < queries.size(); i++) {
+        checksum += cpu::gatherIrradiance(gatherMaps, queries[i], normals[i], 1.f).x;
+      }
+    });
+    if (checksum < 0.f) std::cout << checksum << std::endl;
+  }
+}
+
+/* A small end-to-end CPU render of the largest scene, with and without an
+ * irradiance cache for the diffuse indirect term. */
+void benchCpuRender(const Options &options, const World &world) {
+  const cpu::Bvh bvh = cpu::buildBvh(world);
+
+  cpu::PhotonTracerSettings photonSettings{10, 20'000, 10'000, 1, 0};
+  const auto traced = cpu::tracePhotons(world, bvh, photonSettings);
+  const auto photonMaps = cpu::buildPhotonMaps(traced.global, traced.caustic);
+
+  cpu::RenderSettings settings;
+  settings.fbSize = owl::vec2i(80, 60);
+  settings.samplesPerPixel = 1;
+  settings.maxDepth = 4;
+  settings.skyColour = owl::vec3f(1.f);
+  settings.seed = 1;
+  settings.numThreads = 0;
+  const Camera camera = makeCamera(owl::vec3f(80.f, 30.f, 0.f), owl::vec3f(10.f, 20.f, 0.f),
+                                   owl::vec3f(0.f, 1.f, 0.f), 0.87f, settings.fbSize);
+  const double numPixels = static_cast<double>(settings.fbSize.x) * settings.fbSize.y;
+
+  for (const bool cached : {false, true}) {
+    size_t numRecords = 0;
+    measure(options, "cpu_render", {{"irradiance_cache", cached ? "true" : "false"}}, numPixels, "pixels/s", [&] {
+      cpu::IrradianceCache cache(bvh.nodes.front().bounds);
+      settings.irradianceCache = cached ? &cache : nullptr;
+      cpu::render(world, bvh, photonMaps, camera, settings);
+      numRecords = cache.size();
+    });
+    if (cached) std::cout << "  irradiance records: " << numRecords << std::endl;
+  }
+}
+
+/* Photon tracing and a deep-path render of the largest scene, with and
+ * without Russian roulette. Prints the rays traced per photon and per pixel,
+ * which is what the roulette saves. */
+void benchCpuRussianRoulette(const Options &options, const World &world) {
+  const cpu::Bvh bvh = cpu::buildBvh(world);
+
+  cpu::PhotonTracerSettings photonSettings{10, 20'000, 10'000, 1, 0};
+  const double numPhotons = photonSettings.castedDiffusePhotons + photonSettings.castedCausticsPhotons;
+
+  cpu::RenderSettings settings;
+  settings.fbSize = owl::vec2i(80, 60);
+  settings.samplesPerPixel = 1;
+  settings.maxDepth = 30;
+  settings.skyColour = owl::vec3f(1.f);
+  settings.seed = 1;
+  settings.numThreads = 0;
+  const Camera camera = makeCamera(owl::vec3f(80.f, 30.f, 0.f), owl::vec3f(10.f, 20.f, 0.f),
+                                   owl::vec3f(0.f, 1.f, 0.f), 0.87f, settings.fbSize);
+  const double numPixels = static_cast<double>(settings.fbSize.x) * settings.fbSize.y;
+
+  for (const int rrMinDepth : {-1, 3}) {
+    const std::string enabled = rrMinDepth >= 0 ? "true" : "false";
+    photonSettings.rrMinDepth = rrMinDepth;
+    settings.rrMinDepth = rrMinDepth;
+
+    cpu::TracedPhotons traced;
+    measure(options, "cpu_trace_photons", {{"russian_roulette", enabled}}, numPhotons, "photons/s", [&] {
+      traced = cpu::tracePhotons(world, bvh, photonSettings);
+    });
+    std::cout << "  rays per photon: " << (traced.globalRays + traced.causticRays) / numPhotons << std::endl;
+
+    const auto photonMaps = cpu::buildPhotonMaps(traced.global, traced.caustic);
+    cpu::RenderStats stats;
+    settings.stats = &stats;
+    measure(options, "cpu_render_deep", {{"russian_roulette", enabled}}, numPixels, "pixels/s", [&] {
+      cpu::render(world, bvh, photonMaps, camera, settings);
+    });
+    std::cout << "  path segments per pixel: " << stats.pathSegments / (numPixels * options.repeat) << std::endl;
+  }
+}
+
+/* Direct lighting at surface points from many random point lights, tracing
+ * a shadow ray to every light or to one light picked from a light tree. */
+void benchCpuLightSampling(const Options &options, const World &world, const std::vector<BenchPhoton> &points) {
+  const cpu::Bvh bvh = cpu::buildBvh(world);
+  const owl::box3f bounds = bvh.nodes.front().bounds;
+  const size_t numPoints = std::min(points.size(), LIGHT_SHADING_POINTS);
+
+  for (const int numLights : LIGHT_COUNTS) {
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    std::vector<LightSource> lights(numLights);
+    for (auto &light : lights) {
+      light = {};
+      light.pos = bounds.lower + owl::vec3f(u(rng), u(rng), u(rng)) * (bounds.upper - bounds.lower);
+      light.power = 100.0 * u(rng);
+      light.rgb = owl::vec3f(u(rng), u(rng), u(rng));
+    }
+
+    std::vector<light_tree::Node> tree;
+    measure(options, "light_tree_build", {{"lights", jsonValue(numLights)}}, 1.0, "builds/s", [&] {
+      tree = light_tree::build(lights);
+    });
+
+    const auto contribution = [&](const LightSource &light, const owl::vec3f &p, const owl::vec3f &n) {
+      owl::vec3f dir = light.pos - p;
+      const float distance = length(dir);
+      dir = dir / distance;
+      const float cosine = dot(dir, n);
+      if (cosine < 0.f || cpu::occluded(bvh, p, dir, 1e-3f, distance * (1.f - 1e-3f))) return 0.f;
+      return static_cast<float>(light.power) * cosine / (distance * distance) * light.rgb.x;
+    };
+
+    for (const bool useTree : {false, true}) {
+      float checksum = 0.f;
+      measure(options, "cpu_direct_light",
+              {{"lights", jsonValue(numLights)}, {"sampling", jsonValue(std::string(useTree ? "light_tree" : "all"))}},
+              static_cast<double>(numPoints), "points/s", [&] {
+        Random random;
+        random.init(0, 0);
+        for (size_t i = 0; i < numPoints; i++) {
+          const owl::vec3f &p = points[i].pos;
+          const owl::vec3f &n = points[i].dir;
+          if (!useTree) {
+            for (const auto &light : lights) checksum += contribution(light, p, n);
+            continue;
+          }
+          float pdf;
+          const int id = light_tree::sample(tree.data(), p, n, random(), pdf);
+          if (id >= 0) checksum += contribution(lights[id], p, n) / pdf;
+        }
+      });
+      if (checksum < 0.f) std::cout << checksum << std::endl;
+    }
+  }
+}
+
+/* Random lookups into the bundled wood texture through the tiled cache.
+ * The first lookup writes the tiled mip pyramid, which is timed apart. */
+void benchTextureCache(const Options &options) {
+  const std::vector<std::string> files = {options.assetsDir + "/../textures/wood.jpg"};
+
+  std::mt19937 rng(17);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+  std::vector<owl::vec2f> uvs(options.numQueries);
+  for (auto &uv : uvs) uv = owl::vec2f(u(rng), u(rng));
+
+  // an empty directory every run, so the pyramid is always rebuilt
+  const std::string directory = "benchmark_tiles";
+  measure(options, "texture_tiles_prepare", {}, 1.0, "textures/s", [&] {
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directory(directory);
+    cpu::TextureCacheSettings settings;
+    settings.directory = directory;
+    cpu::TextureCache cache(files, settings);
+    cache.sample(0, owl::vec2f(0.5f), 0.f);
+  });
+
+  for (const size_t budget : TEXTURE_BUDGETS) {
+    for (const float footprint : TEXTURE_FOOTPRINTS) {
+      cpu::TextureCacheSettings settings;
+      settings.memoryBudget = budget;
+      settings.directory = directory;
+      cpu::TextureCache cache(files, settings);
+
+      owl::vec3f checksum(0.f);
+      measure(options, "texture_sample", {{"budget_kib", jsonValue(budget >> 10)}, {"footprint", jsonValue(footprint)}},
+              static_cast<double>(uvs.size()), "lookups/s", [&] {
+        for (const auto &uv : uvs) checksum += cache.sample(0, uv, footprint);
+      });
+      if (checksum.x < 0.f) std::cout << checksum.x << std::endl;
+
+      const auto &stats = cache.stats();
+      const uint64_t fetches = stats.tileHits + stats.tileMisses;
+      std::cout << "  tile hit rate: " << (fetches ? 100.0 * stats.tileHits / fetches : 0.0) << "%, resident: "
+                << (cache.residentBytes() >> 10) << " KiB" << std::endl;
+    }
+  }
+}
+
+void benchPhotonFile(const Options &options, const std::vector<BenchPhoton> &photons) {
+  const std::string filename = "benchmark_photons.txt";
+
+  measure(options, "photon_file_write", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    photon_file::write(photons.data(), photons.size(), filename);
+  });
+
+  // fed in launch-sized batches, as the photon mapper does
+  const size_t batch = 1 << 16;
+  measure(options, "photon_file_write_async", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    photon_file::AsyncWriter<BenchPhoton> writer(filename);
+    for (size_t i = 0; i < photons.size(); i += batch) {
+      writer.write(photons.data() + i, std::min(batch, photons.size() - i));
+    }
+  });
+
+  size_t numRead = 0;
+  measure(options, "photon_file_read", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    numRead = photon_file::read<BenchPhoton>(filename).size();
+  });
+
+  measure(options, "photon_file_read_serial", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    numRead = photon_file::read<BenchPhoton>(filename, 1).size();
+  });
+
+  if (numRead != photons.size()) {
+    std::cerr << "photon_file round trip lost photons: " << numRead << " of " << photons.size() << std::endl;
+  }
+
+  const std::string binaryFilename = "benchmark_photons.bin";
+  measure(options, "photon_file_write_binary", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    photon_file::writeBinary(photons.data(), photons.size(), binaryFilename);
+  });
+
+  measure(options, "photon_file_read_binary", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    numRead = photon_file::read<BenchPhoton>(binaryFilename).size();
+  });
+
+  if (numRead != photons.size()) {
+    std::cerr << "binary photon_file round trip lost photons: " << numRead << " of " << photons.size() << std::endl;
+  }
+  std::remove(filename.c_str());
+  std::remove(binaryFilename.c_str());
+}
+
+/* Chunked photon map gathers at several cache budgets, against the in-memory map. */
+void benchChunkedPhotonMap(const Options &options, const std::vector<BenchPhoton> &photons) {
+  const std::string filename = "benchmark_photons.pchk";
+  std::vector<photon_storage::PhotonRecord> records(photons.size());
+  for (size_t i = 0; i < photons.size(); i++) records[i] = {photons[i].pos, photons[i].dir, photons[i].color};
+  const cpu::PhotonSource source = [&](const auto &fn) { for (const auto &record : records) fn(record); };
+
+  measure(options, "chunked_photon_map_write", {{"photons", jsonValue(photons.size())}},
+          static_cast<double>(photons.size()), "photons/s", [&] {
+    cpu::writeChunkedPhotonMap(source, filename);
+  });
+
+  const auto queries = queryPoints(photons, options.numQueries, 11);
+  cpu::PhotonMap inMemory;
+  cpu::rebuildPhotonMap(records, inMemory);
+  owl::vec3f reference(0.f);
+  measure(options, "chunked_photon_map_gather", {{"budget_mib", jsonValue(std::string("in_memory"))}},
+          static_cast<double>(queries.size()), "queries/s", [&] {
+    for (const auto &q : queries) reference += cpu::gatherPhotons(inMemory, q, owl::vec3f(0.f, 1.f, 0.f), 1.f);
+  });
+  if (reference.x < 0.f) std::cout << reference.x << std::endl;
+
+  for (const size_t budget : PHOTON_CHUNK_BUDGETS) {
+    cpu::ChunkedPhotonMapSettings settings;
+    settings.memoryBudget = budget;
+    cpu::ChunkedPhotonMap map(filename, settings);
+
+    owl::vec3f checksum(0.f);
+    measure(options, "chunked_photon_map_gather", {{"budget_mib", jsonValue(budget >> 20)}},
+            static_cast<double>(queries.size()), "queries/s", [&] {
+      for (const auto &q : queries) checksum += map.gather(q, 1.f);
+    });
+    if (checksum.x < 0.f) std::cout << checksum.x << std::endl;
+
+    const auto &stats = map.stats();
+    const uint64_t fetches = stats.chunkHits + stats.chunkMisses;
+    std::cout << "  chunks: " << map.numChunks() << ", chunk hit rate: "
+              << (fetches ? 100.0 * stats.chunkHits / fetches : 0.0) << "%, resident: "
+              << (map.residentBytes() >> 10) << " KiB" << std::endl;
+  }
+  std::remove(filename.c_str());
+}
+
+/* The viewer's host-side projection of a photon map from a camera inside
+ * the cloud, on one worker and on all of them. Most photons are culled. */
+void benchPhotonProjection(const Options &options, const std::vector<BenchPhoton> &source) {
+  std::vector<Photon> photons(source.size());
+  for (size_t i = 0; i < source.size(); i++) {
+    photons[i].pos = source[i].pos;
+    photons[i].dir = source[i].dir;
+    photons[i].color = source[i].color;
+  }
+
+  const owl::vec2i size(1920, 1080);
+  const auto projection = glm::perspective(0.8f, size.x / static_cast<float>(size.y), 0.1f, 1000.f)
+                        * glm::lookAt(glm::vec3(0.f, 0.f, 40.f), glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f));
+
+  for (const int workers : {1, 0}) {
+    size_t numVisible = 0;
+    measure(options, "photon_projection", {{"workers", jsonValue(parallel::numWorkers(workers))}},
+            static_cast<double>(photons.size()), "photons/s", [&] {
+      numVisible = photon_projection::projectVisible(photons, projection, size, workers).size();
+    });
+    std::cout << "  visible: " << numVisible << " of " << photons.size() << std::endl;
+  }
+}
+
+/* The CPU viewer path: the scene's depth buffer is rasterised once, then
+ * photons on its surfaces are depth tested and splatted in each mode. The
+ * camera looks at the cloud from outside its bounds. */
+void benchPhotonSplatting(const Options &options, const World &world, const std::vector<BenchPhoton> &source) {
+  std::vector<Photon> photons(source.size());
+  owl::box3f bounds;
+  for (size_t i = 0; i < source.size(); i++) {
+    photons[i].pos = source[i].pos;
+    photons[i].dir = source[i].dir;
+    photons[i].color = source[i].color;
+    bounds.extend(source[i].pos);
+  }
+
+  const owl::vec2i size(1920, 1080);
+  const owl::vec3f center = bounds.center();
+  const owl::vec3f from = center + owl::vec3f(0.f, 0.f, 2.f * length(bounds.span()));
+  const auto projection = glm::perspective(0.8f, size.x / static_cast<float>(size.y), 0.1f, 1000.f)
+                        * glm::lookAt(glm::vec3(from.x, from.y, from.z), glm::vec3(center.x, center.y, center.z), glm::vec3(0.f, 1.f, 0.f));
+
+  std::unique_ptr<cpu::DepthBuffer> depthBuffer;
+  measure(options, "depth_rasterise", {{"triangles", jsonValue(numInstancedTriangles(world))}},
+          static_cast<double>(numInstancedTriangles(world)), "triangles/s", [&] {
+    depthBuffer = std::make_unique<cpu::DepthBuffer>(world, projection, size);
+  });
+
+  const std::pair<std::string, cpu::SplatMode> modes[] = {
+    {"color", cpu::SPLAT_COLOR}, {"density", cpu::SPLAT_DENSITY}, {"heat", cpu::SPLAT_HEATMAP},
+  };
+  for (const auto &[name, mode] : modes) {
+    cpu::SplatSettings settings;
+    settings.mode = mode;
+    size_t lit = 0;
+    measure(options, "photon_splat", {{"mode", jsonValue(name)}}, static_cast<double>(photons.size()), "photons/s", [&] {
+      const auto image = cpu::splatPhotons(*depthBuffer, photons, settings);
+      lit = std::count_if(image.begin(), image.end(), [](uint32_t p) { return (p & 0xffffffu) != 0; });
+    });
+    std::cout << "  lit pixels: " << lit << std::endl;
+  }
+}
+
+/* ------------------------------------------------------------------ */
+/* GPU benchmarks (production cukd path), skipped without a device    */
+/* ------------------------------------------------------------------ */
+
+template<int K>
+__global__ void gpuKnnKernel(const float3 *queries, int numQueries,
+                             const PhotonNode *photons, int numPhotons,
+                             float maxRadius, float *radii) {
+  const int tid = blockIdx.x * blockDim.x + threadIdx.x;
+  if (tid >= numQueries) return;
+
+  cukd::HeapCandidateList<K> closest(maxRadius);
+  radii[tid] = cukd::stackBased::knn<cukd::HeapCandidateList<K>, PhotonNode, PhotonNode_traits>(
+    closest, queries[tid], photons, numPhotons);
+}
+
+template<int K>
+void benchGpuKnn(const Options &options, const std::string &cloud,
+                 const PhotonNode *photons, int numPhotons,
+                 const float3 *queries, int numQueries, float *radii) {
+  for (const float radius : KNN_RADII) {
+    measure(options, "gpu_knn",
+            {{"cloud", jsonValue(cloud)}, {"k", jsonValue(K)}, {"radius", jsonValue(radius)}},
+            static_cast<double>(numQueries), "queries/s", [&] {
+      const int blockSize = 128;
+      gpuKnnKernel<K><<<(numQueries + blockSize - 1) / blockSize, blockSize>>>(
+        queries, numQueries, photons, numPhotons, radius, radii);
+      CUKD_CUDA_CALL(DeviceSynchronize());
+    });
+  }
+}
+
+void benchGpuPhotonMap(const Options &options, const std::string &cloud, const std::vector<BenchPhoton> &source) {
+  const int numPhotons = static_cast<int>(source.size());
+  const int numQueries = static_cast<int>(options.numQueries);
+
+  std::vector<photon_storage::PhotonRecord> records(numPhotons);
+  for (int i = 0; i < numPhotons; i++) records[i] = {source[i].pos, source[i].dir, source[i].color};
+
+  PhotonNode *photons = nullptr;
+  uint32_t *flux = nullptr;
+  float3 *queries = nullptr;
+  float *radii = nullptr;
+  cukd::box_t<float3> *bounds = nullptr;
+  CUKD_CUDA_CALL(MallocManaged((void **)&photons, numPhotons * sizeof(PhotonNode)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&flux, numPhotons * sizeof(uint32_t)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&queries, numQueries * sizeof(float3)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&radii, numQueries * sizeof(float)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&bounds, sizeof(*bounds)));
+
+  const auto hostQueries = queryPoints(source, numQueries, 7);
+  for (int i = 0; i < numQueries; i++) queries[i] = hostQueries[i];
+
+  measure(options, "gpu_kdtree_build", {{"cloud", jsonValue(cloud)}, {"photons", jsonValue(numPhotons)}},
+          static_cast<double>(numPhotons), "photons/s", [&] {
+    photon_storage::prepareNodes(records, photons);
+    cukd::buildTree<PhotonNode, PhotonNode_traits>(photons, numPhotons, bounds);
+    CUKD_CUDA_CALL(DeviceSynchronize());
+    photon_storage::packPayloads(records, photons, flux);
+  });
+
+  benchGpuKnn<10>(options, cloud, photons, numPhotons, queries, numQueries, radii);
+  benchGpuKnn<50>(options, cloud, photons, numPhotons, queries, numQueries, radii);
+  benchGpuKnn<100>(options, cloud, photons, numPhotons, queries, numQueries, radii);
+
+  CUKD_CUDA_CALL(Free(photons));
+  CUKD_CUDA_CALL(Free(flux));
+  CUKD_CUDA_CALL(Free(queries));
+  CUKD_CUDA_CALL(Free(radii));
+  CUKD_CUDA_CALL(Free(bounds));
+}
+
+/* ------------------------------------------------------------------ */
+
+Options parseOptions(int ac, char **av) {
+  Options options;
+  for (int i = 1; i < ac; i++) {
+    const std::string arg = av[i];
+    if (i + 1 >= ac) throw std::runtime_error("Missing value for " + arg);
+    const std::string value = av[++i];
+
+    if (arg == "--assets") options.assetsDir = value;
+    else if (arg == "--output") options.output = value;
+    else if (arg == "--photons") options.numPhotons = std::stoull(value);
+    else if (arg == "--queries") options.numQueries = std::stoull(value);
+    else if (arg == "--repeat") options.repeat = std::max(1, std::stoi(value));
+    else throw std::runtime_error("Unknown option " + arg);
+  }
+  return options;
+}
+
+int main(int ac, char **av)
+{
+  const Options options = parseOptions(ac, av);
+
+  int numDevices = 0;
+  const bool gpuAvailable = cudaGetDeviceCount(&numDevices) == cudaSuccess && numDevices > 0;
+
+  std::unique_ptr<World> world;
+  benchImport(options, world);
+  benchCpuInstancing(options, *world);
+  benchTriangleNormals(options, *world);
+
+  const std::vector<std::pair<std::string, std::vector<BenchPhoton>>> clouds = {
+    {"uniform", uniformCloud(options.numPhotons, 1)},
+    {"surface", surfaceCloud(*world, options.numPhotons, 2)},
+  };
+
+  for (const auto &[name, photons] : clouds) {
+    benchCpuPhotonMap(options, name, photons);
+    benchCpuHashGrid(options, name, photons);
+    benchCpuFinalGather(options, name, photons);
+    if (gpuAvailable) benchGpuPhotonMap(options, name, photons);
+  }
+
+  benchPhotonFile(options, clouds.back().second);
+  benchChunkedPhotonMap(options, clouds.back().second);
+  benchPhotonProjection(options, clouds.front().second);
+  benchPhotonSplatting(options, *world, clouds.back().second);
+  benchTextureCache(options);
+  benchCpuLightSampling(options, *world, clouds.back().second);
+  benchCpuRender(options, *world);
+  benchCpuRussianRoulette(options, *world);
+
+  writeResults(options, gpuAvailable);
+  return 0;
+}
@@ -1,40 +1,153 @@
 #include "assetImporter.h"
 
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <queue>
 #include <set>
+#include <unordered_map>
 
 #include "mesh.h"
+#include "parallel.h"
+#include "trace.h"
+#include "vertexAttributes.h"
 #include "../../externals/assimp/include/assimp/scene.h"
 #include "../../externals/assimp/include/assimp/postprocess.h"
 
-static std::vector<Mesh> extract_objects(const aiScene*);
-static void assign_materials(std::vector<Mesh>&,const std::string&);
+static void extract_objects(const aiScene*, World&);
+static void assign_materials(World&,const std::string&);
 static std::vector<LightSource> extract_lights(std::string&);
 
 std::unique_ptr<World> assets::import_scene(Assimp::Importer* importer, std::string& path) {
+  TRACE_SCOPE("import_scene");
   std::unique_ptr<World> world(new World);
-  const aiScene *scene = importer->ReadFile(path,
-                                            aiProcess_Triangulate
-                                            | aiProcess_JoinIdenticalVertices
-                                            | aiProcess_SortByPType);
+  const aiScene *scene;
+  {
+    TRACE_SCOPE("assimp ReadFile");
+    scene = importer->ReadFile(path,
+                               aiProcess_Triangulate
+                               | aiProcess_JoinIdenticalVertices
+                               | aiProcess_SortByPType);
+  }
 
   assert(scene != nullptr);
 
-  world->meshes = extract_objects(scene);
+  extract_objects(scene, *world);
   world->light_sources = extract_lights(path);
-  assign_materials(world->meshes, path);
+  assign_materials(*world, path);
 
 
   return world;
 }
 
-static std::vector<Mesh> extract_objects(const aiScene *scene) {
+/* Exact vertex position, with -0 folded into +0 so it compares like the
+ * floats themselves, plus the packed normal and UV if the mesh has them. */
+struct VertexKey {
+  uint32_t bits[5];
+
+  VertexKey(const owl::vec3f &v, uint32_t normal, uint32_t uv) {
+    const float folded[3] = {v.x + 0.f, v.y + 0.f, v.z + 0.f};
+    std::memcpy(bits, folded, sizeof(folded));
+    bits[3] = normal;
+    bits[4] = uv;
+  }
+
+  bool operator==(const VertexKey &other) const {
+    return std::memcmp(bits, other.bits, sizeof(bits)) == 0;
+  }
+};
+
+struct VertexKeyHash {
+  size_t operator()(const VertexKey &key) const {
+    return (key.bits[0] * 73856093u) ^ (key.bits[1] * 19349663u) ^ (key.bits[2] * 83492791u)
+         ^ (key.bits[3] * 2654435761u) ^ (key.bits[4] * 40503u);
+  }
+};
+
+static owl::affine3f to_affine(const aiMatrix4x4 &m) {
+  owl::affine3f transform;
+  transform.l.vx = owl::vec3f(m.a1, m.b1, m.c1);
+  transform.l.vy = owl::vec3f(m.a2, m.b2, m.c2);
+  transform.l.vz = owl::vec3f(m.a3, m.b3, m.c3);
+  transform.p = owl::vec3f(m.a4, m.b4, m.c4);
+  return transform;
+}
+
+/* Indexes the object space vertices of one mesh, sharing vertices with
+ * identical positions in order of first use. Normals and the first UV
+ * channel are kept, packed, if the mesh has them; vertices are then only
+ * shared where the packed attributes match too. */
+static Mesh extract_mesh(const aiScene *scene, const aiMesh *current_mesh) {
+  TRACE_SCOPE("extract mesh", "worker");
+  const bool has_normals = current_mesh->HasNormals();
+  const bool has_uvs = current_mesh->HasTextureCoords(0);
+
+  std::vector<owl::vec3f> verts;
+  std::vector<uint32_t> normals, uvs;
+  std::vector<owl::vec3i> idx;
+  std::unordered_map<VertexKey, int, VertexKeyHash> vertex_ids;
+  idx.reserve(current_mesh->mNumFaces);
+  vertex_ids.reserve(current_mesh->mNumVertices);
+
+  for (int j = 0; j < current_mesh->mNumFaces; j++) { // for each face in the mesh
+    const auto current_face = current_mesh->mFaces[j];
+    std::vector<int> face_indices;
+
+    for (int k = 0; k < current_face.mNumIndices; k++) { // for each index (vertex) in the face
+      const unsigned vertex = current_face.mIndices[k];
+      const auto current_vert = current_mesh->mVertices[vertex];
+      auto vertex_pos = owl::vec3f(current_vert.x, current_vert.y, current_vert.z);
+
+      uint32_t normal = 0, uv = 0;
+      if (has_normals) {
+        const auto n = current_mesh->mNormals[vertex];
+        normal = vertex_attributes::encodeNormal(normalize(owl::vec3f(n.x, n.y, n.z)));
+      }
+      if (has_uvs) {
+        const auto t = current_mesh->mTextureCoords[0][vertex];
+        uv = vertex_attributes::encodeUV(owl::vec2f(t.x, t.y));
+      }
+
+      const auto [it, inserted] = vertex_ids.emplace(VertexKey(vertex_pos, normal, uv), static_cast<int>(verts.size()));
+      if (inserted) {
+        verts.emplace_back(vertex_pos);
+        if (has_normals) normals.push_back(normal);
+        if (has_uvs) uvs.push_back(uv);
+      }
+      face_indices.push_back(it->second);
+    }
+    // if current_face.mNumIndices != 3, we're in deep shit.
+    assert(face_indices.size() == 3);
+    idx.emplace_back(
+            face_indices.at(0),
+            face_indices.at(1),
+            face_indices.at(2)
+    );
+  }
+  Mesh output_mesh;
+  output_mesh.vertices = std::move(verts);
+  output_mesh.indices = std::move(idx);
+  output_mesh.normals = std::move(normals);
+  output_mesh.uvs = std::move(uvs);
+
+  aiString name;
+  const auto material_idx = current_mesh->mMaterialIndex;
+  scene->mMaterials[material_idx]->Get(AI_MATKEY_NAME,name);
+  output_mesh.name = name.C_Str();
+  return output_mesh;
+}
+
+/* Walks the node hierarchy breadth-first. Every node reference becomes an
+ * instance with the node's accumulated transform; every referenced aiMesh
+ * becomes one prototype, numbered in order of its first reference and
+ * extracted in parallel. */
+static void extract_objects(const aiScene *scene, World &world) {
+  TRACE_SCOPE("extract_objects");
   std::queue<std::pair<aiNode*, aiMatrix4x4>> unprocessed_nodes;
   unprocessed_nodes.emplace(scene->mRootNode, aiMatrix4x4());
 
-  std::vector<Mesh> meshes;
+  std::vector<const aiMesh*> prototypes;
+  std::unordered_map<unsigned, int> prototype_ids;
 
   while (!unprocessed_nodes.empty()) { // for each node in the hierarchy
     const auto [current_node, curr_transform] = unprocessed_nodes.front();
@@ -48,59 +161,25 @@ static std::vector<Mesh> extract_objects(const aiScene *scene) {
     }
 
     for (int i = 0; i < current_node->mNumMeshes; i++) { // for each mesh in the node
-      const auto current_mesh = scene->mMeshes[current_node->mMeshes[i]];
-      std::vector<owl::vec3f> verts;
-      int vert_count = 0;
-      std::vector<owl::vec3i> idx;
-
-      for (int j = 0; j < current_mesh->mNumFaces; j++) { // for each face in the mesh
-        const auto current_face = current_mesh->mFaces[j];
-        std::vector<int> face_indices;
-
-        for (int k = 0; k < current_face.mNumIndices; k++) { // for each index (vertex) in the face
-          const auto current_vert = current_mesh->mVertices[current_face.mIndices[k]];
-          auto transformed_vertex = transform * current_vert;
-          auto vertex_pos = owl::vec3f(transformed_vertex.x, transformed_vertex.y, transformed_vertex.z);
-
-          auto vertex_position_in_verts = std::find(verts.begin(), verts.end(), vertex_pos);
-          if (vertex_position_in_verts == std::end(verts)) { // vertex is not already in `verts` collection.
-            verts.emplace_back(vertex_pos);
-            face_indices.push_back(vert_count++);
-            continue;
-          }
-          const auto numeric_position = distance(verts.begin(), vertex_position_in_verts); // NOLINT(*-narrowing-conversions)
-
-          face_indices.push_back(numeric_position); // NOLINT(*-narrowing-conversions)
-        }
-        // if current_face.mNumIndices != 3, we're in deep shit.
-        assert(face_indices.size() == 3);
-        idx.emplace_back(
-                face_indices.at(0),
-                face_indices.at(1),
-                face_indices.at(2)
-        );
-      }
-      Mesh output_mesh;
-      output_mesh.vertices = verts;
-      output_mesh.indices = idx;
-
-      aiString name;
-      const auto material_idx = current_mesh->mMaterialIndex;
-      scene->mMaterials[material_idx]->Get(AI_MATKEY_NAME,name);
-      output_mesh.name = name.C_Str();
-
-      meshes.push_back(output_mesh);
+      const unsigned scene_mesh = current_node->mMeshes[i];
+      const auto [it, inserted] = prototype_ids.emplace(scene_mesh, static_cast<int>(prototypes.size()));
+      if (inserted) prototypes.push_back(scene->mMeshes[scene_mesh]);
+      world.instances.push_back({it->second, to_affine(transform)});
     }
   }
-  return meshes;
+
+  world.meshes.resize(prototypes.size());
+  parallel::forEach(prototypes.size(), [&](size_t i) {
+    world.meshes[i] = extract_mesh(scene, prototypes[i]);
+  });
 }
 
 static std::vector<LightSource> extract_lights(std::string& path) {
+  TRACE_SCOPE("extract_lights");
   const std::size_t last_slash = path.find_last_of("/\\");
   const auto base_path = path.substr(0,last_slash);
 
   auto full_path = base_path + "/lights.txt";
-  std::replace(full_path.begin(), full_path.end(), '/', '\\');
 
   std::vector<LightSource> lightSources;
   std::ifstream file(full_path);
@@ -133,7 +212,9 @@ static std::vector<LightSource> extract_lights(std::string& path) {
   return lightSources;
 }
 
-using MaterialProperties = std::tuple<owl::vec3f, float, float, float, float>;
+/* albedo, diffuse, specular, transmission, ior and an optional albedo
+ * texture, empty or relative to the .mtl file */
+using MaterialProperties = std::tuple<owl::vec3f, float, float, float, float, std::string>;
 using MaterialMap = std::map<std::string, MaterialProperties>;
 
 static MaterialMap readMaterialFile(const std::string& path) {
@@ -141,7 +222,8 @@ static MaterialMap readMaterialFile(const std::string& path) {
   const auto base_path = path.substr(0,last_dot);
 
   std::string filename = base_path + ".mtl";
-  std::replace(filename.begin(), filename.end(), '/', '\\');
+  const std::size_t last_slash = path.find_last_of("/\\");
+  const auto base_dir = last_slash == std::string::npos ? std::string() : path.substr(0, last_slash + 1);
 
   MaterialMap materials_map;
   std::ifstream file(filename);
@@ -164,7 +246,9 @@ static MaterialMap readMaterialFile(const std::string& path) {
 
     if (iss >> name >> albedo_r >> albedo_g >> albedo_b >> diffuse >> specular >> transmission >> refraction_idx) {
       auto albedo = owl::vec3f(albedo_r, albedo_g, albedo_b);
-      materials_map[name] = std::make_tuple(albedo, diffuse, specular, transmission, refraction_idx);
+      std::string texture;
+      if (iss >> texture) texture = base_dir + texture;
+      materials_map[name] = std::make_tuple(albedo, diffuse, specular, transmission, refraction_idx, texture);
     } else {
       std::cerr << "Warning: Invalid line format: " << line << std::endl;
     }
@@ -174,7 +258,11 @@ static MaterialMap readMaterialFile(const std::string& path) {
   return materials_map;
 }
 
-static void assign_materials(std::vector<Mesh>& meshes, const std::string& path) {
+/* Interns the materials into world.materials in order of first use, so
+ * meshes sharing a material name (and all meshes without one) share one
+ * table entry. */
+static void assign_materials(World& world, const std::string& path) {
+  TRACE_SCOPE("assign_materials");
   using namespace owl;
 
   const MaterialMap mat_map = readMaterialFile(path);
@@ -185,21 +273,42 @@ static void assign_materials(std::vector<Mesh>& meshes, const std::string& path)
   default_material.specular = 0.f;
   default_material.transmission = 0.f;
   default_material.refraction_idx = 0.f;
+  default_material.albedoTexture = -1;
+
+  world.materials.clear();
+  world.textures.clear();
+  // the default material is keyed by the empty name, which .mtl lines can't have
+  std::unordered_map<std::string, uint32_t> material_ids;
+  std::unordered_map<std::string, int> texture_ids;
+
+  for (auto& mesh : world.meshes) {
+    const auto entry = mat_map.find(mesh.name);
+    const std::string key = entry == mat_map.end() ? std::string() : mesh.name;
 
-  /* Unsure if structured bindings are a good idea here */
-  for (auto & [name, _v, _i, material]: meshes) {
-    if (mat_map.count(name) == 0) {
-      material = std::make_shared<Material>(default_material);
+    const auto [id, inserted] = material_ids.try_emplace(key, static_cast<uint32_t>(world.materials.size()));
+    mesh.materialID = id->second;
+    if (!inserted) continue;
+
+    if (entry == mat_map.end()) {
+      world.materials.push_back(default_material);
       continue;
     }
 
-    auto current_mat = mat_map.at(name);
+    const auto& current_mat = entry->second;
     Material mesh_mat;
     mesh_mat.albedo = std::get<0>(current_mat);
     mesh_mat.diffuse = std::get<1>(current_mat);
     mesh_mat.specular = std::get<2>(current_mat);
     mesh_mat.transmission = std::get<3>(current_mat);
     mesh_mat.refraction_idx = std::get<4>(current_mat);
-    material = std::make_shared<Material>(mesh_mat);
+    mesh_mat.albedoTexture = -1;
+
+    const auto& texture = std::get<5>(current_mat);
+    if (!texture.empty()) {
+      const auto [texture_id, new_texture] = texture_ids.try_emplace(texture, static_cast<int>(world.textures.size()));
+      if (new_texture) world.textures.push_back(texture);
+      mesh_mat.albedoTexture = texture_id->second;
+    }
+    world.materials.push_back(mesh_mat);
   }
 }
\ No newline at end of file
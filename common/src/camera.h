@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cmath>
 #include <owl/common/math/vec.h>
 
 struct Camera {
@@ -7,4 +8,17 @@ struct Camera {
     owl::vec3f dir_00; // out-of-screen
     owl::vec3f dir_du; // left-to-right
     owl::vec3f dir_dv; // bottom-to-top
-};
\ No newline at end of file
+};
+
+inline Camera makeCamera(const owl::vec3f &lookFrom, const owl::vec3f &lookAt, const owl::vec3f &lookUp,
+                         float fovy, const owl::vec2i &fbSize) {
+    Camera camera;
+    const float aspect = fbSize.x / static_cast<float>(fbSize.y);
+    const float cosFovy = std::cos(fovy);
+    camera.pos = lookFrom;
+    camera.dir_00 = normalize(lookAt-lookFrom);
+    camera.dir_du = cosFovy * aspect * normalize(cross(camera.dir_00, lookUp));
+    camera.dir_dv = cosFovy * normalize(cross(camera.dir_du, camera.dir_00));
+    camera.dir_00 -= 0.5f * (camera.dir_du + camera.dir_dv);
+    return camera;
+}
\ No newline at end of file
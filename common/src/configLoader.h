@@ -2,6 +2,9 @@
 
 #include <iostream>
 #include "toml.hpp"
+#include "trace.h"
+#include "hashGrid.h"
+#include "lightTree.h"
 
 #define CONFIG_PATH "../config.toml"
 
@@ -26,4 +29,28 @@ inline owl::vec2i toml_to_vec2i(const toml::value &cfg) {
 inline owl::vec3f toml_to_vec3f(const toml::value &cfg) {
     const auto& arr = cfg.as_array();
     return { (float)arr[0].as_floating(), (float)arr[1].as_floating(),(float)arr[2].as_floating() };
-}
\ No newline at end of file
+}
+
+/* Trace capture is opt-in: set [trace] output_filename to get a Chrome
+ * trace-event JSON of the run. */
+inline void start_trace_from_config(const toml::value &cfg) {
+  const auto trace_filename = toml::find_or<std::string>(cfg, "trace", "output_filename", "");
+  if (trace_filename.empty()) return;
+
+  trace::start(trace_filename);
+  trace::setThreadName("main");
+}
+
+/* "kd_tree" (K nearest photons) or "hash_grid" (fixed gather radius). */
+inline hash_grid::PhotonLookup parse_photon_lookup(const std::string &name) {
+  if (name == "hash_grid") return hash_grid::HASH_GRID;
+  if (name != "kd_tree") std::cerr << "Unknown photon_lookup \"" << name << "\", using kd_tree\n";
+  return hash_grid::KD_TREE;
+}
+
+/* "all" (a shadow ray to every light) or "light_tree" (importance sampled). */
+inline light_tree::LightSampling parse_light_sampling(const std::string &name) {
+  if (name == "light_tree") return light_tree::LIGHT_TREE;
+  if (name != "all") std::cerr << "Unknown light_sampling \"" << name << "\", using all\n";
+  return light_tree::ALL_LIGHTS;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "photonStorage.h"
+
+/* Hashed uniform grid photon map for fixed-radius gathers.
+ *
+ * Photons are counting-sorted by the hash of their grid cell, so every hash
+ * bucket is a contiguous range [cellStart[b], cellStart[b+1]) of the node
+ * array. The nodes and flux use the same packed layout as the KD-tree maps
+ * (common/src/photonStorage.h), just in bucket order instead of tree order.
+ *
+ * With the cell size set to twice the gather radius a query touches at most
+ * 2x2x2 cells. Building is O(N) and only writes into the caller's buffers,
+ * so progressive passes can rebuild without reallocating.
+ */
+namespace hash_grid {
+    enum PhotonLookup {
+        KD_TREE = 0,
+        HASH_GRID = 1
+    };
+
+    struct HashGrid {
+        /* tableSize + 1 entries */
+        const uint32_t* cellStart;
+        uint32_t tableSize;
+        float cellSize;
+    };
+
+    inline __both__ owl::vec3i cellOf(const owl::vec3f& p, float cellSize) {
+        return owl::vec3i(static_cast<int>(floorf(p.x / cellSize)),
+                          static_cast<int>(floorf(p.y / cellSize)),
+                          static_cast<int>(floorf(p.z / cellSize)));
+    }
+
+    /* Teschner et al. spatial hash; tableSize is a power of two. */
+    inline __both__ uint32_t hashCell(const owl::vec3i& cell, uint32_t tableSize) {
+        const uint32_t h = (static_cast<uint32_t>(cell.x) * 73856093u)
+                         ^ (static_cast<uint32_t>(cell.y) * 19349663u)
+                         ^ (static_cast<uint32_t>(cell.z) * 83492791u);
+        return h & (tableSize - 1);
+    }
+
+    /* Two buckets per photon keeps collisions between neighbouring cells
+     * rare without making the table dominate the memory use. */
+    inline uint32_t tableSizeFor(size_t numPhotons) {
+        uint32_t size = 1;
+        while (size < 2 * numPhotons && size < (1u << 31)) size <<= 1;
+        return size;
+    }
+
+    inline float cellSizeFor(float gatherRadius) {
+        return 2.f * gatherRadius;
+    }
+
+    /* Counting sort of `records` into `nodes` (records.size() entries) and
+     * `cellStart` (tableSize + 1 entries). Node meta holds the record index,
+     * ready for photon_storage::packPayloads. */
+    inline void build(const std::vector<photon_storage::PhotonRecord>& records, float cellSize, uint32_t tableSize,
+                      photon_storage::PhotonNode* nodes, uint32_t* cellStart) {
+        std::vector<uint32_t> bucket(records.size());
+        for (uint32_t b = 0; b <= tableSize; b++) cellStart[b] = 0;
+
+        for (size_t i = 0; i < records.size(); i++) {
+            bucket[i] = hashCell(cellOf(records[i].pos, cellSize), tableSize);
+            cellStart[bucket[i] + 1]++;
+        }
+        for (uint32_t b = 0; b < tableSize; b++) cellStart[b + 1] += cellStart[b];
+
+        // scatter, using cellStart[b] as the insertion cursor of bucket b
+        for (size_t i = 0; i < records.size(); i++) {
+            const uint32_t slot = cellStart[bucket[i]]++;
+            nodes[slot].pos = records[i].pos;
+            nodes[slot].meta = static_cast<uint32_t>(i);
+        }
+        // the cursors now hold the end of each bucket, i.e. the next start
+        for (uint32_t b = tableSize; b > 0; b--) cellStart[b] = cellStart[b - 1];
+        cellStart[0] = 0;
+    }
+
+    /* Calls fn(index, distance squared) for every photon within `radius` of
+     * `query`, which must not exceed half the cell size. Cells that hash to
+     * an already visited bucket are skipped so no photon is reported twice. */
+    template<typename Fn>
+    inline __both__ void forEachInRadius(const HashGrid& grid, const photon_storage::PhotonNode* nodes,
+                                         const owl::vec3f& query, float radius, Fn&& fn) {
+        const owl::vec3i lo = cellOf(query - owl::vec3f(radius), grid.cellSize);
+        const owl::vec3i hi = cellOf(query + owl::vec3f(radius), grid.cellSize);
+        const float radius2 = radius * radius;
+
+        uint32_t visited[8];
+        int numVisited = 0;
+
+        for (int z = lo.z; z <= hi.z; z++) {
+            for (int y = lo.y; y <= hi.y; y++) {
+                for (int x = lo.x; x <= hi.x; x++) {
+                    const uint32_t b = hashCell(owl::vec3i(x, y, z), grid.tableSize);
+
+                    bool seen = false;
+                    for (int v = 0; v < numVisited; v++) seen |= visited[v] == b;
+                    if (seen) continue;
+                    if (numVisited < 8) visited[numVisited++] = b;
+
+                    for (uint32_t i = grid.cellStart[b]; i < grid.cellStart[b + 1]; i++) {
+                        const owl::vec3f d = nodes[i].pos - query;
+                        const float dist2 = dot(d, d);
+                        if (dist2 <= radius2) fn(i, dist2);
+                    }
+                }
+            }
+        }
+    }
+}
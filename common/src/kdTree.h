@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "owl/common/math/box.h"
+
+/* Host-side photon KD-tree.
+ *
+ * The tree uses the same implicit, left-balanced layout as cudaKDTree: the
+ * data array itself is the tree, node i has children 2i+1 and 2i+2, and
+ * every node stores the dimension it was split along. This lets the CPU
+ * paths (benchmarks, reference renderer) query photon maps without a GPU.
+ *
+ * `Traits` follows the cukd convention:
+ *   static owl::vec3f get_point(const T&);
+ *   static int  get_dim(const T&);
+ *   static void set_dim(T&, int);
+ */
+namespace kdtree {
+    /* Number of nodes in the subtree rooted at `node` of an n-node tree. */
+    inline size_t subtreeSize(size_t node, size_t n) {
+        size_t size = 0;
+        size_t first = node;
+        size_t count = 1;
+        while (first < n) {
+            size += std::min(count, n - first);
+            first = 2 * first + 1;
+            count *= 2;
+        }
+        return size;
+    }
+
+    template<typename T, typename Traits>
+    void buildRecursive(T* tree, size_t node, size_t n, T* begin, T* end) {
+        const size_t size = end - begin;
+        if (size == 0) return;
+
+        owl::box3f bounds;
+        for (T* it = begin; it != end; ++it) bounds.extend(Traits::get_point(*it));
+        const owl::vec3f extent = bounds.upper - bounds.lower;
+        const int dim = extent.x >= extent.y
+                        ? (extent.x >= extent.z ? 0 : 2)
+                        : (extent.y >= extent.z ? 1 : 2);
+
+        const size_t left = (size > 1) ? subtreeSize(2 * node + 1, n) : 0;
+        std::nth_element(begin, begin + left, end, [dim](const T& a, const T& b) {
+            return Traits::get_point(a)[dim] < Traits::get_point(b)[dim];
+        });
+
+        tree[node] = begin[left];
+        Traits::set_dim(tree[node], dim);
+
+        buildRecursive<T, Traits>(tree, 2 * node + 1, n, begin, begin + left);
+        buildRecursive<T, Traits>(tree, 2 * node + 2, n, begin + left + 1, end);
+    }
+
+    /* Reorders `data` in place into tree order and returns its bounds. */
+    template<typename T, typename Traits>
+    owl::box3f buildTree(T* data, size_t n) {
+        owl::box3f bounds;
+        if (n == 0) return bounds;
+
+        std::vector<T> scratch(data, data + n);
+        buildRecursive<T, Traits>(data, 0, n, scratch.data(), scratch.data() + n);
+
+        for (size_t i = 0; i < n; i++) bounds.extend(Traits::get_point(data[i]));
+        return bounds;
+    }
+
+    /* Fixed-size max-heap of the K closest points found so far. Points
+     * further away than the initial radius are never accepted. */
+    template<int K>
+    struct CandidateList {
+        inline __both__ explicit CandidateList(float maxRadius)
+            : count(0), cutoff(maxRadius * maxRadius) {}
+
+        inline __both__ float maxDist2() const {
+            return count < K ? cutoff : dist2[0];
+        }
+
+        inline __both__ void push(float d2, int64_t id) {
+            if (d2 >= maxDist2()) return;
+
+            int i;
+            if (count < K) {
+                // sift up from the new leaf
+                i = count++;
+                while (i > 0 && dist2[(i - 1) / 2] < d2) {
+                    dist2[i] = dist2[(i - 1) / 2];
+                    pointID[i] = pointID[(i - 1) / 2];
+                    i = (i - 1) / 2;
+                }
+            } else {
+                // replace the current furthest and sift down
+                i = 0;
+                while (true) {
+                    int child = 2 * i + 1;
+                    if (child >= K) break;
+                    if (child + 1 < K && dist2[child + 1] > dist2[child]) child++;
+                    if (dist2[child] <= d2) break;
+                    dist2[i] = dist2[child];
+                    pointID[i] = pointID[child];
+                    i = child;
+                }
+            }
+            dist2[i] = d2;
+            pointID[i] = id;
+        }
+
+        int count;
+        float cutoff;
+        float dist2[K];
+        int64_t pointID[K];
+    };
+
+    /* Forwards to a candidate list shared by several trees, with `offset`
+     * added to the point IDs so the merged list can tell the trees apart.
+     * Running knn over each tree with the same list finds the K nearest
+     * points of all of them together. */
+    template<typename CandidateListT>
+    struct OffsetCandidates {
+        CandidateListT& list;
+        int64_t offset;
+
+        inline __both__ float maxDist2() const { return list.maxDist2(); }
+        inline __both__ void push(float d2, int64_t id) { list.push(d2, offset + id); }
+    };
+
+    /* Finds the K nearest points to `query`. Stack-based so it can also
+     * run inside a device kernel. Like cukd, returns the squared distance of
+     * the furthest candidate, or the squared max radius if fewer than K were
+     * found. */
+    template<typename CandidateListT, typename T, typename Traits>
+    inline __both__ float knn(CandidateListT& closest, const owl::vec3f& query, const T* tree, size_t n) {
+        struct StackEntry { size_t node; float dist2; };
+        StackEntry stack[64];
+        int top = 0;
+
+        size_t node = 0;
+        while (true) {
+            while (node < n) {
+                const owl::vec3f p = Traits::get_point(tree[node]);
+                const owl::vec3f d = p - query;
+                closest.push(dot(d, d), static_cast<int64_t>(node));
+
+                const int dim = Traits::get_dim(tree[node]);
+                const float diff = query[dim] - p[dim];
+                const size_t near = diff < 0.f ? 2 * node + 1 : 2 * node + 2;
+                const size_t far = diff < 0.f ? 2 * node + 2 : 2 * node + 1;
+
+                if (far < n && diff * diff < closest.maxDist2()) {
+                    stack[top++] = { far, diff * diff };
+                }
+                node = near;
+            }
+
+            // pop the next far subtree that can still contain closer points
+            node = n;
+            while (top > 0) {
+                const StackEntry entry = stack[--top];
+                if (entry.dist2 < closest.maxDist2()) {
+                    node = entry.node;
+                    break;
+                }
+            }
+            if (node >= n) break;
+        }
+
+        return closest.maxDist2();
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "world.h"
+
+/* Light tree for importance sampling one of many point lights per shading
+ * point (after Conty Estevez & Kulla 2018, "Importance sampling of many
+ * lights", without the orientation cones point lights do not need).
+ *
+ * Every node stores the bounds and total power of the lights below it. A
+ * sample walks from the root to a leaf, picking each child with probability
+ * proportional to its estimated contribution at the shading point, so the
+ * cost is logarithmic in the number of lights. Nodes are stored depth-first:
+ * the left child of an inner node follows it directly.
+ */
+namespace light_tree {
+    enum LightSampling {
+        ALL_LIGHTS = 0,
+        LIGHT_TREE = 1
+    };
+
+    struct Node {
+        owl::vec3f lower;
+        /* sum of power * mean colour of the lights below */
+        float power;
+        owl::vec3f upper;
+        /* inner nodes: index of the right child; leaves: -1 - light index */
+        int32_t next;
+    };
+
+    inline __both__ bool isLeaf(const Node& node) { return node.next < 0; }
+    inline __both__ int lightIndex(const Node& node) { return -1 - node.next; }
+
+    inline float lightPower(const LightSource& light) {
+        return static_cast<float>(light.power) * (light.rgb.x + light.rgb.y + light.rgb.z) / 3.f;
+    }
+
+    namespace detail {
+        inline void build(const std::vector<LightSource>& lights, std::vector<int>& order,
+                          int begin, int end, std::vector<Node>& nodes) {
+            const int id = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+
+            Node node;
+            node.lower = owl::vec3f(INFINITY);
+            node.upper = owl::vec3f(-INFINITY);
+            node.power = 0.f;
+            for (int i = begin; i < end; i++) {
+                const auto& light = lights[order[i]];
+                node.lower = owl::min(node.lower, light.pos);
+                node.upper = owl::max(node.upper, light.pos);
+                node.power += lightPower(light);
+            }
+
+            if (end - begin == 1) {
+                node.next = -1 - order[begin];
+                nodes[id] = node;
+                return;
+            }
+
+            // median split along the longest axis of the light positions
+            const owl::vec3f extent = node.upper - node.lower;
+            const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            const int mid = (begin + end) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+                return lights[a].pos[axis] < lights[b].pos[axis];
+            });
+
+            build(lights, order, begin, mid, nodes);
+            node.next = static_cast<int32_t>(nodes.size());
+            build(lights, order, mid, end, nodes);
+            nodes[id] = node;
+        }
+    }
+
+    /* 2 * lights.size() - 1 nodes, none for an empty light list. */
+    inline std::vector<Node> build(const std::vector<LightSource>& lights) {
+        std::vector<Node> nodes;
+        if (lights.empty()) return nodes;
+
+        std::vector<int> order(lights.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = static_cast<int>(i);
+        nodes.reserve(2 * lights.size() - 1);
+        detail::build(lights, order, 0, static_cast<int>(lights.size()), nodes);
+        return nodes;
+    }
+
+    /* Estimated contribution of the lights below `node` to a surface at
+     * (p, n): their power over the squared distance to the bounds' centre,
+     * which is clamped to the bounds' radius so close clusters are not
+     * overestimated. Zero if all of the bounds lie behind the surface. */
+    inline __both__ float importance(const Node& node, const owl::vec3f& p, const owl::vec3f& n) {
+        // the box corner furthest along n
+        const owl::vec3f corner(n.x > 0.f ? node.upper.x : node.lower.x,
+                                n.y > 0.f ? node.upper.y : node.lower.y,
+                                n.z > 0.f ? node.upper.z : node.lower.z);
+        if (dot(corner - p, n) < 0.f) return 0.f;
+
+        const owl::vec3f halfExtent = 0.5f * (node.upper - node.lower);
+        const owl::vec3f offset = 0.5f * (node.lower + node.upper) - p;
+        const float distance2 = fmaxf(dot(offset, offset), dot(halfExtent, halfExtent));
+        return node.power / fmaxf(distance2, 1e-6f);
+    }
+
+    /* Picks a light for the shading point (p, n) with the uniform number u.
+     * Returns its index and probability in pdf, or -1 if no light can
+     * reach the point. */
+    inline __both__ int sample(const Node* nodes, const owl::vec3f& p, const owl::vec3f& n, float u, float& pdf) {
+        pdf = 1.f;
+        int current = 0;
+        if (importance(nodes[0], p, n) <= 0.f) return -1;
+
+        while (!isLeaf(nodes[current])) {
+            const int left = current + 1;
+            const int right = nodes[current].next;
+            const float wLeft = importance(nodes[left], p, n);
+            const float wRight = importance(nodes[right], p, n);
+            if (!(wLeft + wRight > 0.f)) return -1;
+            const float pLeft = wLeft / (wLeft + wRight);
+
+            // reuse u for the next level by rescaling it into [0, 1)
+            if (u < pLeft) {
+                u = u / pLeft;
+                pdf *= pLeft;
+                current = left;
+            } else {
+                u = (u - pLeft) / (1.f - pLeft);
+                pdf *= 1.f - pLeft;
+                current = right;
+            }
+            u = fminf(u, 0.99999994f);
+        }
+        return lightIndex(nodes[current]);
+    }
+}
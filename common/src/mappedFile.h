@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Read-only memory mapping of a whole file. The pages are read in by the
+ * kernel as they are touched, so parsing threads pull from the page cache
+ * directly instead of through a stream buffer each. */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (::fstat(fd, &info) == 0) {
+            opened = true;
+            length = static_cast<size_t>(info.st_size);
+            if (length > 0) {
+                void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    opened = false;
+                    length = 0;
+                } else {
+                    bytes = static_cast<const char*>(mapping);
+                    ::madvise(mapping, length, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (bytes) ::munmap(const_cast<char*>(bytes), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /* false if the file is missing or couldn't be mapped */
+    bool valid() const { return opened; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool opened = false;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <string>
 #include <vector>
 #include "owl/common/math/vec.h"
 
@@ -9,14 +11,25 @@ struct Material {
     float specular;
     float transmission;
     float refraction_idx;
+    /* index into World::textures modulating albedo, -1 for none */
+    int albedoTexture;
 };
 
 /* variables for the triangle mesh geometry */
 struct TrianglesGeomData
 {
     Material *material;
+    /* index into the scene's material table */
+    uint32_t materialID;
     owl::vec3i *index;
     owl::vec3f *vertex;
+    /* precomputed object space triangle normals, nullptr to compute them
+     * from the vertices on every hit */
+    owl::vec3f *normal;
+    /* packed per-vertex attributes (vertexAttributes.h), nullptr if the
+     * mesh has none */
+    uint32_t *vertexNormal;
+    uint32_t *vertexUV;
 };
 
 /* The vectors need to be (trivially) transformed into regular arrays
@@ -25,6 +38,11 @@ struct Mesh {
     std::string name;
     std::vector<owl::vec3f> vertices;
     std::vector<owl::vec3i> indices;
-    std::shared_ptr<Material> material;
+    /* optional, either empty or indexed like vertices: octahedral normals
+     * and half float UVs, packed as in vertexAttributes.h */
+    std::vector<uint32_t> normals;
+    std::vector<uint32_t> uvs;
+    /* index into World::materials */
+    uint32_t materialID;
 };
 
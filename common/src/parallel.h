@@ -0,0 +1,40 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+/* Minimal work distribution for the CPU paths. Items are handed out
+ * dynamically, so the result only depends on the item index, never on
+ * which worker processed it. */
+namespace parallel {
+    inline int numWorkers(int requested = 0) {
+        if (requested > 0) return requested;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    /* Calls fn(i) for every i in [0, count) on `workers` threads. */
+    template<typename Fn>
+    void forEach(size_t count, Fn&& fn, int workers = 0) {
+        workers = static_cast<int>(std::min<size_t>(numWorkers(workers), std::max<size_t>(count, 1)));
+        if (workers == 1) {
+            for (size_t i = 0; i < count; i++) fn(i);
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> threads;
+        threads.reserve(workers);
+        for (int w = 0; w < workers; w++) {
+            threads.emplace_back([&, w] {
+                trace::setThreadName("worker " + std::to_string(w));
+                for (size_t i = next++; i < count; i = next++) fn(i);
+            });
+        }
+        for (auto& t : threads) t.join();
+    }
+}
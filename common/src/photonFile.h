@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "mappedFile.h"
+#include "parallel.h"
+#include "trace.h"
+
+/* Photon files come in two formats.
+ *
+ * Text, one photon per line, as written by the photon mapper:
+ *   pos.x pos.y pos.z dir.x dir.y dir.z color.x color.y color.z
+ *
+ * Binary, from writeBinary (or the photonConvert tool): a BinaryHeader and
+ * then `count` photons of nine little-endian floats in the same order as a
+ * text line. It holds exactly the values a text file parses to, in 36 bytes
+ * per photon instead of about 90.
+ *
+ * The readers tell the formats apart by the header magic, so every program
+ * takes either. Both are memory mapped; text is split at line boundaries
+ * into chunks parsed in parallel with std::from_chars.
+ *
+ * Templated on the photon type so each program can read straight into its
+ * own layout; `PhotonT` only needs `pos`, `dir` and `color` members with
+ * x/y/z components.
+ */
+#define PHOTON_BINARY_MAGIC 0x424f4850u /* "PHOB" */
+#define PHOTON_BINARY_VERSION 1u
+#define PHOTON_BINARY_FLOATS 9
+/* bytes per parsing or copying task */
+#define PHOTON_PARSE_CHUNK (4u << 20)
+
+namespace photon_file {
+    struct BinaryHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t count;
+    };
+
+    namespace detail {
+        const size_t BINARY_BLOCK = PHOTON_PARSE_CHUNK / (PHOTON_BINARY_FLOATS * sizeof(float));
+
+        inline bool isSpace(char c) {
+            return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+        }
+
+        inline const char* parseFloat(const char* p, const char* end, float& value) {
+            while (p < end && isSpace(*p)) p++;
+            // accepted by operator>>, not by from_chars
+            if (p < end && *p == '+') p++;
+            const auto result = std::from_chars(p, end, value);
+            return result.ec == std::errc() ? result.ptr : nullptr;
+        }
+
+        template<typename PhotonT>
+        const char* parsePhoton(const char* p, const char* end, PhotonT& photon) {
+            float* fields[9] = {&photon.pos.x, &photon.pos.y, &photon.pos.z,
+                                &photon.dir.x, &photon.dir.y, &photon.dir.z,
+                                &photon.color.x, &photon.color.y, &photon.color.z};
+            for (float* field : fields) {
+                if (!(p = parseFloat(p, end, *field))) return nullptr;
+            }
+            return p;
+        }
+
+        /* Calls fn(photon) for the photons of [p, end). Returns false if it
+         * stopped early at something that isn't a photon. */
+        template<typename PhotonT, typename Fn>
+        bool parseText(const char* p, const char* end, Fn&& fn) {
+            PhotonT photon{};
+            while (true) {
+                while (p < end && isSpace(*p)) p++;
+                if (p == end) return true;
+                if (!(p = parsePhoton(p, end, photon))) return false;
+                fn(photon);
+            }
+        }
+
+        template<typename PhotonT>
+        void fromFloats(const float* f, PhotonT& photon) {
+            photon.pos.x = f[0]; photon.pos.y = f[1]; photon.pos.z = f[2];
+            photon.dir.x = f[3]; photon.dir.y = f[4]; photon.dir.z = f[5];
+            photon.color.x = f[6]; photon.color.y = f[7]; photon.color.z = f[8];
+        }
+
+        /* The photons of a binary file, or nullptr if `file` isn't one. A
+         * binary file that can't be read has no photons. */
+        inline const float* binaryPhotons(const MappedFile& file, const std::string& filename, uint64_t& count) {
+            BinaryHeader header;
+            if (file.size() < sizeof(header)) return nullptr;
+            std::memcpy(&header, file.data(), sizeof(header));
+            if (header.magic != PHOTON_BINARY_MAGIC) return nullptr;
+
+            count = 0;
+            const size_t capacity = (file.size() - sizeof(header)) / (PHOTON_BINARY_FLOATS * sizeof(float));
+            if (header.version != PHOTON_BINARY_VERSION) {
+                std::cerr << "Unsupported photon file version " << header.version << ": " << filename << std::endl;
+            } else if (header.count > capacity) {
+                std::cerr << "Truncated photon file: " << filename << std::endl;
+            } else {
+                count = header.count;
+            }
+            return reinterpret_cast<const float*>(file.data() + sizeof(header));
+        }
+    }
+
+    namespace detail {
+        /* Offsets of the parsing chunks of a text file, and its size last.
+         * Chunks start after a newline, so no line is split between two. */
+        inline std::vector<size_t> chunkStarts(const char* text, size_t size) {
+            const size_t numChunks = std::max<size_t>(1, size / PHOTON_PARSE_CHUNK);
+            std::vector<size_t> starts(numChunks + 1, size);
+            starts[0] = 0;
+            for (size_t c = 1; c < numChunks; c++) {
+                const size_t guess = std::max(starts[c - 1], c * (size / numChunks));
+                const void* newline = std::memchr(text + guess, '\n', size - guess);
+                starts[c] = newline ? static_cast<size_t>(static_cast<const char*>(newline) - text) + 1 : size;
+            }
+            return starts;
+        }
+
+        /* Parses chunks [first, last) in parallel. Everything after the
+         * first malformed photon is dropped, and `malformed` set. */
+        template<typename PhotonT>
+        std::vector<std::vector<PhotonT>> parseChunks(const char* text, const std::vector<size_t>& starts,
+                                                      size_t first, size_t last, const std::string& filename,
+                                                      int workers, bool& malformed) {
+            std::vector<std::vector<PhotonT>> chunks(last - first);
+            std::vector<char> complete(chunks.size(), 1);
+            parallel::forEach(chunks.size(), [&](size_t c) {
+                const char* begin = text + starts[first + c];
+                const char* end = text + starts[first + c + 1];
+                chunks[c].reserve(std::count(begin, end, '\n') + 1);
+                complete[c] = parseText<PhotonT>(begin, end, [&](const PhotonT& photon) { chunks[c].push_back(photon); });
+            }, workers);
+
+            for (size_t c = 0; c < chunks.size(); c++) {
+                if (!complete[c]) {
+                    std::cerr << "Stopped at a malformed photon in " << filename << std::endl;
+                    malformed = true;
+                    chunks.resize(c + 1);
+                    break;
+                }
+            }
+            return chunks;
+        }
+    }
+
+    /* Calls fn(photon) for every photon in the file without keeping them,
+     * for files that don't fit in memory. Returns false if the file can't
+     * be opened. */
+    template<typename PhotonT, typename Fn>
+    bool forEach(const std::string& filename, Fn&& fn) {
+        const MappedFile file(filename);
+        if (!file.valid()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return false;
+        }
+
+        uint64_t count = 0;
+        if (const float* floats = detail::binaryPhotons(file, filename, count)) {
+            PhotonT photon{};
+            for (uint64_t i = 0; i < count; i++) {
+                detail::fromFloats(floats + PHOTON_BINARY_FLOATS * i, photon);
+                fn(photon);
+            }
+            return true;
+        }
+
+        if (!detail::parseText<PhotonT>(file.data(), file.data() + file.size(), fn)) {
+            std::cerr << "Stopped at a malformed photon in " << filename << std::endl;
+        }
+        return true;
+    }
+
+    /* Reads a whole photon file on `workers` threads (0 for all cores). A
+     * malformed line ends the photons, like it ends an operator>> loop. */
+    template<typename PhotonT>
+    std::vector<PhotonT> read(const std::string& filename, int workers = 0) {
+        TRACE_SCOPE("photon_file::read", "io");
+        std::vector<PhotonT> photons;
+        const MappedFile file(filename);
+        if (!file.valid()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return photons;
+        }
+
+        uint64_t count = 0;
+        if (const float* floats = detail::binaryPhotons(file, filename, count)) {
+            photons.resize(count);
+            const size_t numBlocks = (count + detail::BINARY_BLOCK - 1) / detail::BINARY_BLOCK;
+            parallel::forEach(numBlocks, [&](size_t b) {
+                const size_t end = std::min<size_t>((b + 1) * detail::BINARY_BLOCK, count);
+                for (size_t i = b * detail::BINARY_BLOCK; i < end; i++) {
+                    detail::fromFloats(floats + PHOTON_BINARY_FLOATS * i, photons[i]);
+                }
+            }, workers);
+            return photons;
+        }
+
+        const auto starts = detail::chunkStarts(file.data(), file.size());
+        bool malformed = false;
+        auto chunks = detail::parseChunks<PhotonT>(file.data(), starts, 0, starts.size() - 1, filename, workers, malformed);
+
+        std::vector<size_t> offsets(chunks.size() + 1, 0);
+        for (size_t c = 0; c < chunks.size(); c++) offsets[c + 1] = offsets[c] + chunks[c].size();
+        photons.resize(offsets.back());
+        parallel::forEach(chunks.size(), [&](size_t c) {
+            std::copy(chunks[c].begin(), chunks[c].end(), photons.begin() + offsets[c]);
+            chunks[c] = {};
+        }, workers);
+        return photons;
+    }
+
+    /* Calls fn(photons, count) for consecutive blocks of the file, in file
+     * order, parsing a few blocks per worker ahead at a time. For files far
+     * larger than memory, at close to the speed of read. */
+    template<typename PhotonT, typename Fn>
+    bool forEachBlock(const std::string& filename, Fn&& fn, int workers = 0) {
+        TRACE_SCOPE("photon_file::forEachBlock", "io");
+        const MappedFile file(filename);
+        if (!file.valid()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return false;
+        }
+
+        uint64_t count = 0;
+        if (const float* floats = detail::binaryPhotons(file, filename, count)) {
+            std::vector<PhotonT> block;
+            for (uint64_t begin = 0; begin < count; begin += detail::BINARY_BLOCK) {
+                block.resize(std::min<uint64_t>(detail::BINARY_BLOCK, count - begin));
+                for (size_t i = 0; i < block.size(); i++) {
+                    detail::fromFloats(floats + PHOTON_BINARY_FLOATS * (begin + i), block[i]);
+                }
+                fn(block.data(), block.size());
+            }
+            return true;
+        }
+
+        const auto starts = detail::chunkStarts(file.data(), file.size());
+        const size_t numChunks = starts.size() - 1;
+        const size_t window = 4 * static_cast<size_t>(parallel::numWorkers(workers));
+        bool malformed = false;
+        for (size_t first = 0; first < numChunks && !malformed; first += window) {
+            const size_t last = std::min(first + window, numChunks);
+            const auto chunks = detail::parseChunks<PhotonT>(file.data(), starts, first, last, filename, workers, malformed);
+            for (const auto& chunk : chunks) fn(chunk.data(), chunk.size());
+        }
+        return true;
+    }
+
+    /* Appends the lines of `count` photons to `out`, which must have been
+     * set up with std::fixed and std::setprecision(6) like write does. */
+    template<typename PhotonT>
+    void writeLines(std::ostream& out, const PhotonT* photons, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            const auto& photon = photons[i];
+            out << photon.pos.x << " " << photon.pos.y << " " << photon.pos.z << " "
+                << photon.dir.x << " " << photon.dir.y << " " << photon.dir.z << " "
+                << photon.color.x << " " << photon.color.y << " " << photon.color.z << "\n";
+        }
+    }
+
+    template<typename PhotonT>
+    void write(const PhotonT* photons, size_t count, const std::string& filename) {
+        TRACE_SCOPE("photon_file::write", "io");
+        std::ofstream outFile(filename);
+
+        if (!outFile.is_open()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return;
+        }
+
+        outFile << std::fixed << std::setprecision(6);
+        writeLines(outFile, photons, count);
+    }
+
+    inline void writeBinaryHeader(std::ostream& out, uint64_t count) {
+        const BinaryHeader header{PHOTON_BINARY_MAGIC, PHOTON_BINARY_VERSION, count};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    /* Appends `count` photons to a binary file whose header is written with
+     * the final count, before or after. */
+    template<typename PhotonT>
+    void writeBinaryPhotons(std::ostream& out, const PhotonT* photons, size_t count) {
+        std::vector<float> block;
+        for (size_t begin = 0; begin < count; begin += detail::BINARY_BLOCK) {
+            const size_t end = std::min(begin + detail::BINARY_BLOCK, count);
+            block.clear();
+            for (size_t i = begin; i < end; i++) {
+                const auto& p = photons[i];
+                block.insert(block.end(), {p.pos.x, p.pos.y, p.pos.z, p.dir.x, p.dir.y, p.dir.z, p.color.x, p.color.y, p.color.z});
+            }
+            out.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(float));
+        }
+    }
+
+    template<typename PhotonT>
+    bool writeBinary(const PhotonT* photons, size_t count, const std::string& filename) {
+        TRACE_SCOPE("photon_file::writeBinary", "io");
+        std::ofstream outFile(filename, std::ios::binary);
+        if (!outFile.is_open()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return false;
+        }
+
+        writeBinaryHeader(outFile, count);
+        writeBinaryPhotons(outFile, photons, count);
+        return static_cast<bool>(outFile);
+    }
+}
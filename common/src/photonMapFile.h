@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "owl/common/math/box.h"
+#include "photonStorage.h"
+#include "trace.h"
+
+/* Pre-built photon maps on disk, so repeated renders of the same photon
+ * files skip the KD-tree build.
+ *
+ * A file holds one or more maps exactly as they are laid out in memory
+ * after the build: the nodes in tree order with their split dimensions and
+ * packed directions, the RGBE flux, and the bounds. It starts with
+ *   Header
+ *   MapHeader maps[numMaps]
+ * followed by nodes[count] and flux[count] of every map in turn.
+ *
+ * `sourceKey` identifies what the maps were built from. A reader only
+ * accepts a file whose key, version and node layout match its own, so a
+ * changed photon file or power constant means a rebuild, never a stale
+ * map.
+ */
+#define PHOTON_MAP_FILE_MAGIC 0x50414d50u /* "PMAP" */
+/* 2: the global map no longer includes the caustic photons */
+#define PHOTON_MAP_FILE_VERSION 2u
+
+namespace photon_map_file {
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nodeBytes;
+        uint32_t numMaps;
+        uint64_t sourceKey;
+    };
+
+    struct MapHeader {
+        owl::box3f bounds;
+        uint32_t count;
+        uint32_t reserved;
+    };
+
+    /* A built map to be written; the arrays are in tree order. */
+    struct MapRef {
+        const photon_storage::PhotonNode* nodes;
+        const uint32_t* flux;
+        uint32_t count;
+        owl::box3f bounds;
+    };
+
+    inline uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+        return hash;
+    }
+
+    /* Key of the photon maps built from `files`: their sizes and
+     * modification times, and `salt` for the build parameters (photon
+     * powers and the like). 0 if a file is missing. */
+    inline uint64_t sourceKey(const std::vector<std::string>& files, const std::vector<float>& salt) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (const auto& file : files) {
+            std::error_code error;
+            const uint64_t size = std::filesystem::file_size(file, error);
+            if (error) return 0;
+            const int64_t modified = std::filesystem::last_write_time(file, error).time_since_epoch().count();
+            if (error) return 0;
+            hash = fnv1a(hash, &size, sizeof(size));
+            hash = fnv1a(hash, &modified, sizeof(modified));
+        }
+        return fnv1a(hash, salt.data(), salt.size() * sizeof(float));
+    }
+
+    /* Writes through a temporary file, so a reader never sees half a map.
+     * Returns false if the file can't be written. */
+    inline bool write(const std::string& filename, uint64_t sourceKey, const std::vector<MapRef>& maps) {
+        TRACE_SCOPE("photon_map_file::write", "io");
+        const std::string temporary = filename + ".tmp";
+        FILE* file = std::fopen(temporary.c_str(), "wb");
+        if (!file) {
+            std::cerr << "Error opening file: " << temporary << std::endl;
+            return false;
+        }
+
+        const Header header{PHOTON_MAP_FILE_MAGIC, PHOTON_MAP_FILE_VERSION,
+                            static_cast<uint32_t>(sizeof(photon_storage::PhotonNode)),
+                            static_cast<uint32_t>(maps.size()), sourceKey};
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const auto& map : maps) {
+            const MapHeader mapHeader{map.bounds, map.count, 0};
+            ok = ok && std::fwrite(&mapHeader, sizeof(mapHeader), 1, file) == 1;
+        }
+        for (const auto& map : maps) {
+            ok = ok && std::fwrite(map.nodes, sizeof(*map.nodes), map.count, file) == map.count
+                    && std::fwrite(map.flux, sizeof(*map.flux), map.count, file) == map.count;
+        }
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Error writing file: " << filename << std::endl;
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    class Reader {
+    public:
+        /* Opens `filename` if it holds `numMaps` maps built from
+         * `sourceKey`; valid() is false otherwise, and for a missing file. */
+        Reader(const std::string& filename, uint64_t sourceKey, uint32_t numMaps) {
+            if (sourceKey == 0) return;
+            file = std::fopen(filename.c_str(), "rb");
+            if (!file) return;
+
+            Header header;
+            maps.resize(numMaps);
+            const bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+                && header.magic == PHOTON_MAP_FILE_MAGIC
+                && header.version == PHOTON_MAP_FILE_VERSION
+                && header.nodeBytes == sizeof(photon_storage::PhotonNode)
+                && header.numMaps == numMaps
+                && header.sourceKey == sourceKey
+                && std::fread(maps.data(), sizeof(MapHeader), numMaps, file) == numMaps;
+
+            uint64_t offset = sizeof(Header) + numMaps * sizeof(MapHeader);
+            for (const auto& map : maps) {
+                offsets.push_back(offset);
+                offset += static_cast<uint64_t>(map.count) * (sizeof(photon_storage::PhotonNode) + sizeof(uint32_t));
+            }
+            std::error_code error;
+            if (!ok || std::filesystem::file_size(filename, error) != offset || error) {
+                std::fclose(file);
+                file = nullptr;
+            }
+        }
+
+        ~Reader() {
+            if (file) std::fclose(file);
+        }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        bool valid() const { return file != nullptr; }
+        uint32_t count(size_t map) const { return maps[map].count; }
+        const owl::box3f& bounds(size_t map) const { return maps[map].bounds; }
+
+        /* Reads map `map` into arrays of count(map) entries. */
+        bool read(size_t map, photon_storage::PhotonNode* nodes, uint32_t* flux) {
+            TRACE_SCOPE("photon_map_file::read", "io");
+            const uint32_t n = maps[map].count;
+            return std::fseek(file, static_cast<long>(offsets[map]), SEEK_SET) == 0
+                && std::fread(nodes, sizeof(*nodes), n, file) == n
+                && std::fread(flux, sizeof(*flux), n, file) == n;
+        }
+
+    private:
+        FILE* file = nullptr;
+        std::vector<MapHeader> maps;
+        std::vector<uint64_t> offsets;
+    };
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+
+/* Compact photon map storage shared by the ray tracer and the CPU paths.
+ *
+ * A photon map is two parallel arrays in KD-tree order:
+ *   PhotonNode nodes[n]  - position, split dimension and direction (16 B)
+ *   uint32_t   flux[n]   - colour * power as shared-exponent RGBE (4 B)
+ *
+ * The tree walk only ever touches `nodes`, and one node is a single aligned
+ * 16 byte load. The flux is read for the K photons that survive the search.
+ *
+ * Positions stay interleaved with `meta` rather than split into x/y/z
+ * arrays: cukd builds and walks an array of point structs, and each visited
+ * node needs its position and split dimension together, which the 16 byte
+ * node delivers in one load where separate arrays would take four.
+ *
+ * `meta` packs the split dimension into the top 2 bits. The low 30 bits
+ * hold the index of the source photon while the tree is built, and the
+ * 15:15 octahedral direction once the payloads have been packed.
+ */
+#define PHOTON_DIM_SHIFT 30
+#define PHOTON_PAYLOAD_MASK 0x3fffffffu
+#define PHOTON_MAX_COUNT (PHOTON_PAYLOAD_MASK + 1u)
+#define OCTAHEDRAL_BITS 15
+
+namespace photon_storage {
+    /* Unpacked photon as read from a photon file. `color` is the flux,
+     * i.e. the photon colour already scaled by its power. */
+    struct PhotonRecord {
+        owl::vec3f pos;
+        owl::vec3f dir;
+        owl::vec3f color;
+    };
+
+    struct alignas(16) PhotonNode {
+        owl::vec3f pos;
+        uint32_t meta;
+    };
+
+    inline __both__ int getDim(const PhotonNode& node) {
+        return static_cast<int>(node.meta >> PHOTON_DIM_SHIFT);
+    }
+
+    inline __both__ void setDim(PhotonNode& node, int dim) {
+        node.meta = (node.meta & PHOTON_PAYLOAD_MASK) | (static_cast<uint32_t>(dim) << PHOTON_DIM_SHIFT);
+    }
+
+    inline __both__ float signNotZero(float v) {
+        return v < 0.f ? -1.f : 1.f;
+    }
+
+    /* Octahedral unit vector encoding with `bits` per component, at most 16. */
+    inline __both__ uint32_t encodeOctahedral(const owl::vec3f& dir, int bits = OCTAHEDRAL_BITS) {
+        const float l1 = fabsf(dir.x) + fabsf(dir.y) + fabsf(dir.z);
+        float u = dir.x / l1;
+        float v = dir.y / l1;
+        if (dir.z < 0.f) {
+            const float fu = (1.f - fabsf(v)) * signNotZero(u);
+            const float fv = (1.f - fabsf(u)) * signNotZero(v);
+            u = fu;
+            v = fv;
+        }
+
+        const float scale = static_cast<float>((1u << bits) - 1);
+        const uint32_t qu = static_cast<uint32_t>(fminf(fmaxf(u * 0.5f + 0.5f, 0.f), 1.f) * scale + 0.5f);
+        const uint32_t qv = static_cast<uint32_t>(fminf(fmaxf(v * 0.5f + 0.5f, 0.f), 1.f) * scale + 0.5f);
+        return (qu << bits) | qv;
+    }
+
+    inline __both__ owl::vec3f decodeOctahedral(uint32_t packed, int bits = OCTAHEDRAL_BITS) {
+        const uint32_t mask = (1u << bits) - 1;
+        const float scale = static_cast<float>(mask);
+        const float u = ((packed >> bits) & mask) / scale * 2.f - 1.f;
+        const float v = (packed & mask) / scale * 2.f - 1.f;
+
+        owl::vec3f dir(u, v, 1.f - fabsf(u) - fabsf(v));
+        if (dir.z < 0.f) {
+            dir.x = (1.f - fabsf(v)) * signNotZero(u);
+            dir.y = (1.f - fabsf(u)) * signNotZero(v);
+        }
+        const float len = sqrtf(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
+        return dir / len;
+    }
+
+    /* Ward's RGBE: an 8 bit mantissa per channel sharing one exponent. */
+    inline __both__ uint32_t encodeRGBE(const owl::vec3f& flux) {
+        const float m = fmaxf(flux.x, fmaxf(flux.y, flux.z));
+        if (m < 1e-32f) return 0;
+
+        int e;
+        const float scale = frexpf(m, &e) * 256.f / m;
+        const uint32_t r = static_cast<uint32_t>(fmaxf(flux.x, 0.f) * scale);
+        const uint32_t g = static_cast<uint32_t>(fmaxf(flux.y, 0.f) * scale);
+        const uint32_t b = static_cast<uint32_t>(fmaxf(flux.z, 0.f) * scale);
+        return r | (g << 8) | (b << 16) | (static_cast<uint32_t>(e + 128) << 24);
+    }
+
+    inline __both__ owl::vec3f decodeRGBE(uint32_t rgbe) {
+        const uint32_t e = rgbe >> 24;
+        if (e == 0) return owl::vec3f(0.f);
+
+        const float f = ldexpf(1.f, static_cast<int>(e) - (128 + 8));
+        return owl::vec3f(((rgbe & 0xff) + 0.5f) * f,
+                          (((rgbe >> 8) & 0xff) + 0.5f) * f,
+                          (((rgbe >> 16) & 0xff) + 0.5f) * f);
+    }
+
+    inline __both__ owl::vec3f direction(const PhotonNode& node) {
+        return decodeOctahedral(node.meta & PHOTON_PAYLOAD_MASK);
+    }
+
+    /* Fills `nodes` with the photon positions, tagging each node with the
+     * index of its record so the payloads can follow the tree build. */
+    inline void prepareNodes(const std::vector<PhotonRecord>& records, PhotonNode* nodes) {
+        for (size_t i = 0; i < records.size(); i++) {
+            nodes[i].pos = records[i].pos;
+            nodes[i].meta = static_cast<uint32_t>(i);
+        }
+    }
+
+    /* After the tree build has reordered `nodes`, writes the flux of every
+     * node to the matching slot and replaces the record index by the packed
+     * direction. */
+    inline void packPayloads(const std::vector<PhotonRecord>& records, PhotonNode* nodes, uint32_t* flux) {
+        for (size_t i = 0; i < records.size(); i++) {
+            const PhotonRecord& record = records[nodes[i].meta & PHOTON_PAYLOAD_MASK];
+            flux[i] = encodeRGBE(record.color);
+            nodes[i].meta = (nodes[i].meta & ~PHOTON_PAYLOAD_MASK) | encodeOctahedral(record.dir);
+        }
+    }
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "photonFile.h"
+#include "trace.h"
+
+/* Photons per block handed to the writer thread. */
+#define PHOTON_WRITER_BLOCK 65536
+
+namespace photon_file {
+    /* Streaming sink for a photon file, in the format of photon_file::write.
+     *
+     * write() copies the photons into fixed-size blocks and returns; a
+     * background thread formats and writes the full blocks, so the caller
+     * can trace the next batch while the previous one goes to disk. At most
+     * `queueDepth` full blocks wait for the writer: once the queue is full,
+     * write() blocks until the writer catches up, so memory stays bounded by
+     * the queue depth no matter how many photons go through. Photons are
+     * written in the order they were passed in.
+     *
+     * Once a block fails to write (e.g. the disk is full) the writer drops
+     * the rest, and close() returns false.
+     */
+    template<typename PhotonT>
+    class AsyncWriter {
+    public:
+        explicit AsyncWriter(const std::string& filename, size_t queueDepth = 4)
+            : out(filename), queueDepth(std::max<size_t>(queueDepth, 1)) {
+            if (!out.is_open()) {
+                std::cerr << "Error opening file: " << filename << std::endl;
+                return;
+            }
+            out << std::fixed << std::setprecision(6);
+            filling.reserve(PHOTON_WRITER_BLOCK);
+            writer = std::thread([this] { run(); });
+        }
+
+        ~AsyncWriter() { close(); }
+
+        AsyncWriter(const AsyncWriter&) = delete;
+        AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+        /* false if the file couldn't be opened; writes are then dropped */
+        bool valid() const { return writer.joinable() || closed; }
+
+        void write(const PhotonT* photons, size_t count) {
+            if (!writer.joinable()) return;
+            written += count;
+            while (count > 0) {
+                const size_t n = std::min(count, PHOTON_WRITER_BLOCK - filling.size());
+                filling.insert(filling.end(), photons, photons + n);
+                photons += n;
+                count -= n;
+                if (filling.size() == PHOTON_WRITER_BLOCK) submit();
+            }
+        }
+
+        /* Writes the partial block, waits for the queue to drain and closes
+         * the file. Returns false if the file couldn't be opened or any
+         * photon couldn't be written. */
+        bool close() {
+            if (!writer.joinable()) return closed && !failed;
+            if (!filling.empty()) submit();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closing = true;
+            }
+            queued.notify_one();
+            writer.join();
+            out.close();
+            failed = failed || out.fail();
+            closed = true;
+            return !failed;
+        }
+
+        /* photons passed to write() so far */
+        size_t count() const { return written; }
+
+    private:
+        void submit() {
+            std::vector<PhotonT> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                drained.wait(lock, [&] { return queue.size() < queueDepth; });
+                queue.push_back(std::move(filling));
+                if (!spare.empty()) {
+                    next = std::move(spare.back());
+                    spare.pop_back();
+                }
+            }
+            queued.notify_one();
+            next.clear();
+            next.reserve(PHOTON_WRITER_BLOCK);
+            filling = std::move(next);
+        }
+
+        void run() {
+            trace::setThreadName("photon writer");
+            while (true) {
+                std::vector<PhotonT> block;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    queued.wait(lock, [&] { return !queue.empty() || closing; });
+                    if (queue.empty()) return;
+                    block = std::move(queue.front());
+                    queue.pop_front();
+                }
+                drained.notify_one();
+
+                // only this thread touches `out` and `failed` until close() joins it
+                if (!failed) {
+                    TRACE_SCOPE("photon_file::AsyncWriter block", "io");
+                    writeLines(out, block.data(), block.size());
+                    failed = out.fail();
+                }
+
+                // handed back to write() so blocks aren't reallocated
+                std::lock_guard<std::mutex> lock(mutex);
+                spare.push_back(std::move(block));
+            }
+        }
+
+        std::ofstream out;
+        size_t queueDepth;
+        size_t written = 0;
+        bool closed = false;
+        bool failed = false;
+        std::vector<PhotonT> filling;
+
+        std::mutex mutex;
+        std::condition_variable queued;
+        std::condition_variable drained;
+        std::deque<std::vector<PhotonT>> queue;
+        std::vector<std::vector<PhotonT>> spare;
+        bool closing = false;
+        std::thread writer;
+    };
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "kdTree.h"
+#include "parallel.h"
+#include "photonStorage.h"
+#include "shadingMath.h"
+#include "trace.h"
+
+/* Precomputed irradiance (Christensen 1999, "Faster photon map global
+ * illumination").
+ *
+ * Every `stride`-th photon of the global map gets a K-nearest density
+ * estimate of the irradiance at its position and a surface normal fitted
+ * to the neighbouring photons. Final gathers then look up the nearest of
+ * these points whose normal matches instead of running a full estimate.
+ *
+ * The points come back as PhotonRecords (pos, dir = normal, color =
+ * irradiance) so they can be stored and searched like any photon map; the
+ * direction bits of the packed nodes then hold the normal.
+ */
+namespace precomputed_irradiance {
+    struct Settings {
+        int stride = 4;
+        float maxRadius = 100.f;
+        float coneFilterC = 1.1f;
+        int numThreads = 0;
+    };
+
+    struct Node_traits {
+        static inline owl::vec3f get_point(const photon_storage::PhotonNode& p) { return p.pos; }
+        static inline int get_dim(const photon_storage::PhotonNode& p) { return photon_storage::getDim(p); }
+        static inline void set_dim(photon_storage::PhotonNode& p, int dim) { photon_storage::setDim(p, dim); }
+    };
+
+    /* Eigenvector of the smallest eigenvalue of a symmetric 3x3 matrix,
+     * by cyclic Jacobi rotations. */
+    inline owl::vec3f smallestEigenvector(float a[3][3]) {
+        float v[3][3] = {{1.f, 0.f, 0.f}, {0.f, 1.f, 0.f}, {0.f, 0.f, 1.f}};
+
+        for (int sweep = 0; sweep < 16; sweep++) {
+            const float off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+            if (off < 1e-12f) break;
+
+            for (int p = 0; p < 2; p++) {
+                for (int q = p + 1; q < 3; q++) {
+                    if (std::abs(a[p][q]) < 1e-12f) continue;
+
+                    const float theta = (a[q][q] - a[p][p]) / (2.f * a[p][q]);
+                    const float t = (theta >= 0.f ? 1.f : -1.f) / (std::abs(theta) + std::sqrt(theta * theta + 1.f));
+                    const float c = 1.f / std::sqrt(t * t + 1.f);
+                    const float s = t * c;
+
+                    for (int k = 0; k < 3; k++) {
+                        const float akp = a[k][p], akq = a[k][q];
+                        a[k][p] = c * akp - s * akq;
+                        a[k][q] = s * akp + c * akq;
+                    }
+                    for (int k = 0; k < 3; k++) {
+                        const float apk = a[p][k], aqk = a[q][k];
+                        a[p][k] = c * apk - s * aqk;
+                        a[q][k] = s * apk + c * aqk;
+                    }
+                    for (int k = 0; k < 3; k++) {
+                        const float vkp = v[k][p], vkq = v[k][q];
+                        v[k][p] = c * vkp - s * vkq;
+                        v[k][q] = s * vkp + c * vkq;
+                    }
+                }
+            }
+        }
+
+        int smallest = 0;
+        if (a[1][1] < a[smallest][smallest]) smallest = 1;
+        if (a[2][2] < a[smallest][smallest]) smallest = 2;
+        return owl::vec3f(v[0][smallest], v[1][smallest], v[2][smallest]);
+    }
+
+    /* `records` is the global photon map with colour * power in `color`. */
+    template<int K>
+    std::vector<photon_storage::PhotonRecord> estimate(const std::vector<photon_storage::PhotonRecord>& records,
+                                                       const Settings& settings) {
+        TRACE_SCOPE("precompute irradiance");
+        const size_t stride = static_cast<size_t>(std::max(1, settings.stride));
+        std::vector<photon_storage::PhotonRecord> points((records.size() + stride - 1) / stride);
+        if (records.empty()) return points;
+
+        // meta keeps the record index, the payloads are never packed
+        std::vector<photon_storage::PhotonNode> tree(records.size());
+        photon_storage::prepareNodes(records, tree.data());
+        kdtree::buildTree<photon_storage::PhotonNode, Node_traits>(tree.data(), tree.size());
+
+        const float normalisation = (1.f - (2.f / 3.f) * (1.f / settings.coneFilterC)) * 2.f * PI;
+
+        parallel::forEach(points.size(), [&](size_t p) {
+            const auto& origin = records[p * stride];
+
+            kdtree::CandidateList<K> closest(settings.maxRadius);
+            const float radius2 = kdtree::knn<kdtree::CandidateList<K>, photon_storage::PhotonNode, Node_traits>(
+                closest, origin.pos, tree.data(), tree.size());
+            const float radius = std::sqrt(radius2);
+
+            // irradiance and the neighbours' centroid
+            owl::vec3f irradiance(0.f), centroid(0.f);
+            for (int i = 0; i < closest.count; i++) {
+                const auto& photon = records[tree[closest.pointID[i]].meta & PHOTON_PAYLOAD_MASK];
+                const float weight = 1.f - (owl::length(photon.pos - origin.pos) / radius * settings.coneFilterC);
+                irradiance += weight * photon.color;
+                centroid += photon.pos;
+            }
+            centroid /= static_cast<float>(std::max(1, closest.count));
+
+            float covariance[3][3] = {};
+            owl::vec3f outgoing(0.f);
+            for (int i = 0; i < closest.count; i++) {
+                const auto& photon = records[tree[closest.pointID[i]].meta & PHOTON_PAYLOAD_MASK];
+                const owl::vec3f d = photon.pos - centroid;
+                for (int r = 0; r < 3; r++) {
+                    for (int c = 0; c < 3; c++) covariance[r][c] += d[r] * d[c];
+                }
+                outgoing += photon.dir;
+            }
+
+            // photons leave the surface on the side they were deposited
+            owl::vec3f normal = smallestEigenvector(covariance);
+            if (owl::dot(normal, outgoing) < 0.f) normal = -normal;
+
+            auto& point = points[p];
+            point.pos = origin.pos;
+            point.dir = normal;
+            point.color = radius2 > 0.f ? irradiance / (normalisation * radius2) : owl::vec3f(0.f);
+        }, settings.numThreads);
+
+        return points;
+    }
+}
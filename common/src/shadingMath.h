@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cmath>
+#include "owl/common/math/vec.h"
+#include "owl/common/math/random.h"
+#include "common.h"
+
+/* Sampling and scattering maths shared by the OptiX programs and the CPU
+ * reference paths. Everything here is __both__; device-only helpers that
+ * need OptiX intrinsics live in common/cuda/helpers.h. */
+
+#define RANDVEC3F owl::vec3f(rnd(),rnd(),rnd())
+#define INFTY 1e10
+#define EPS 1e-3f
+#define PI float(3.141592653)
+
+inline __both__ owl::vec3f clampvec(owl::vec3f v, float f) {
+    return owl::vec3f(owl::clamp(v.x, f), owl::clamp(v.y, f), owl::clamp(v.z, f));
+}
+
+inline __both__ bool nearZero(const owl::vec3f& v) {
+    return v.x < EPS && v.y < EPS && v.z < EPS;
+}
+
+inline __both__ bool isZero(const owl::vec3f& v) {
+    return v.x == 0.f && v.y == 0.f && v.z == 0.f;
+}
+
+inline __both__ float norm(owl::vec3f v) {
+    return sqrtf(dot(v, v));
+}
+
+inline __both__ owl::vec3f randomPointInUnitSphere(Random &random) {
+  const float u = random();
+  const float v = random();
+  const float theta = 2.f * PI * u;
+  const float phi = acosf(2.f * v - 1.f);
+
+  return owl::vec3f(sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi));
+}
+
+inline __both__ void randomUnitVector(Random &random, owl::vec3f &vec) {
+    do {
+        vec.x = 2.f*random() - 1.f;
+        vec.y = 2.f*random() - 1.f;
+        vec.z = 2.f*random() - 1.f;
+    } while (dot(vec, vec) >= 1.f);
+    vec = normalize(vec);
+}
+
+inline __both__ owl::vec3f cosineSampleHemisphere(const owl::vec3f &normal, Random &random) {
+  return normalize(normal + randomPointInUnitSphere(random) * (1 - EPS));
+}
+
+inline __both__ owl::vec3f reflect(const owl::vec3f &incoming, const owl::vec3f &normal) {
+    return incoming - 2.f * dot(incoming, normal) * normal;
+}
+
+inline __both__ owl::vec3f reflectDiffuse(const owl::vec3f &normal, Random &random) {
+    return cosineSampleHemisphere(normal, random);
+}
+
+inline __both__ owl::vec3f refract(const owl::vec3f &incoming, const owl::vec3f &normal, const float refractionIndex) {
+    float cosTheta = -dot(incoming, normal);
+    float mu;
+    if(cosTheta > 0.f) {
+        mu = 1.f / refractionIndex;
+    } else {
+        mu = refractionIndex;
+        cosTheta = -cosTheta;
+    }
+
+    const float cosPhi = 1.f - mu * mu * (1.f - cosTheta * cosTheta);
+
+    if (cosPhi >= 0) {
+      return mu * incoming + (mu * cosTheta - sqrtf(cosPhi)) * normal;
+    } else {
+      return reflect(incoming, normal);
+    }
+}
+
+inline __both__ owl::vec3f multiplyColor(const owl::vec3f &a, const owl::vec3f &b) {
+    return owl::vec3f(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+inline __both__
+bool refract(const owl::vec3f& v,
+             const owl::vec3f& n,
+             const float ni_over_nt,
+             owl::vec3f &refracted)
+{
+    const owl::vec3f uv = normalize(v);
+    const float dt = dot(uv, n);
+    const float discriminant = 1.0f - ni_over_nt * ni_over_nt*(1 - dt * dt);
+    if (discriminant > 0.f) {
+        refracted = ni_over_nt * (uv - n * dt) - n * sqrtf(discriminant);
+        return true;
+    }
+
+    return false;
+}
+
+inline __both__ float schlickFresnelAprox(const float cos, const float ior) {
+    float r0 = (1. - ior) / (1. + ior);
+    r0 = r0 * r0;
+    return r0 + (1. - r0) * pow(1. - cos, 5);
+}
+
+/* Upper bound of the survival probability, so that paths through white,
+ * lossless materials still end after ~20 bounces on average. */
+#define RR_MAX_SURVIVAL 0.95f
+
+/* Russian roulette (Arvo & Kirk 1990) after `depth` bounces. The path
+ * survives with probability max(throughput) / reference, clamped to
+ * RR_MAX_SURVIVAL, and the throughput of a surviving path is divided by that
+ * probability so the estimate stays unbiased. Returns false when the path
+ * is terminated. A negative minDepth disables the roulette. */
+inline __both__ bool russianRoulette(owl::vec3f &throughput, const float reference,
+                                     const int depth, const int minDepth, Random &random) {
+    if (minDepth < 0 || depth < minDepth) return true;
+
+    const float maxComponent = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+    const float survival = fminf(maxComponent / reference, RR_MAX_SURVIVAL);
+    if (!(survival > 0.f) || random() >= survival) return false;
+
+    throughput = throughput * (1.f / survival);
+    return true;
+}
@@ -0,0 +1,105 @@
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> trace::capturing{false};
+
+namespace {
+  struct Event {
+    const char* name;
+    const char* category;
+    long long ts;
+    long long dur;
+  };
+
+  struct ThreadBuffer {
+    int tid;
+    std::string name;
+    std::vector<Event> events;
+  };
+
+  std::mutex registry_mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> registry;
+  std::string output_filename;
+  trace::Clock::time_point epoch;
+
+  ThreadBuffer& thread_buffer() {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      registry.push_back(std::make_unique<ThreadBuffer>());
+      buffer = registry.back().get();
+      buffer->tid = static_cast<int>(registry.size());
+      buffer->name = "thread " + std::to_string(buffer->tid);
+      buffer->events.reserve(1024);
+    }
+    return *buffer;
+  }
+
+  long long micros_since_epoch(trace::Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+  }
+
+  void write_escaped(std::ostream& out, const std::string& s) {
+    for (const char c : s) {
+      if (c == '"' || c == '\\') out << '\\';
+      out << c;
+    }
+  }
+}
+
+void trace::start(const std::string& filename) {
+  output_filename = filename;
+  epoch = Clock::now();
+  capturing.store(true, std::memory_order_relaxed);
+}
+
+void trace::setThreadName(const std::string& name) {
+  if (!enabled()) return;
+  thread_buffer().name = name;
+}
+
+void trace::record(const char* name, const char* category, Clock::time_point begin, Clock::time_point end) {
+  auto& buffer = thread_buffer();
+  buffer.events.push_back({name, category, micros_since_epoch(begin), micros_since_epoch(end) - micros_since_epoch(begin)});
+}
+
+void trace::finish() {
+  if (!enabled()) return;
+  capturing.store(false, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  std::ofstream out(output_filename);
+  if (!out.is_open()) {
+    std::cerr << "Error opening trace file: " << output_filename << std::endl;
+    return;
+  }
+
+  size_t num_events = 0;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto& buffer : registry) {
+    out << (first ? "" : ",") << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->tid
+        << ",\"args\":{\"name\":\"";
+    write_escaped(out, buffer->name);
+    out << "\"}}";
+    first = false;
+
+    for (const auto& event : buffer->events) {
+      out << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+          << ",\"ts\":" << event.ts << ",\"dur\":" << event.dur << ",\"name\":\"";
+      write_escaped(out, event.name);
+      out << "\",\"cat\":\"";
+      write_escaped(out, event.category);
+      out << "\"}";
+    }
+    num_events += buffer->events.size();
+  }
+  out << "\n]}\n";
+
+  std::cout << "Wrote " << num_events << " trace events to " << output_filename << std::endl;
+}
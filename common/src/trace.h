@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+/* Chrome trace-event capture for profiling the pipeline stages.
+ * The resulting JSON can be opened in chrome://tracing or ui.perfetto.dev.
+ *
+ * Spans are recorded into per-thread buffers and serialised once by
+ * trace::finish(), so recording never takes a lock. When capture was not
+ * started, a span costs one relaxed atomic load and nothing else.
+ */
+namespace trace {
+    using Clock = std::chrono::steady_clock;
+
+    extern std::atomic<bool> capturing;
+
+    /* Starts capturing; events are written to `filename` on finish(). */
+    void start(const std::string& filename);
+    /* Writes the captured events. Worker threads must have been joined. */
+    void finish();
+    /* Label the calling thread in the viewer (e.g. "main", "worker 3"). */
+    void setThreadName(const std::string& name);
+
+    inline bool enabled() { return capturing.load(std::memory_order_relaxed); }
+
+    void record(const char* name, const char* category, Clock::time_point begin, Clock::time_point end);
+
+    struct Span {
+        explicit Span(const char* name, const char* category = "stage")
+            : name(name), category(category), active(enabled()) {
+            if (active) begin = Clock::now();
+        }
+
+        ~Span() {
+            if (active) record(name, category, begin, Clock::now());
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        const char* name;
+        const char* category;
+        bool active;
+        Clock::time_point begin;
+    };
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(...) trace::Span TRACE_CONCAT(trace_span_, __LINE__)(__VA_ARGS__)
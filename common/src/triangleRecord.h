@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "mesh.h"
+
+/* Per-triangle data computed once at scene load instead of on every hit:
+ * the edges from the first vertex, which the CPU intersector needs, and the
+ * unit geometric normal. Both are in the object space of the mesh.
+ *
+ * The GPU intersects in hardware and only keeps the normals (12 bytes per
+ * triangle); the CPU BVH stores the whole record in place of the other two
+ * vertices. */
+struct TriangleRecord {
+    owl::vec3f e1;
+    owl::vec3f e2;
+    owl::vec3f normal;
+};
+
+inline __both__ TriangleRecord makeTriangleRecord(const owl::vec3f& a, const owl::vec3f& b, const owl::vec3f& c) {
+    TriangleRecord record;
+    record.e1 = b - a;
+    record.e2 = c - a;
+    record.normal = normalize(cross(record.e1, record.e2));
+    return record;
+}
+
+/* Normal of an instanced triangle in world space from its object space
+ * normal. rows are the linear part of the world-to-object transform, so
+ * their transpose maps normals to world space; the sign of its determinant
+ * keeps the winding of mirrored instances, as cross(M e1, M e2) does. */
+inline __both__ owl::vec3f instanceNormal(const owl::vec3f& normal, const owl::vec3f& row0,
+                                          const owl::vec3f& row1, const owl::vec3f& row2) {
+    const owl::vec3f n = normal.x * row0 + normal.y * row1 + normal.z * row2;
+    return dot(row0, cross(row1, row2)) < 0.f ? -normalize(n) : normalize(n);
+}
+
+/* Indexed like mesh.indices. */
+inline std::vector<owl::vec3f> triangleNormals(const Mesh& mesh) {
+    std::vector<owl::vec3f> normals;
+    normals.reserve(mesh.indices.size());
+    for (const auto& index : mesh.indices) {
+        normals.push_back(makeTriangleRecord(mesh.vertices[index.x], mesh.vertices[index.y], mesh.vertices[index.z]).normal);
+    }
+    return normals;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "owl/common/math/vec.h"
+#include "photonStorage.h"
+
+/* Optional per-vertex shading attributes, 4 bytes each:
+ *   normals - octahedral, 16:16 bits (see photon_storage::encodeOctahedral)
+ *   UVs     - two IEEE half floats, u in the low 16 bits
+ *
+ * Both are interpolated with the hit barycentrics, on the device and in the
+ * CPU renderer alike.
+ */
+#define VERTEX_NORMAL_BITS 16
+
+namespace vertex_attributes {
+    inline __both__ uint32_t encodeNormal(const owl::vec3f& normal) {
+        return photon_storage::encodeOctahedral(normal, VERTEX_NORMAL_BITS);
+    }
+
+    inline __both__ owl::vec3f decodeNormal(uint32_t packed) {
+        return photon_storage::decodeOctahedral(packed, VERTEX_NORMAL_BITS);
+    }
+
+    /* Round to nearest even; out of range values become infinities. */
+    inline __both__ uint16_t floatToHalf(float value) {
+        uint32_t x;
+        memcpy(&x, &value, sizeof(x));
+        const uint32_t sign = (x >> 16) & 0x8000u;
+        const uint32_t biased = (x >> 23) & 0xffu;
+        uint32_t mantissa = x & 0x7fffffu;
+
+        if (biased == 0xffu) return static_cast<uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+        const int exponent = static_cast<int>(biased) - 127 + 15;
+        if (exponent >= 31) return static_cast<uint16_t>(sign | 0x7c00u);
+
+        if (exponent <= 0) {
+            // subnormal half, or zero
+            if (exponent < -10) return static_cast<uint16_t>(sign);
+            mantissa |= 0x800000u;
+            const int shift = 14 - exponent;
+            uint32_t half = mantissa >> shift;
+            const uint32_t rest = mantissa & ((1u << shift) - 1);
+            const uint32_t halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (half & 1u))) half++;
+            return static_cast<uint16_t>(sign | half);
+        }
+
+        // a carry out of the mantissa correctly bumps the exponent
+        uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+        const uint32_t rest = mantissa & 0x1fffu;
+        if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) half++;
+        return static_cast<uint16_t>(half);
+    }
+
+    inline __both__ float halfToFloat(uint16_t half) {
+        const uint32_t sign = (static_cast<uint32_t>(half) & 0x8000u) << 16;
+        const uint32_t exponent = (half >> 10) & 0x1fu;
+        const uint32_t mantissa = half & 0x3ffu;
+
+        if (exponent == 0) {
+            const float value = ldexpf(static_cast<float>(mantissa), -24);
+            return sign ? -value : value;
+        }
+
+        const uint32_t x = exponent == 31
+            ? sign | 0x7f800000u | (mantissa << 13)
+            : sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+        float value;
+        memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+
+    inline __both__ uint32_t encodeUV(const owl::vec2f& uv) {
+        return static_cast<uint32_t>(floatToHalf(uv.x)) | (static_cast<uint32_t>(floatToHalf(uv.y)) << 16);
+    }
+
+    inline __both__ owl::vec2f decodeUV(uint32_t packed) {
+        return owl::vec2f(halfToFloat(static_cast<uint16_t>(packed & 0xffffu)), halfToFloat(static_cast<uint16_t>(packed >> 16)));
+    }
+
+    /* (u, v) are the barycentrics of the second and third vertex. The
+     * result is in object space and not normalised. */
+    inline __both__ owl::vec3f interpolateNormal(const uint32_t* normals, const owl::vec3i& index, float u, float v) {
+        return (1.f - u - v) * decodeNormal(normals[index.x])
+             + u * decodeNormal(normals[index.y])
+             + v * decodeNormal(normals[index.z]);
+    }
+
+    inline __both__ owl::vec2f interpolateUV(const uint32_t* uvs, const owl::vec3i& index, float u, float v) {
+        return (1.f - u - v) * decodeUV(uvs[index.x])
+             + u * decodeUV(uvs[index.y])
+             + v * decodeUV(uvs[index.z]);
+    }
+}
@@ -1,12 +1,68 @@
 #include "world.h"
+#include "trace.h"
+#include "triangleRecord.h"
 
-GeometryData loadGeometry(OWLContext &owlContext, const std::unique_ptr<World> &world){
+PackedScene packScene(const World &world, bool precomputeNormals) {
+  TRACE_SCOPE("packScene");
+  PackedScene packed;
+
+  size_t numVertices = 0, numIndices = 0;
+  bool anyNormals = false, anyUVs = false;
+  for (const auto &mesh : world.meshes) {
+    numVertices += mesh.vertices.size();
+    numIndices += mesh.indices.size();
+    anyNormals |= !mesh.normals.empty();
+    anyUVs |= !mesh.uvs.empty();
+  }
+  packed.vertices.reserve(numVertices);
+  packed.indices.reserve(numIndices);
+  if (precomputeNormals) packed.normals.reserve(numIndices);
+  if (anyNormals) packed.vertexNormals.reserve(numVertices);
+  if (anyUVs) packed.vertexUVs.reserve(numVertices);
+  packed.materials = world.materials;
+  packed.meshes.reserve(world.meshes.size());
+
+  for (const auto &mesh : world.meshes) {
+    PackedMesh entry;
+    entry.vertexOffset = static_cast<uint32_t>(packed.vertices.size());
+    entry.vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+    entry.indexOffset = static_cast<uint32_t>(packed.indices.size());
+    entry.indexCount = static_cast<uint32_t>(mesh.indices.size());
+    entry.materialID = mesh.materialID;
+    entry.hasNormals = !mesh.normals.empty();
+    entry.hasUVs = !mesh.uvs.empty();
+
+    packed.vertices.insert(packed.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+    packed.indices.insert(packed.indices.end(), mesh.indices.begin(), mesh.indices.end());
+    if (precomputeNormals) {
+      const auto normals = triangleNormals(mesh);
+      packed.normals.insert(packed.normals.end(), normals.begin(), normals.end());
+    }
+    if (anyNormals) {
+      if (entry.hasNormals) packed.vertexNormals.insert(packed.vertexNormals.end(), mesh.normals.begin(), mesh.normals.end());
+      else packed.vertexNormals.resize(packed.vertexNormals.size() + mesh.vertices.size(), 0u);
+    }
+    if (anyUVs) {
+      if (entry.hasUVs) packed.vertexUVs.insert(packed.vertexUVs.end(), mesh.uvs.begin(), mesh.uvs.end());
+      else packed.vertexUVs.resize(packed.vertexUVs.size() + mesh.vertices.size(), 0u);
+    }
+    packed.meshes.push_back(entry);
+  }
+  return packed;
+}
+
+GeometryData loadGeometry(OWLContext &owlContext, const std::unique_ptr<World> &world, bool precomputeNormals){
+  TRACE_SCOPE("loadGeometry");
   GeometryData data;
 
   OWLVarDecl trianglesGeomVars[] = {
-          { "index",  OWL_BUFPTR, OWL_OFFSETOF(TrianglesGeomData,index)},
-          { "vertex", OWL_BUFPTR, OWL_OFFSETOF(TrianglesGeomData,vertex)},
-          { "material", OWL_BUFPTR, OWL_OFFSETOF(TrianglesGeomData,material)},
+          { "index",  OWL_RAW_POINTER, OWL_OFFSETOF(TrianglesGeomData,index)},
+          { "vertex", OWL_RAW_POINTER, OWL_OFFSETOF(TrianglesGeomData,vertex)},
+          { "material", OWL_RAW_POINTER, OWL_OFFSETOF(TrianglesGeomData,material)},
+          { "materialID", OWL_UINT, OWL_OFFSETOF(TrianglesGeomData,materialID)},
+          { "normal", OWL_RAW_POINTER, OWL_OFFSETOF(TrianglesGeomData,normal)},
+          { "vertexNormal", OWL_RAW_POINTER, OWL_OFFSETOF(TrianglesGeomData,vertexNormal)},
+          { "vertexUV", OWL_RAW_POINTER, OWL_OFFSETOF(TrianglesGeomData,vertexUV)},
           { nullptr /* Sentinel to mark end-of-list */}
   };
 
@@ -15,43 +71,77 @@ GeometryData loadGeometry(OWLContext &owlContext, const std::unique_ptr<World> &
                                                 sizeof(TrianglesGeomData),
                                                 trianglesGeomVars,-1);
 
-  const int numMeshes = static_cast<int>(world->meshes.size());
-
-  for (int meshID=0; meshID<numMeshes; meshID++) {
-    auto mesh = world->meshes[meshID];
-    auto vertices = mesh.vertices;
-    auto indices = mesh.indices;
-    auto material = mesh.material;
+  const PackedScene packed = packScene(*world, precomputeNormals);
 
-    std::vector<Material> mats_vec = { *material };
+  {
+    TRACE_SCOPE("upload geometry");
+    data.vertexBuffer
+            = owlDeviceBufferCreate(owlContext,OWL_FLOAT3,packed.vertices.size(), packed.vertices.data());
+    data.indexBuffer
+            = owlDeviceBufferCreate(owlContext,OWL_INT3,packed.indices.size(), packed.indices.data());
+    data.materialBuffer
+            = owlDeviceBufferCreate(owlContext,OWL_USER_TYPE(Material),packed.materials.size(), packed.materials.data());
+    data.normalBuffer = precomputeNormals
+            ? owlDeviceBufferCreate(owlContext,OWL_FLOAT3,packed.normals.size(), packed.normals.data())
+            : nullptr;
+    data.vertexNormalBuffer = packed.vertexNormals.empty()
+            ? nullptr
+            : owlDeviceBufferCreate(owlContext,OWL_UINT,packed.vertexNormals.size(), packed.vertexNormals.data());
+    data.vertexUVBuffer = packed.vertexUVs.empty()
+            ? nullptr
+            : owlDeviceBufferCreate(owlContext,OWL_UINT,packed.vertexUVs.size(), packed.vertexUVs.data());
+  }
 
-    OWLBuffer vertexBuffer
-            = owlDeviceBufferCreate(owlContext,OWL_FLOAT3,vertices.size(), vertices.data());
-    OWLBuffer indexBuffer
-            = owlDeviceBufferCreate(owlContext,OWL_INT3,indices.size(), indices.data());
-    OWLBuffer materialBuffer
-            = owlDeviceBufferCreate(owlContext,OWL_USER_TYPE(Material),1, mats_vec.data());
+  // the context has a single device
+  auto *vertices = static_cast<owl::vec3f*>(const_cast<void*>(owlBufferGetPointer(data.vertexBuffer,0)));
+  auto *indices = static_cast<owl::vec3i*>(const_cast<void*>(owlBufferGetPointer(data.indexBuffer,0)));
+  auto *materials = static_cast<Material*>(const_cast<void*>(owlBufferGetPointer(data.materialBuffer,0)));
+  auto *normals = precomputeNormals
+          ? static_cast<owl::vec3f*>(const_cast<void*>(owlBufferGetPointer(data.normalBuffer,0)))
+          : nullptr;
+  auto *vertexNormals = data.vertexNormalBuffer
+          ? static_cast<uint32_t*>(const_cast<void*>(owlBufferGetPointer(data.vertexNormalBuffer,0)))
+          : nullptr;
+  auto *vertexUVs = data.vertexUVBuffer
+          ? static_cast<uint32_t*>(const_cast<void*>(owlBufferGetPointer(data.vertexUVBuffer,0)))
+          : nullptr;
 
+  for (const auto &mesh : packed.meshes) {
     OWLGeom trianglesGeom
             = owlGeomCreate(owlContext,data.trianglesGeomType);
 
-    owlTrianglesSetVertices(trianglesGeom,vertexBuffer,
-                            vertices.size(),sizeof(owl::vec3f),0);
-    owlTrianglesSetIndices(trianglesGeom,indexBuffer,
-                           indices.size(),sizeof(owl::vec3i),0);
+    owlTrianglesSetVertices(trianglesGeom,data.vertexBuffer,
+                            mesh.vertexCount,sizeof(owl::vec3f),mesh.vertexOffset*sizeof(owl::vec3f));
+    owlTrianglesSetIndices(trianglesGeom,data.indexBuffer,
+                           mesh.indexCount,sizeof(owl::vec3i),mesh.indexOffset*sizeof(owl::vec3i));
 
-    owlGeomSetBuffer(trianglesGeom,"vertex",vertexBuffer);
-    owlGeomSetBuffer(trianglesGeom,"index",indexBuffer);
-    owlGeomSetBuffer(trianglesGeom,"material", materialBuffer);
+    owlGeomSetPointer(trianglesGeom,"vertex",vertices + mesh.vertexOffset);
+    owlGeomSetPointer(trianglesGeom,"index",indices + mesh.indexOffset);
+    owlGeomSetPointer(trianglesGeom,"material",materials + mesh.materialID);
+    owlGeomSet1ui(trianglesGeom,"materialID",mesh.materialID);
+    owlGeomSetPointer(trianglesGeom,"normal",normals ? normals + mesh.indexOffset : nullptr);
+    owlGeomSetPointer(trianglesGeom,"vertexNormal",mesh.hasNormals ? vertexNormals + mesh.vertexOffset : nullptr);
+    owlGeomSetPointer(trianglesGeom,"vertexUV",mesh.hasUVs ? vertexUVs + mesh.vertexOffset : nullptr);
 
     data.geometry.push_back(trianglesGeom);
   }
 
-  data.trianglesGroup = owlTrianglesGeomGroupCreate(owlContext,data.geometry.size(),data.geometry.data());
-  owlGroupBuildAccel(data.trianglesGroup);
+  TRACE_SCOPE("build accel");
+  for (auto &geom : data.geometry) {
+    OWLGroup meshGroup = owlTrianglesGeomGroupCreate(owlContext,1,&geom);
+    owlGroupBuildAccel(meshGroup);
+    data.meshGroups.push_back(meshGroup);
+  }
 
-  data.worldGroup = owlInstanceGroupCreate(owlContext,1);
-  owlInstanceGroupSetChild(data.worldGroup,0,data.trianglesGroup);
+  const int numInstances = static_cast<int>(world->instances.size());
+  data.worldGroup = owlInstanceGroupCreate(owlContext,numInstances);
+  for (int instanceID=0; instanceID<numInstances; instanceID++) {
+    const auto &instance = world->instances[instanceID];
+    owlInstanceGroupSetChild(data.worldGroup,instanceID,data.meshGroups[instance.meshID]);
+    owlInstanceGroupSetTransform(data.worldGroup,instanceID,
+                                 reinterpret_cast<const float*>(&instance.transform),
+                                 OWL_MATRIX_FORMAT_OWL);
+  }
   owlGroupBuildAccel(data.worldGroup);
 
   return data;
@@ -2,6 +2,7 @@
 #include <vector>
 
 #include "owl/common/math/vec.h"
+#include "owl/common/math/AffineSpace.h"
 #include "owl/owl.h"
 #include "mesh.h"
 
@@ -23,20 +24,96 @@ struct LightSource {
     int num_photons;
 };
 
+/* One placement of a mesh prototype. */
+struct MeshInstance {
+    int meshID;
+    /* object to world */
+    owl::affine3f transform;
+};
+
 /* This holds all the state required for the path tracer to function.
  * As we use the STL, this is code in C++ land that needs a bit of
  * glue to transform to data that can be held in the GPU.
  */
 struct World {
     std::vector<LightSource> light_sources;
+    /* prototypes in object space, each stored once however often it is
+     * instanced */
     std::vector<Mesh> meshes;
+    std::vector<MeshInstance> instances;
+    /* one entry per distinct material, shared by every mesh that uses it */
+    std::vector<Material> materials;
+    /* image files referenced by Material::albedoTexture, sampled by the
+     * CPU renderer only */
+    std::vector<std::string> textures;
 };
 
+inline owl::affine3f identityTransform() {
+    owl::affine3f transform;
+    transform.l.vx = owl::vec3f(1.f, 0.f, 0.f);
+    transform.l.vy = owl::vec3f(0.f, 1.f, 0.f);
+    transform.l.vz = owl::vec3f(0.f, 0.f, 1.f);
+    transform.p = owl::vec3f(0.f);
+    return transform;
+}
+
+/* Triangles in the scene, counting every instance. */
+inline size_t numInstancedTriangles(const World &world) {
+    size_t count = 0;
+    for (const auto &instance : world.instances) count += world.meshes[instance.meshID].indices.size();
+    return count;
+}
+
+/* Where one mesh lives in the pools of a PackedScene. Indices are relative
+ * to vertexOffset. */
+struct PackedMesh {
+    uint32_t vertexOffset;
+    uint32_t vertexCount;
+    uint32_t indexOffset;
+    uint32_t indexCount;
+    uint32_t materialID;
+    /* whether the mesh's range of the vertex attribute pools is valid */
+    bool hasNormals;
+    bool hasUVs;
+};
+
+/* All mesh prototypes concatenated into one vertex pool, one index pool
+ * and the world's material table, so uploading a scene takes three
+ * allocations however many meshes it has. */
+struct PackedScene {
+    std::vector<owl::vec3f> vertices;
+    std::vector<owl::vec3i> indices;
+    std::vector<Material> materials;
+    /* one per triangle, indexed like `indices`; empty unless requested */
+    std::vector<owl::vec3f> normals;
+    /* packed vertex attributes, indexed like `vertices`; empty if no mesh
+     * has them, zero for the meshes that don't */
+    std::vector<uint32_t> vertexNormals;
+    std::vector<uint32_t> vertexUVs;
+    /* indexed like World::meshes */
+    std::vector<PackedMesh> meshes;
+};
+
+PackedScene packScene(const World &world, bool precomputeNormals = false);
+
+/* Two-level layout: one triangles group (BLAS) per mesh prototype and an
+ * instance group over them with the instance transforms. The geoms point
+ * into the pooled buffers. */
 struct GeometryData {
     std::vector<OWLGeom> geometry;
     OWLGeomType trianglesGeomType;
-    OWLGroup trianglesGroup;
+    std::vector<OWLGroup> meshGroups;
     OWLGroup worldGroup;
+    OWLBuffer vertexBuffer;
+    OWLBuffer indexBuffer;
+    OWLBuffer materialBuffer;
+    /* nullptr unless the normals are precomputed */
+    OWLBuffer normalBuffer;
+    /* nullptr if no mesh has vertex normals or UVs */
+    OWLBuffer vertexNormalBuffer;
+    OWLBuffer vertexUVBuffer;
 };
 
-GeometryData loadGeometry(OWLContext &owlContext, const std::unique_ptr<World> &world);
\ No newline at end of file
+/* precomputeNormals stores each triangle's normal at load time, so closest
+ * hits read it instead of three vertices (see triangleRecord.h). */
+GeometryData loadGeometry(OWLContext &owlContext, const std::unique_ptr<World> &world, bool precomputeNormals = false);
\ No newline at end of file
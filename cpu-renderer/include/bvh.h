@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "owl/common/math/box.h"
+#include "owl/common/math/AffineSpace.h"
+#include "../../common/src/world.h"
+#include "../../common/src/triangleRecord.h"
+#include "../../common/src/vertexAttributes.h"
+
+/* Two-level CPU BVH, used by the reference renderer, the CPU photon tracer
+ * and the benchmarks: one triangle BVH per mesh prototype in object space,
+ * and a top-level BVH over the world bounds of the instances. Rays are
+ * moved into object space per instance, so an instanced mesh costs its
+ * triangles once. */
+namespace cpu {
+    /* The first vertex and the precomputed edges and normal. */
+    struct BvhTriangle {
+        owl::vec3f a;
+        TriangleRecord record;
+        int primID;
+    };
+
+    /* Leaves have count > 0 and store their primitives at [first, first+count).
+     * Inner nodes have count == 0 and their children at first and first+1. */
+    struct BvhNode {
+        owl::box3f bounds;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    struct MeshBvh {
+        std::vector<BvhNode> nodes;
+        std::vector<BvhTriangle> triangles;
+    };
+
+    struct BvhInstance {
+        int meshID;
+        owl::affine3f toWorld;
+        owl::affine3f toObject;
+        /* world space */
+        owl::box3f bounds;
+    };
+
+    struct Bvh {
+        /* top level; leaves index `instances` */
+        std::vector<BvhNode> nodes;
+        std::vector<BvhInstance> instances;
+        /* indexed by World::meshes */
+        std::vector<MeshBvh> meshes;
+    };
+
+    struct Hit {
+        float t;
+        /* index into Bvh::instances */
+        int instanceID;
+        int meshID;
+        /* index into Bvh::meshes[meshID].triangles */
+        uint32_t triangle;
+        int primID;
+        /* barycentrics of b and c */
+        float u, v;
+    };
+
+    Bvh buildBvh(const World &world);
+
+    bool intersect(const Bvh &bvh, const owl::vec3f &org, const owl::vec3f &dir, float tmin, float tmax, Hit &hit);
+    bool occluded(const Bvh &bvh, const owl::vec3f &org, const owl::vec3f &dir, float tmin, float tmax);
+
+    /* Same convention as getPrimitiveNormal on the device: world space, not
+     * flipped towards the ray. */
+    inline owl::vec3f geometricNormal(const Bvh &bvh, const Hit &hit) {
+        const auto &tri = bvh.meshes[hit.meshID].triangles[hit.triangle];
+        const auto &l = bvh.instances[hit.instanceID].toObject.l;
+        return instanceNormal(tri.record.normal, owl::vec3f(l.vx.x, l.vy.x, l.vz.x),
+                              owl::vec3f(l.vx.y, l.vy.y, l.vz.y), owl::vec3f(l.vx.z, l.vy.z, l.vz.z));
+    }
+
+    /* Same as getShadingNormal on the device: the interpolated vertex
+     * normal in world space on the side of geometricNormal, or
+     * geometricNormal if the mesh has no normals. */
+    inline owl::vec3f shadingNormal(const Bvh &bvh, const World &world, const Hit &hit, const owl::vec3f &geometricNormal) {
+        const auto &mesh = world.meshes[hit.meshID];
+        if (mesh.normals.empty()) return geometricNormal;
+
+        const owl::vec3f n = vertex_attributes::interpolateNormal(mesh.normals.data(), mesh.indices[hit.primID], hit.u, hit.v);
+        const auto &l = bvh.instances[hit.instanceID].toObject.l;
+        // the transpose of the world-to-object transform maps normals to world space
+        const owl::vec3f normal = normalize(owl::vec3f(dot(l.vx, n), dot(l.vy, n), dot(l.vz, n)));
+        return dot(normal, geometricNormal) < 0.f ? -normal : normal;
+    }
+
+    inline owl::vec2f hitUV(const World &world, const Hit &hit) {
+        const auto &mesh = world.meshes[hit.meshID];
+        if (mesh.uvs.empty()) return owl::vec2f(0.f);
+        return vertex_attributes::interpolateUV(mesh.uvs.data(), mesh.indices[hit.primID], hit.u, hit.v);
+    }
+
+    /* Texture space length per world space length on the hit triangle,
+     * from the ratio of its areas in both; 0 if the mesh has no UVs. */
+    inline float uvDensity(const Bvh &bvh, const World &world, const Hit &hit) {
+        const auto &mesh = world.meshes[hit.meshID];
+        if (mesh.uvs.empty()) return 0.f;
+
+        const auto &index = mesh.indices[hit.primID];
+        const owl::vec2f a = vertex_attributes::decodeUV(mesh.uvs[index.x]);
+        const owl::vec2f b = vertex_attributes::decodeUV(mesh.uvs[index.y]);
+        const owl::vec2f c = vertex_attributes::decodeUV(mesh.uvs[index.z]);
+        const float uvArea = std::abs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y));
+
+        const auto &tri = bvh.meshes[hit.meshID].triangles[hit.triangle];
+        const auto &toWorld = bvh.instances[hit.instanceID].toWorld;
+        const float worldArea = length(cross(xfmVector(toWorld, tri.record.e1), xfmVector(toWorld, tri.record.e2)));
+        return worldArea > 0.f ? std::sqrt(uvArea / worldArea) : 0.f;
+    }
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "owl/common/math/box.h"
+#include "../../common/src/photonStorage.h"
+
+/* Out-of-core global photon map for the CPU renderer.
+ *
+ * The map is written once to a file that is partitioned into spatial
+ * chunks: the photons are binned into a 64^3 grid over their bounds, and an
+ * octree over the grid is split until every leaf holds at most
+ * chunkCapacity photons (a single grid cell may exceed it). Each leaf is a
+ * chunk, stored as its own photon map in KD-tree order (see
+ * photonStorage.h). The octree, with the photon bounds of every node, is
+ * the chunk index at the front of the file.
+ *
+ * Writing streams its source several times and never holds more than
+ * memoryBudget bytes of photons, so the map can be many times larger than
+ * memory. Rendering pages chunks in on demand and keeps the resident ones
+ * under memoryBudget by evicting the least recently used. A gather walks
+ * the octree nearest first and merges the K nearest photons across the
+ * chunks within reach, so it finds exactly the photons an in-memory
+ * KD-tree would.
+ *
+ * Only the K nearest lookup is supported; there is no precomputed
+ * irradiance for chunked maps.
+ */
+namespace cpu {
+    struct ChunkedPhotonMapSettings {
+        /* photons per chunk the octree aims for */
+        uint32_t chunkCapacity = 1u << 16;
+        /* bytes of resident chunks when rendering, of staged photons when
+         * writing */
+        size_t memoryBudget = 256u << 20;
+        int numThreads = 0;
+    };
+
+    struct ChunkedPhotonMapStats {
+        std::atomic<uint64_t> chunkHits{0};
+        std::atomic<uint64_t> chunkMisses{0};
+        std::atomic<uint64_t> evictions{0};
+    };
+
+    /* Calls its argument once per global photon record (flux premultiplied).
+     * Invoked once per pass over the source. */
+    using PhotonSource = std::function<void(const std::function<void(const photon_storage::PhotonRecord &)> &)>;
+
+    /* Writes the chunked map of `source` to `filename`. Returns false if a
+     * file can't be written. */
+    bool writeChunkedPhotonMap(const PhotonSource &source, const std::string &filename,
+                               const ChunkedPhotonMapSettings &settings = {});
+
+    /* Same from the photon files of the photon mapper, without loading them.
+     * The caustic photons go in too, since the chunked map stands in for
+     * gatherGlobal over both in-memory maps. */
+    bool writeChunkedPhotonMap(const std::string &photonsFile, const std::string &causticPhotonsFile,
+                               const std::string &filename, const ChunkedPhotonMapSettings &settings = {});
+
+    class ChunkedPhotonMap {
+    public:
+        /* Reads the chunk index of a file from writeChunkedPhotonMap; the
+         * chunks themselves are read on demand. */
+        explicit ChunkedPhotonMap(const std::string &filename, const ChunkedPhotonMapSettings &settings = {});
+        ~ChunkedPhotonMap();
+
+        ChunkedPhotonMap(const ChunkedPhotonMap &) = delete;
+        ChunkedPhotonMap &operator=(const ChunkedPhotonMap &) = delete;
+
+        /* false if the file is missing or not a chunked photon map */
+        bool valid() const { return file != nullptr; }
+
+        /* Cone-filtered estimate over the K nearest photons, like
+         * gatherPhotons on an in-memory KD-tree map. */
+        owl::vec3f gather(const owl::vec3f &hitpoint, float diffuse_brdf);
+
+        uint64_t numPhotons() const { return photonCount; }
+        size_t numChunks() const { return chunks.size(); }
+        size_t residentBytes() const;
+        const ChunkedPhotonMapStats &stats() const { return cacheStats; }
+
+        /* Photon bounds of an octree node, with its children or chunk. */
+        struct Node {
+            owl::box3f bounds;
+            int32_t firstChild;
+            int32_t numChildren;
+            /* index into the chunk table for leaves, -1 for inner nodes */
+            int32_t chunk;
+        };
+
+        struct ChunkInfo {
+            uint64_t offset;
+            uint32_t count;
+        };
+
+    private:
+        struct Chunk {
+            std::vector<photon_storage::PhotonNode> nodes;
+            std::vector<uint32_t> flux;
+        };
+
+        struct Resident {
+            std::shared_ptr<const Chunk> chunk;
+            std::list<int32_t>::iterator lru;
+        };
+
+        std::shared_ptr<const Chunk> chunk(int32_t id);
+
+        ChunkedPhotonMapSettings settings;
+        ChunkedPhotonMapStats cacheStats;
+        std::string filename;
+        FILE *file = nullptr;
+        uint64_t photonCount = 0;
+        std::vector<Node> octree;
+        std::vector<ChunkInfo> chunks;
+
+        mutable std::mutex mutex;
+        std::unordered_map<int32_t, Resident> resident;
+        /* most recently used at the front */
+        std::list<int32_t> lru;
+        size_t bytes = 0;
+    };
+}
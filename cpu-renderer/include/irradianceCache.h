@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "owl/common/math/box.h"
+
+/* Levels below the root; records that would go deeper stay at this depth,
+ * which keeps a lookup's traversal stack bounded. */
+#define IRRADIANCE_CACHE_MAX_DEPTH 24
+
+/* Ward-style irradiance cache for the diffuse indirect term of the CPU
+ * renderer (Ward, Rubinstein & Clear 1988; gradients after Ward & Heckbert
+ * 1992).
+ *
+ * Records are created lazily by the render workers where no existing record
+ * is valid, and reused by interpolation everywhere else. They live in an
+ * octree over the scene bounds, at most IRRADIANCE_CACHE_MAX_DEPTH levels
+ * deep; each record sits in the smallest node that is at least twice its
+ * validity radius, so a lookup only needs to visit the nodes whose bounds,
+ * grown by half their size, contain the query point.
+ *
+ * The rotational gradient is Ward & Heckbert's. The translational one is
+ * an approximation: their estimate needs the samples' stratification and
+ * the distances of neighbouring strata, which insert() doesn't get, so each
+ * sample instead contributes the change of a facing surface's cos/r^2
+ * under a tangential move. It reacts to nearby geometry like theirs but
+ * isn't exact, so keep `accuracy` small where extrapolation matters.
+ *
+ * Lookups take a shared lock and insertions an exclusive one, so any number
+ * of workers can use one cache. Records are added in whatever order the
+ * workers reach them, so unlike the uncached renderer a cached render with
+ * more than one thread is not bit-for-bit reproducible.
+ */
+namespace cpu {
+    struct IrradianceCacheSettings {
+        /* Ward's a: records are valid up to a * radius away, larger values
+         * reuse them further and interpolate more */
+        float accuracy = 0.25f;
+        /* clamp of the harmonic mean distance, in scene units */
+        float minRadius = 0.5f;
+        float maxRadius = 20.f;
+    };
+
+    struct IrradianceRecord {
+        owl::vec3f pos;
+        owl::vec3f normal;
+        owl::vec3f irradiance;
+        /* harmonic mean distance to the surfaces seen from pos */
+        float radius;
+        /* per colour channel: d irradiance / d position (approximate, see
+         * above), and the gradient for rotating the normal (change is
+         * dot(cross(n_i, n), gradient)) */
+        owl::vec3f translationGradient[3];
+        owl::vec3f rotationGradient[3];
+    };
+
+    /* One hemisphere sample used to create a record. */
+    struct IrradianceSample {
+        owl::vec3f direction;
+        owl::vec3f radiance;
+        float distance;
+    };
+
+    class IrradianceCache {
+    public:
+        IrradianceCache(const owl::box3f &sceneBounds, const IrradianceCacheSettings &settings = {});
+
+        /* Interpolates the cached irradiance at (pos, normal). Returns false
+         * if no record is valid there. */
+        bool lookup(const owl::vec3f &pos, const owl::vec3f &normal, owl::vec3f &irradiance) const;
+
+        /* Builds a record from the hemisphere samples taken at (pos, normal),
+         * adds it and returns the estimated irradiance. */
+        owl::vec3f insert(const owl::vec3f &pos, const owl::vec3f &normal, const std::vector<IrradianceSample> &samples);
+
+        size_t size() const;
+
+        /* Binary persistence, to carry the cache across the frames of a
+         * camera sweep. load() replaces the current records and returns false
+         * if the file is missing or was written with other settings. */
+        bool save(const std::string &filename) const;
+        bool load(const std::string &filename);
+
+    private:
+        struct Node {
+            owl::box3f bounds;
+            int32_t children[8];
+            std::vector<uint32_t> records;
+        };
+
+        void insertRecord(const IrradianceRecord &record);
+        void clear();
+
+        owl::box3f rootBounds;
+        IrradianceCacheSettings settings;
+        std::vector<Node> nodes;
+        std::vector<IrradianceRecord> records;
+        mutable std::shared_mutex mutex;
+    };
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "owl/common/math/box.h"
+#include "../../common/src/hashGrid.h"
+#include "../../common/src/photonStorage.h"
+
+namespace cpu {
+    class ChunkedPhotonMap;
+
+    /* A photon as deposited by the photon tracer, same layout as the
+     * photon mapper's output. */
+    struct Photon {
+        owl::vec3f pos;
+        owl::vec3f dir;
+        owl::vec3f color;
+    };
+
+    using photon_storage::PhotonNode;
+
+    struct PhotonNode_traits {
+        static inline owl::vec3f get_point(const PhotonNode &p) { return p.pos; }
+        static inline int get_dim(const PhotonNode &p) { return photon_storage::getDim(p); }
+        static inline void set_dim(PhotonNode &p, int dim) { photon_storage::setDim(p, dim); }
+    };
+
+    struct PhotonMapSettings {
+        hash_grid::PhotonLookup lookup = hash_grid::KD_TREE;
+        /* fixed gather radius, only used by HASH_GRID */
+        float gatherRadius = 1.f;
+
+        /* precompute irradiance at every irradianceStride-th global photon
+         * for the final gather */
+        bool precomputeIrradiance = false;
+        int irradianceStride = 4;
+        int numThreads = 0;
+    };
+
+    /* Photons in KD-tree order (see common/src/kdTree.h) or in hash bucket
+     * order (see common/src/hashGrid.h), stored like the ray tracer's maps
+     * (see common/src/photonStorage.h). */
+    struct PhotonMap {
+        std::vector<PhotonNode> nodes;
+        std::vector<uint32_t> flux;
+        owl::box3f bounds;
+
+        hash_grid::PhotonLookup lookup = hash_grid::KD_TREE;
+        float gatherRadius = 0.f;
+        float cellSize = 0.f;
+        std::vector<uint32_t> cellStart;
+    };
+
+    /* Every photon is stored once: `global` holds the non-caustic photons
+     * and global gathers (gatherGlobal) merge it with `caustic`. */
+    struct PhotonMaps {
+        PhotonMap global;
+        PhotonMap caustic;
+        /* empty unless PhotonMapSettings::precomputeIrradiance; always a
+         * KD-tree, with the normal in the direction bits */
+        PhotonMap irradiance;
+        /* optional; when set, global gathers page through it instead of
+         * using `global` and `irradiance` (see chunkedPhotonMap.h) */
+        ChunkedPhotonMap *globalChunks = nullptr;
+    };
+
+    /* All global records: the non-caustic photons with PHOTON_POWER, then
+     * the caustic ones with CAUSTICS_PHOTON_POWER. */
+    std::vector<photon_storage::PhotonRecord> globalPhotonRecords(const std::vector<Photon> &nonCaustic,
+                                                                  const std::vector<Photon> &caustic);
+
+    /* Same layout as the ray tracer's loadPhotons: the caustic photons, with
+     * CAUSTICS_PHOTON_POWER, go into `caustic` and the rest, with
+     * PHOTON_POWER, into `global`. */
+    PhotonMaps buildPhotonMaps(const std::vector<Photon> &nonCaustic, const std::vector<Photon> &caustic,
+                               const PhotonMapSettings &settings = {});
+
+    /* Rebuilds `map` from `records` with the map's current lookup, reusing
+     * its buffers. Used for progressive passes. */
+    void rebuildPhotonMap(const std::vector<photon_storage::PhotonRecord> &records, PhotonMap &map);
+
+    /* Cone-filtered density estimate, matching gatherPhotons and
+     * gatherPhotonsInRadius in ray-tracer/cuda/shading.h: over the K nearest
+     * photons for KD_TREE maps, over a fixed radius for HASH_GRID maps. */
+    owl::vec3f gatherPhotons(const PhotonMap &map, const owl::vec3f &hitpoint, const owl::vec3f &normal, float diffuse_brdf);
+
+    /* gatherPhotons over the global and the caustic map together, as if
+     * they were one map: a merged K nearest search, or the sum of both
+     * fixed-radius gathers. */
+    owl::vec3f gatherGlobal(const PhotonMaps &maps, const owl::vec3f &hitpoint, const owl::vec3f &normal, float diffuse_brdf);
+
+    /* Final gather estimate: the precomputed irradiance of the nearest point
+     * with a matching normal if there is one, gatherGlobal otherwise.
+     * Matches gatherIrradiance in ray-tracer/cuda/shading.h. With
+     * globalChunks it is always a gather on the chunked map. */
+    owl::vec3f gatherIrradiance(const PhotonMaps &maps, const owl::vec3f &hitpoint, const owl::vec3f &normal, float diffuse_brdf);
+}
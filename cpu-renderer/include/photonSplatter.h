@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "owl/common/math/vec.h"
+#include "../../common/src/parallel.h"
+#include "../../common/src/trace.h"
+#include "../../common/src/world.h"
+
+/* CPU alternative to the photon viewer's occlusion rays.
+ *
+ * The scene is rasterised once into a depth buffer from the viewer's
+ * camera. Photon maps are then projected, depth tested against it and
+ * splatted into an image in one parallel, linear pass over the map, with
+ * no GPU and no ray per photon.
+ *
+ * Depths are stored as 1/w (w is the view depth), which interpolates
+ * linearly in screen space. A photon is visible if it is at most
+ * depthBias (relative) behind the nearest surface at its pixel. Pixels
+ * follow the viewer's convention, row 0 at the top.
+ */
+#define SPLAT_BLOCK 4096
+
+namespace cpu {
+    enum SplatMode {
+        /* colour of the last photon in map order on each pixel, like the
+         * GPU viewer */
+        SPLAT_COLOR = 0,
+        /* visible photons per pixel, log scaled to grey */
+        SPLAT_DENSITY = 1,
+        /* summed flux per pixel, log scaled through a heat ramp */
+        SPLAT_HEATMAP = 2
+    };
+
+    struct SplatSettings {
+        SplatMode mode = SPLAT_COLOR;
+        float depthBias = 1e-2f;
+        int numThreads = 0;
+    };
+
+    class DepthBuffer {
+    public:
+        /* `viewProjection` is a glm (column-major) matrix with OpenGL clip
+         * space, as built by glm::perspective. */
+        DepthBuffer(const World &world, const glm::mat4 &viewProjection, const owl::vec2i &size, int numThreads = 0);
+
+        const glm::mat4 &viewProjection() const { return projection; }
+        const owl::vec2i &size() const { return fbSize; }
+        /* 1/w of the nearest surface, 0 where there is none */
+        float inverseDepth(int x, int y) const { return depth[x + fbSize.x * y]; }
+
+    private:
+        glm::mat4 projection;
+        owl::vec2i fbSize;
+        std::vector<float> depth;
+    };
+
+    /* RGBA8 pixels of the per pixel values accumulated by splatPhotons in
+     * SPLAT_DENSITY (counts) or SPLAT_HEATMAP (double flux bits) mode. */
+    std::vector<uint32_t> resolveSplats(const std::atomic<uint64_t> *values, size_t numPixels, SplatMode mode);
+
+    uint32_t splatRGBA(const owl::vec3f &colour);
+
+    /* Splats the photons visible in `depthBuffer` into an RGBA8 image of
+     * its size, row 0 at the top, black where no photon lands. PhotonT
+     * needs `pos` and `color`. */
+    template<typename PhotonT>
+    std::vector<uint32_t> splatPhotons(const DepthBuffer &depthBuffer, const std::vector<PhotonT> &photons,
+                                       const SplatSettings &settings) {
+        TRACE_SCOPE("splat photons");
+        const owl::vec2i size = depthBuffer.size();
+        const size_t numPixels = static_cast<size_t>(size.x) * size.y;
+        // value-initialised, so all zero
+        std::unique_ptr<std::atomic<uint64_t>[]> values(new std::atomic<uint64_t>[numPixels]());
+
+        const glm::mat4 &m = depthBuffer.viewProjection();
+        const float bias = 1.f + settings.depthBias;
+        const size_t numBlocks = (photons.size() + SPLAT_BLOCK - 1) / SPLAT_BLOCK;
+        parallel::forEach(numBlocks, [&](size_t b) {
+            const size_t end = std::min((b + 1) * SPLAT_BLOCK, photons.size());
+            for (size_t i = b * SPLAT_BLOCK; i < end; i++) {
+                const auto &pos = photons[i].pos;
+                const float cx = m[0][0] * pos.x + m[1][0] * pos.y + m[2][0] * pos.z + m[3][0];
+                const float cy = m[0][1] * pos.x + m[1][1] * pos.y + m[2][1] * pos.z + m[3][1];
+                const float cz = m[0][2] * pos.x + m[1][2] * pos.y + m[2][2] * pos.z + m[3][2];
+                const float cw = m[0][3] * pos.x + m[1][3] * pos.y + m[2][3] * pos.z + m[3][3];
+                if (!(cw > 0.f) || cz < -cw) continue;
+
+                const float sx = (cx / cw + 1.f) * 0.5f * size.x;
+                const float sy = (cy / cw + 1.f) * 0.5f * size.y;
+                if (!(sx >= 0.f && sx < size.x && sy >= 0.f && sy < size.y + 1.f)) continue;
+                const int x = static_cast<int>(sx);
+                const int y = size.y - static_cast<int>(sy);
+                if (y >= size.y) continue;
+
+                // behind the nearest surface
+                if (bias / cw < depthBuffer.inverseDepth(x, y)) continue;
+
+                auto &value = values[x + static_cast<size_t>(size.x) * y];
+                if (settings.mode == SPLAT_COLOR) {
+                    // the highest index wins, so the result doesn't depend on the threads
+                    uint64_t current = value.load(std::memory_order_relaxed);
+                    while (current < i + 1 && !value.compare_exchange_weak(current, i + 1, std::memory_order_relaxed)) {}
+                } else if (settings.mode == SPLAT_DENSITY) {
+                    value.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    const double flux = (photons[i].color.x + photons[i].color.y + photons[i].color.z) / 3.0;
+                    uint64_t current = value.load(std::memory_order_relaxed);
+                    uint64_t next;
+                    do {
+                        double sum;
+                        std::memcpy(&sum, &current, sizeof(sum));
+                        sum += flux;
+                        std::memcpy(&next, &sum, sizeof(next));
+                    } while (!value.compare_exchange_weak(current, next, std::memory_order_relaxed));
+                }
+            }
+        }, settings.numThreads);
+
+        if (settings.mode != SPLAT_COLOR) return resolveSplats(values.get(), numPixels, settings.mode);
+
+        std::vector<uint32_t> image(numPixels);
+        for (size_t p = 0; p < numPixels; p++) {
+            const uint64_t last = values[p].load(std::memory_order_relaxed);
+            image[p] = last ? splatRGBA(photons[last - 1].color) : splatRGBA(owl::vec3f(0.f));
+        }
+        return image;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+#include "photonMap.h"
+#include "textureCache.h"
+#include "../../common/src/world.h"
+
+namespace cpu {
+    struct PhotonTracerSettings {
+        int maxDepth;
+        int64_t castedDiffusePhotons;
+        int64_t castedCausticsPhotons;
+        uint32_t seed;
+        int numThreads;
+        /* bounces before Russian roulette starts, negative disables it */
+        int rrMinDepth = -1;
+        /* optional, shared with the renderer; photons point sample the
+         * finest mip level */
+        TextureCache *textures = nullptr;
+    };
+
+    struct TracedPhotons {
+        std::vector<Photon> global;
+        std::vector<Photon> caustic;
+        /* rays traced for each map */
+        uint64_t globalRays = 0;
+        uint64_t causticRays = 0;
+    };
+
+    /* CPU port of photon-mapping/cuda/deviceCode.cu. Photon i of every light
+     * draws from the same random stream as launch index (i, seed) on the GPU,
+     * with the upper half of a 64-bit i added to the seed as there, and the
+     * output order only depends on the inputs. */
+    TracedPhotons tracePhotons(const World &world, const Bvh &bvh, const PhotonTracerSettings &settings);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+#include "irradianceCache.h"
+#include "photonMap.h"
+#include "textureCache.h"
+#include "../../common/src/camera.h"
+#include "../../common/src/lightTree.h"
+#include "../../common/src/world.h"
+
+namespace cpu {
+    struct RenderStats {
+        /* closest-hit rays along the camera paths, without shadow and
+         * final gather rays */
+        std::atomic<uint64_t> pathSegments{0};
+    };
+
+    struct RenderSettings {
+        owl::vec2i fbSize;
+        int samplesPerPixel;
+        int maxDepth;
+        owl::vec3f skyColour;
+        uint32_t seed;
+        int numThreads;
+        /* optional; reused and extended for the diffuse indirect term */
+        IrradianceCache *irradianceCache = nullptr;
+        /* bounces before Russian roulette starts, negative disables it */
+        int rrMinDepth = -1;
+        /* LIGHT_TREE samples lightSamples lights per hit instead of
+         * tracing a shadow ray to every light */
+        light_tree::LightSampling lightSampling = light_tree::ALL_LIGHTS;
+        int lightSamples = 1;
+        /* optional; counters are added to, not reset */
+        RenderStats *stats = nullptr;
+        /* optional; without it textured materials use their constant albedo */
+        TextureCache *textures = nullptr;
+    };
+
+    /* CPU port of ray-tracer/cuda/deviceCode.cu. Returns RGBA8 pixels,
+     * row 0 at the top, like the frame buffer written by the ray tracer. */
+    std::vector<uint32_t> render(const World &world, const Bvh &bvh, const PhotonMaps &photonMaps,
+                                 const Camera &camera, const RenderSettings &settings);
+}
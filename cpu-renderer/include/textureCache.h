@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+#include "../../common/src/mesh.h"
+
+/* Tiled, mip-mapped cache for the albedo textures of the CPU renderer and
+ * the CPU photon tracer. The GPU ray tracer and photon mapper have no
+ * texture path and refuse scenes with textured materials.
+ *
+ * The first lookup into a texture decodes the image once, builds its mip
+ * chain in linear colour and writes it as square sRGB8 tiles to a file in
+ * settings.directory (reused by later runs while it is newer than the
+ * image). From then on only the tiles a lookup touches are read, and the
+ * resident tiles of all textures are kept under settings.memoryBudget by
+ * evicting the least recently used ones. Lookups pick the mip level from
+ * the footprint of the hit in texture space and filter trilinearly.
+ *
+ * One mutex guards the tile table, so misses are serialised; lookups keep
+ * a reference to their tiles and can't be invalidated by an eviction.
+ */
+namespace cpu {
+    struct TextureCacheSettings {
+        /* bytes of resident tiles over all textures */
+        size_t memoryBudget = 64u << 20;
+        /* texels per tile side */
+        int tileSize = 64;
+        /* where the tiled pyramids are written; empty for the temp directory */
+        std::string directory;
+    };
+
+    struct TextureCacheStats {
+        std::atomic<uint64_t> tileHits{0};
+        std::atomic<uint64_t> tileMisses{0};
+        std::atomic<uint64_t> evictions{0};
+    };
+
+    class TextureCache {
+    public:
+        /* `files` are indexed by Material::albedoTexture (World::textures). */
+        explicit TextureCache(const std::vector<std::string> &files, const TextureCacheSettings &settings = {});
+        ~TextureCache();
+
+        TextureCache(const TextureCache &) = delete;
+        TextureCache &operator=(const TextureCache &) = delete;
+
+        /* Linear RGB of texture `id` at `uv` (repeating), filtered over
+         * `footprint`, the width of the lookup in uv units. 0 samples the
+         * finest level. A texture that can't be loaded is white. */
+        owl::vec3f sample(int id, const owl::vec2f &uv, float footprint);
+
+        size_t residentBytes() const;
+        const TextureCacheStats &stats() const { return cacheStats; }
+
+    private:
+        struct Level {
+            int width, height;
+            int tilesX, tilesY;
+            /* index of the level's first tile in the file */
+            uint64_t firstTile;
+        };
+
+        struct Texture {
+            std::string file;
+            /* set by prepare(): the levels and tile file are usable */
+            bool valid = false;
+            std::vector<Level> levels;
+            FILE *tiles = nullptr;
+        };
+
+        using Tile = std::vector<uint32_t>;
+
+        struct Resident {
+            std::shared_ptr<const Tile> tile;
+            std::list<uint64_t>::iterator lru;
+        };
+
+        void prepare(int id);
+        std::shared_ptr<const Tile> tile(int id, int level, int tx, int ty);
+        owl::vec3f bilinear(int id, int level, const owl::vec2f &uv);
+
+        TextureCacheSettings settings;
+        TextureCacheStats cacheStats;
+        std::vector<Texture> textures;
+        /* one per texture, prepare() runs on its first lookup */
+        std::unique_ptr<std::once_flag[]> prepared;
+
+        mutable std::mutex mutex;
+        /* key: texture, level and tile packed by tileKey() */
+        std::unordered_map<uint64_t, Resident> resident;
+        /* most recently used at the front */
+        std::list<uint64_t> lru;
+        size_t bytes = 0;
+    };
+
+    /* Albedo of `material` at a hit: the constant albedo, modulated by its
+     * texture if it has one and a cache is given. */
+    inline owl::vec3f albedo(const Material &material, TextureCache *textures, const owl::vec2f &uv, float footprint) {
+        if (!textures || material.albedoTexture < 0) return material.albedo;
+        return material.albedo * textures->sample(material.albedoTexture, uv, footprint);
+    }
+}
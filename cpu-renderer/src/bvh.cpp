@@ -0,0 +1,299 @@
+#include "../include/bvh.h"
+
+#include <algorithm>
+
+#include "../../common/src/parallel.h"
+#include "../../common/src/trace.h"
+
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_NUM_BINS 16
+/* below this depth splits fall back to halving, which bounds the traversal stack */
+#define BVH_MAX_SAH_DEPTH 40
+
+namespace {
+  using namespace owl;
+
+  vec3f centroid(const cpu::BvhTriangle &tri) {
+    return tri.a + (tri.record.e1 + tri.record.e2) * (1.f / 3.f);
+  }
+
+  box3f primitiveBounds(const cpu::BvhTriangle &tri) {
+    box3f box;
+    box.extend(tri.a);
+    box.extend(tri.a + tri.record.e1);
+    box.extend(tri.a + tri.record.e2);
+    return box;
+  }
+
+  vec3f centroid(const cpu::BvhInstance &instance) {
+    return instance.bounds.center();
+  }
+
+  box3f primitiveBounds(const cpu::BvhInstance &instance) {
+    return instance.bounds;
+  }
+
+  float area(const box3f &box) {
+    if (box.upper.x < box.lower.x) return 0.f;
+    const vec3f d = box.upper - box.lower;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  /* Binned SAH split of primitives [first, first+count), triangles or
+   * instances. Returns the number that end up in the left child, or 0 to
+   * make a leaf. */
+  template<typename Prim>
+  uint32_t partition(std::vector<Prim> &tris, uint32_t first, uint32_t count, float parentArea) {
+    box3f centroidBounds;
+    for (uint32_t i = first; i < first + count; i++) centroidBounds.extend(centroid(tris[i]));
+
+    const vec3f extent = centroidBounds.upper - centroidBounds.lower;
+    const int dim = extent.x >= extent.y ? (extent.x >= extent.z ? 0 : 2) : (extent.y >= extent.z ? 1 : 2);
+    if (extent[dim] <= 0.f) return count / 2;
+
+    struct Bin { box3f bounds; uint32_t count = 0; };
+    Bin bins[BVH_NUM_BINS];
+    const float scale = BVH_NUM_BINS / extent[dim];
+    auto binOf = [&](const Prim &tri) {
+      const int b = static_cast<int>((centroid(tri)[dim] - centroidBounds.lower[dim]) * scale);
+      return std::min(b, BVH_NUM_BINS - 1);
+    };
+
+    for (uint32_t i = first; i < first + count; i++) {
+      Bin &bin = bins[binOf(tris[i])];
+      bin.bounds.extend(primitiveBounds(tris[i]));
+      bin.count++;
+    }
+
+    // sweep from the right to get suffix areas, then from the left
+    float rightArea[BVH_NUM_BINS];
+    uint32_t rightCount[BVH_NUM_BINS];
+    box3f acc;
+    uint32_t accCount = 0;
+    for (int b = BVH_NUM_BINS - 1; b > 0; b--) {
+      acc.extend(bins[b].bounds);
+      accCount += bins[b].count;
+      rightArea[b] = area(acc);
+      rightCount[b] = accCount;
+    }
+
+    float bestCost = static_cast<float>(count);
+    int bestSplit = -1;
+    acc = box3f();
+    accCount = 0;
+    for (int b = 0; b < BVH_NUM_BINS - 1; b++) {
+      acc.extend(bins[b].bounds);
+      accCount += bins[b].count;
+      if (accCount == 0 || rightCount[b + 1] == 0) continue;
+      const float cost = (area(acc) * accCount + rightArea[b + 1] * rightCount[b + 1]) / parentArea;
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestSplit = b;
+      }
+    }
+
+    if (bestSplit < 0) {
+      return count > BVH_MAX_LEAF_SIZE ? count / 2 : 0;
+    }
+
+    const auto mid = std::partition(tris.begin() + first, tris.begin() + first + count,
+                                    [&](const Prim &tri) { return binOf(tri) <= bestSplit; });
+    return static_cast<uint32_t>(mid - (tris.begin() + first));
+  }
+
+  template<typename Prim>
+  void buildNode(std::vector<cpu::BvhNode> &nodes, std::vector<Prim> &prims, uint32_t nodeID, uint32_t first, uint32_t count, int depth) {
+    box3f bounds;
+    for (uint32_t i = first; i < first + count; i++) bounds.extend(primitiveBounds(prims[i]));
+    nodes[nodeID].bounds = bounds;
+
+    uint32_t leftCount = 0;
+    if (count > BVH_MAX_LEAF_SIZE) {
+      leftCount = depth < BVH_MAX_SAH_DEPTH ? partition(prims, first, count, area(bounds)) : count / 2;
+    }
+    if (leftCount == 0 || leftCount == count) {
+      nodes[nodeID].first = first;
+      nodes[nodeID].count = count;
+      return;
+    }
+
+    const auto leftID = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[nodeID].first = leftID;
+    nodes[nodeID].count = 0;
+
+    buildNode(nodes, prims, leftID, first, leftCount, depth + 1);
+    buildNode(nodes, prims, leftID + 1, first + leftCount, count - leftCount, depth + 1);
+  }
+
+  template<typename Prim>
+  void buildNodes(std::vector<cpu::BvhNode> &nodes, std::vector<Prim> &prims) {
+    if (prims.empty()) return;
+    nodes.reserve(2 * prims.size());
+    nodes.emplace_back();
+    buildNode(nodes, prims, 0, 0, static_cast<uint32_t>(prims.size()), 0);
+  }
+
+  box3f transformBounds(const affine3f &transform, const box3f &box) {
+    box3f result;
+    for (int corner = 0; corner < 8; corner++) {
+      const vec3f p((corner & 1) ? box.upper.x : box.lower.x,
+                    (corner & 2) ? box.upper.y : box.lower.y,
+                    (corner & 4) ? box.upper.z : box.lower.z);
+      result.extend(xfmPoint(transform, p));
+    }
+    return result;
+  }
+
+  bool intersectBox(const box3f &box, const vec3f &org, const vec3f &invDir, float tmin, float tmax) {
+    for (int d = 0; d < 3; d++) {
+      float t0 = (box.lower[d] - org[d]) * invDir[d];
+      float t1 = (box.upper[d] - org[d]) * invDir[d];
+      if (t0 > t1) std::swap(t0, t1);
+      tmin = std::max(tmin, t0);
+      tmax = std::min(tmax, t1);
+      if (tmin > tmax) return false;
+    }
+    return true;
+  }
+
+  /* Moeller-Trumbore. Returns true and fills t/u/v for hits in (tmin, tmax). */
+  bool intersectTriangle(const cpu::BvhTriangle &tri, const vec3f &org, const vec3f &dir,
+                         float tmin, float tmax, float &t, float &u, float &v) {
+    const vec3f &e1 = tri.record.e1;
+    const vec3f &e2 = tri.record.e2;
+    const vec3f p = cross(dir, e2);
+    const float det = dot(e1, p);
+    if (det == 0.f) return false;
+
+    const float invDet = 1.f / det;
+    const vec3f s = org - tri.a;
+    u = dot(s, p) * invDet;
+    if (u < 0.f || u > 1.f) return false;
+
+    const vec3f q = cross(s, e1);
+    v = dot(dir, q) * invDet;
+    if (v < 0.f || u + v > 1.f) return false;
+
+    t = dot(e2, q) * invDet;
+    return t > tmin && t < tmax;
+  }
+
+  /* Closest (or any) hit in one mesh, in its object space. Shrinks tmax to
+   * the closest hit found. */
+  template<bool anyHit>
+  bool traverseMesh(const cpu::MeshBvh &mesh, const vec3f &org, const vec3f &dir, float tmin, float &tmax, cpu::Hit &hit) {
+    if (mesh.nodes.empty()) return false;
+
+    const vec3f invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    uint32_t stack[128];
+    int top = 0;
+    stack[top++] = 0;
+
+    bool found = false;
+    while (top > 0) {
+      const cpu::BvhNode &node = mesh.nodes[stack[--top]];
+      if (!intersectBox(node.bounds, org, invDir, tmin, tmax)) continue;
+
+      if (node.count == 0) {
+        stack[top++] = node.first;
+        stack[top++] = node.first + 1;
+        continue;
+      }
+
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        float t, u, v;
+        if (!intersectTriangle(mesh.triangles[i], org, dir, tmin, tmax, t, u, v)) continue;
+        if (anyHit) return true;
+
+        found = true;
+        tmax = t;
+        hit.t = t;
+        hit.triangle = i;
+        hit.primID = mesh.triangles[i].primID;
+        hit.u = u;
+        hit.v = v;
+      }
+    }
+    return found;
+  }
+
+  template<bool anyHit>
+  bool traverse(const cpu::Bvh &bvh, const vec3f &org, const vec3f &dir, float tmin, float tmax, cpu::Hit &hit) {
+    if (bvh.nodes.empty()) return false;
+
+    const vec3f invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    uint32_t stack[128];
+    int top = 0;
+    stack[top++] = 0;
+
+    bool found = false;
+    while (top > 0) {
+      const cpu::BvhNode &node = bvh.nodes[stack[--top]];
+      if (!intersectBox(node.bounds, org, invDir, tmin, tmax)) continue;
+
+      if (node.count == 0) {
+        stack[top++] = node.first;
+        stack[top++] = node.first + 1;
+        continue;
+      }
+
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const cpu::BvhInstance &instance = bvh.instances[i];
+        // the direction is not renormalised, so t is the same in both spaces
+        const vec3f objectOrg = xfmPoint(instance.toObject, org);
+        const vec3f objectDir = xfmVector(instance.toObject, dir);
+        if (!traverseMesh<anyHit>(bvh.meshes[instance.meshID], objectOrg, objectDir, tmin, tmax, hit)) continue;
+        if (anyHit) return true;
+
+        found = true;
+        hit.instanceID = static_cast<int>(i);
+        hit.meshID = instance.meshID;
+      }
+    }
+    return found;
+  }
+}
+
+cpu::Bvh cpu::buildBvh(const World &world) {
+  TRACE_SCOPE("cpu::buildBvh");
+  Bvh bvh;
+
+  // one BVH per prototype, however often it is instanced
+  bvh.meshes.resize(world.meshes.size());
+  parallel::forEach(world.meshes.size(), [&](size_t meshID) {
+    const auto &mesh = world.meshes[meshID];
+    auto &meshBvh = bvh.meshes[meshID];
+    meshBvh.triangles.reserve(mesh.indices.size());
+    for (int primID = 0; primID < static_cast<int>(mesh.indices.size()); primID++) {
+      const auto &index = mesh.indices[primID];
+      const vec3f &a = mesh.vertices[index.x];
+      meshBvh.triangles.push_back({a, makeTriangleRecord(a, mesh.vertices[index.y], mesh.vertices[index.z]), primID});
+    }
+    buildNodes(meshBvh.nodes, meshBvh.triangles);
+  });
+
+  for (const auto &instance : world.instances) {
+    const auto &meshBvh = bvh.meshes[instance.meshID];
+    if (meshBvh.nodes.empty()) continue;
+
+    BvhInstance bvhInstance;
+    bvhInstance.meshID = instance.meshID;
+    bvhInstance.toWorld = instance.transform;
+    bvhInstance.toObject = rcp(instance.transform);
+    bvhInstance.bounds = transformBounds(instance.transform, meshBvh.nodes.front().bounds);
+    bvh.instances.push_back(bvhInstance);
+  }
+  buildNodes(bvh.nodes, bvh.instances);
+  return bvh;
+}
+
+bool cpu::intersect(const Bvh &bvh, const vec3f &org, const vec3f &dir, float tmin, float tmax, Hit &hit) {
+  return traverse<false>(bvh, org, dir, tmin, tmax, hit);
+}
+
+bool cpu::occluded(const Bvh &bvh, const vec3f &org, const vec3f &dir, float tmin, float tmax) {
+  Hit hit;
+  return traverse<true>(bvh, org, dir, tmin, tmax, hit);
+}
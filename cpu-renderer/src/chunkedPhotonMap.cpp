@@ -0,0 +1,422 @@
+#include "../include/chunkedPhotonMap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "../../common/src/kdTree.h"
+#include "../../common/src/parallel.h"
+#include "../../common/src/photonFile.h"
+#include "../../common/src/shadingMath.h"
+#include "../../common/src/trace.h"
+#include "../../ray-tracer/include/renderConstants.h"
+
+using namespace owl;
+
+#define PHOTON_CHUNKS_MAGIC 0x4b484350u /* "PCHK" */
+#define PHOTON_CHUNKS_VERSION 1u
+/* the octree is split down to cells of this grid at most */
+#define PHOTON_CHUNKS_GRID 64
+
+namespace {
+  using photon_storage::PhotonNode;
+  using photon_storage::PhotonRecord;
+
+  const float CONE_FILTER_NORMALISATION = 1 - (2.f/3.f) * (1.f/CONE_FILTER_C);
+  const size_t CHUNK_PHOTON_BYTES = sizeof(PhotonNode) + sizeof(uint32_t);
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numNodes;
+    uint32_t numChunks;
+    uint64_t numPhotons;
+  };
+
+  struct PhotonNode_traits {
+    static inline vec3f get_point(const PhotonNode &p) { return p.pos; }
+    static inline int get_dim(const PhotonNode &p) { return photon_storage::getDim(p); }
+    static inline void set_dim(PhotonNode &p, int dim) { photon_storage::setDim(p, dim); }
+  };
+
+  float boxDistance2(const box3f &box, const vec3f &p) {
+    const vec3f d = max(vec3f(0.f), max(box.lower - p, p - box.upper));
+    return dot(d, d);
+  }
+
+  /* The grid over the photon bounds that the octree is built on. */
+  struct Grid {
+    box3f bounds;
+    vec3f scale;
+
+    explicit Grid(const box3f &photonBounds) : bounds(photonBounds) {
+      const vec3f extent = max(bounds.upper - bounds.lower, vec3f(1e-6f));
+      scale = vec3f(static_cast<float>(PHOTON_CHUNKS_GRID)) / extent;
+    }
+
+    size_t cell(const vec3f &p) const {
+      const vec3f c = (p - bounds.lower) * scale;
+      const int x = std::clamp(static_cast<int>(c.x), 0, PHOTON_CHUNKS_GRID - 1);
+      const int y = std::clamp(static_cast<int>(c.y), 0, PHOTON_CHUNKS_GRID - 1);
+      const int z = std::clamp(static_cast<int>(c.z), 0, PHOTON_CHUNKS_GRID - 1);
+      return index(x, y, z);
+    }
+
+    static size_t index(int x, int y, int z) {
+      return (static_cast<size_t>(z) * PHOTON_CHUNKS_GRID + y) * PHOTON_CHUNKS_GRID + x;
+    }
+  };
+
+  /* Splits the grid into an octree whose leaves are the chunks. Children of
+   * a node are contiguous; empty octants get no node. */
+  struct OctreeBuilder {
+    OctreeBuilder(const std::vector<uint64_t> &cellCounts, const std::vector<box3f> &cellBounds, uint32_t capacity)
+        : cellCounts(cellCounts), cellBounds(cellBounds), capacity(capacity) {}
+
+    const std::vector<uint64_t> &cellCounts;
+    const std::vector<box3f> &cellBounds;
+    uint32_t capacity;
+
+    std::vector<cpu::ChunkedPhotonMap::Node> nodes;
+    std::vector<cpu::ChunkedPhotonMap::ChunkInfo> chunks;
+    std::vector<int32_t> chunkOfCell;
+
+    void cubeStats(const vec3i &lo, int size, uint64_t &count, box3f &bounds) const {
+      count = 0;
+      bounds = box3f();
+      for (int z = lo.z; z < lo.z + size; z++) {
+        for (int y = lo.y; y < lo.y + size; y++) {
+          for (int x = lo.x; x < lo.x + size; x++) {
+            const size_t cell = Grid::index(x, y, z);
+            count += cellCounts[cell];
+            if (cellCounts[cell]) bounds.extend(cellBounds[cell]);
+          }
+        }
+      }
+    }
+
+    void fill(size_t slot, const vec3i &lo, int size, uint64_t count, const box3f &bounds) {
+      cpu::ChunkedPhotonMap::Node node;
+      node.bounds = bounds;
+      node.firstChild = -1;
+      node.numChildren = 0;
+      node.chunk = -1;
+
+      if (count <= capacity || size == 1) {
+        node.chunk = static_cast<int32_t>(chunks.size());
+        chunks.push_back({0, static_cast<uint32_t>(count)});
+        for (int z = lo.z; z < lo.z + size; z++) {
+          for (int y = lo.y; y < lo.y + size; y++) {
+            for (int x = lo.x; x < lo.x + size; x++) chunkOfCell[Grid::index(x, y, z)] = node.chunk;
+          }
+        }
+        nodes[slot] = node;
+        return;
+      }
+
+      const int half = size / 2;
+      vec3i childLo[8];
+      uint64_t childCount[8];
+      box3f childBounds[8];
+      int numChildren = 0;
+      for (int octant = 0; octant < 8; octant++) {
+        const vec3i corner = lo + vec3i(octant & 1, (octant >> 1) & 1, (octant >> 2) & 1) * half;
+        cubeStats(corner, half, childCount[numChildren], childBounds[numChildren]);
+        if (childCount[numChildren] == 0) continue;
+        childLo[numChildren++] = corner;
+      }
+
+      node.firstChild = static_cast<int32_t>(nodes.size());
+      node.numChildren = numChildren;
+      nodes[slot] = node;
+      nodes.resize(nodes.size() + numChildren);
+      for (int c = 0; c < numChildren; c++) {
+        fill(node.firstChild + c, childLo[c], half, childCount[c], childBounds[c]);
+      }
+    }
+
+    void build() {
+      chunkOfCell.assign(cellCounts.size(), -1);
+      uint64_t count;
+      box3f bounds;
+      cubeStats(vec3i(0), PHOTON_CHUNKS_GRID, count, bounds);
+      if (count == 0) return;
+      nodes.resize(1);
+      fill(0, vec3i(0), PHOTON_CHUNKS_GRID, count, bounds);
+    }
+  };
+
+  bool writeAt(FILE *file, uint64_t offset, const void *data, size_t size) {
+    return std::fseek(file, static_cast<long>(offset), SEEK_SET) == 0
+        && std::fwrite(data, 1, size, file) == size;
+  }
+
+  bool readAt(FILE *file, uint64_t offset, void *data, size_t size) {
+    return std::fseek(file, static_cast<long>(offset), SEEK_SET) == 0
+        && std::fread(data, 1, size, file) == size;
+  }
+}
+
+bool cpu::writeChunkedPhotonMap(const PhotonSource &source, const std::string &filename,
+                                const ChunkedPhotonMapSettings &settings) {
+  TRACE_SCOPE("cpu::writeChunkedPhotonMap", "io");
+
+  // pass 1: bounds
+  box3f photonBounds;
+  uint64_t numPhotons = 0;
+  source([&](const PhotonRecord &record) {
+    photonBounds.extend(record.pos);
+    numPhotons++;
+  });
+
+  // pass 2: counts and bounds per grid cell
+  const Grid grid(photonBounds);
+  std::vector<uint64_t> cellCounts(static_cast<size_t>(PHOTON_CHUNKS_GRID) * PHOTON_CHUNKS_GRID * PHOTON_CHUNKS_GRID, 0);
+  std::vector<box3f> cellBounds(cellCounts.size());
+  if (numPhotons > 0) {
+    source([&](const PhotonRecord &record) {
+      const size_t cell = grid.cell(record.pos);
+      cellCounts[cell]++;
+      cellBounds[cell].extend(record.pos);
+    });
+  }
+
+  OctreeBuilder octree(cellCounts, cellBounds, std::max(settings.chunkCapacity, 1u));
+  octree.build();
+  auto &chunks = octree.chunks;
+  for (const auto &chunk : chunks) {
+    if (chunk.count >= PHOTON_MAX_COUNT) {
+      std::cerr << "Too many photons in one chunk of " << filename << ": " << chunk.count << std::endl;
+      return false;
+    }
+  }
+
+  const Header header{PHOTON_CHUNKS_MAGIC, PHOTON_CHUNKS_VERSION, static_cast<uint32_t>(octree.nodes.size()),
+                      static_cast<uint32_t>(chunks.size()), numPhotons};
+  uint64_t offset = sizeof(Header) + octree.nodes.size() * sizeof(ChunkedPhotonMap::Node)
+                  + chunks.size() * sizeof(ChunkedPhotonMap::ChunkInfo);
+  std::vector<uint64_t> stagingOffset(chunks.size());
+  uint64_t staged = 0;
+  for (size_t c = 0; c < chunks.size(); c++) {
+    chunks[c].offset = offset;
+    offset += chunks[c].count * CHUNK_PHOTON_BYTES;
+    stagingOffset[c] = staged * sizeof(PhotonRecord);
+    staged += chunks[c].count;
+  }
+
+  FILE *out = std::fopen(filename.c_str(), "wb");
+  if (!out) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return false;
+  }
+  const std::string stagingFile = filename + ".staging";
+  FILE *staging = std::fopen(stagingFile.c_str(), "wb+");
+  if (!staging) {
+    std::cerr << "Error opening file: " << stagingFile << std::endl;
+    std::fclose(out);
+    return false;
+  }
+
+  bool ok = writeAt(out, 0, &header, sizeof(header))
+         && std::fwrite(octree.nodes.data(), sizeof(ChunkedPhotonMap::Node), octree.nodes.size(), out) == octree.nodes.size()
+         && std::fwrite(chunks.data(), sizeof(ChunkedPhotonMap::ChunkInfo), chunks.size(), out) == chunks.size();
+
+  // pass 3: stage the records grouped by chunk, in bounded batches
+  if (numPhotons > 0) {
+    TRACE_SCOPE("stage chunks", "io");
+    std::vector<std::vector<PhotonRecord>> buffers(chunks.size());
+    std::vector<uint64_t> written(chunks.size(), 0);
+    size_t bufferedBytes = 0;
+    const auto flush = [&] {
+      for (size_t c = 0; c < buffers.size(); c++) {
+        if (buffers[c].empty()) continue;
+        ok = ok && writeAt(staging, stagingOffset[c] + written[c] * sizeof(PhotonRecord),
+                           buffers[c].data(), buffers[c].size() * sizeof(PhotonRecord));
+        written[c] += buffers[c].size();
+        std::vector<PhotonRecord>().swap(buffers[c]);
+      }
+      bufferedBytes = 0;
+    };
+
+    source([&](const PhotonRecord &record) {
+      buffers[octree.chunkOfCell[grid.cell(record.pos)]].push_back(record);
+      bufferedBytes += sizeof(PhotonRecord);
+      if (bufferedBytes >= settings.memoryBudget) flush();
+    });
+    flush();
+  }
+
+  // pass 4: every chunk becomes a KD-tree; the builds run in parallel
+  {
+    TRACE_SCOPE("build chunks");
+    std::mutex io;
+    parallel::forEach(chunks.size(), [&](size_t c) {
+      std::vector<PhotonRecord> records(chunks[c].count);
+      {
+        std::lock_guard<std::mutex> lock(io);
+        ok = ok && readAt(staging, stagingOffset[c], records.data(), records.size() * sizeof(PhotonRecord));
+      }
+
+      std::vector<PhotonNode> nodes(records.size());
+      std::vector<uint32_t> flux(records.size());
+      photon_storage::prepareNodes(records, nodes.data());
+      kdtree::buildTree<PhotonNode, PhotonNode_traits>(nodes.data(), nodes.size());
+      photon_storage::packPayloads(records, nodes.data(), flux.data());
+
+      std::lock_guard<std::mutex> lock(io);
+      ok = ok && writeAt(out, chunks[c].offset, nodes.data(), nodes.size() * sizeof(PhotonNode))
+              && std::fwrite(flux.data(), sizeof(uint32_t), flux.size(), out) == flux.size();
+    }, settings.numThreads);
+  }
+
+  std::fclose(staging);
+  std::remove(stagingFile.c_str());
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok) std::cerr << "Error writing chunked photon map: " << filename << std::endl;
+  return ok;
+}
+
+bool cpu::writeChunkedPhotonMap(const std::string &photonsFile, const std::string &causticPhotonsFile,
+                                const std::string &filename, const ChunkedPhotonMapSettings &settings) {
+  bool ok = true;
+  const PhotonSource source = [&](const std::function<void(const PhotonRecord &)> &emit) {
+    ok = photon_file::forEach<PhotonRecord>(photonsFile, [&](PhotonRecord record) {
+      record.color *= PHOTON_POWER;
+      emit(record);
+    }) && ok;
+    ok = photon_file::forEach<PhotonRecord>(causticPhotonsFile, [&](PhotonRecord record) {
+      record.color *= CAUSTICS_PHOTON_POWER;
+      emit(record);
+    }) && ok;
+  };
+  return writeChunkedPhotonMap(source, filename, settings) && ok;
+}
+
+cpu::ChunkedPhotonMap::ChunkedPhotonMap(const std::string &filename, const ChunkedPhotonMapSettings &settings)
+    : settings(settings), filename(filename) {
+  file = std::fopen(filename.c_str(), "rb");
+  if (!file) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return;
+  }
+
+  Header header;
+  bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+         && header.magic == PHOTON_CHUNKS_MAGIC && header.version == PHOTON_CHUNKS_VERSION;
+  if (ok) {
+    octree.resize(header.numNodes);
+    chunks.resize(header.numChunks);
+    photonCount = header.numPhotons;
+    ok = std::fread(octree.data(), sizeof(Node), octree.size(), file) == octree.size()
+      && std::fread(chunks.data(), sizeof(ChunkInfo), chunks.size(), file) == chunks.size();
+  }
+  if (!ok) {
+    std::cerr << "Not a chunked photon map: " << filename << std::endl;
+    std::fclose(file);
+    file = nullptr;
+    octree.clear();
+    chunks.clear();
+  }
+}
+
+cpu::ChunkedPhotonMap::~ChunkedPhotonMap() {
+  if (file) std::fclose(file);
+}
+
+size_t cpu::ChunkedPhotonMap::residentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return bytes;
+}
+
+std::shared_ptr<const cpu::ChunkedPhotonMap::Chunk> cpu::ChunkedPhotonMap::chunk(int32_t id) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  const auto found = resident.find(id);
+  if (found != resident.end()) {
+    lru.splice(lru.begin(), lru, found->second.lru);
+    cacheStats.chunkHits++;
+    return found->second.chunk;
+  }
+
+  cacheStats.chunkMisses++;
+  const ChunkInfo &info = chunks[id];
+  auto loaded = std::make_shared<Chunk>();
+  loaded->nodes.resize(info.count);
+  loaded->flux.resize(info.count);
+  if (!readAt(file, info.offset, loaded->nodes.data(), info.count * sizeof(PhotonNode))
+      || std::fread(loaded->flux.data(), sizeof(uint32_t), info.count, file) != info.count) {
+    std::cerr << "Warning: Short read from the photon chunks of " << filename << std::endl;
+  }
+
+  lru.push_front(id);
+  resident.emplace(id, Resident{loaded, lru.begin()});
+  bytes += info.count * CHUNK_PHOTON_BYTES;
+
+  // always keep the chunk just loaded, even over budget
+  while (bytes > settings.memoryBudget && lru.size() > 1) {
+    const int32_t evicted = lru.back();
+    bytes -= chunks[evicted].count * CHUNK_PHOTON_BYTES;
+    resident.erase(evicted);
+    lru.pop_back();
+    cacheStats.evictions++;
+  }
+  return loaded;
+}
+
+vec3f cpu::ChunkedPhotonMap::gather(const vec3f &hitpoint, const float diffuse_brdf) {
+  using Candidates = kdtree::CandidateList<K_NEAREST_NEIGHBOURS>;
+  Candidates closest(K_MAX_DISTANCE);
+  // the chunks searched, which the candidates' IDs refer to
+  thread_local std::vector<std::shared_ptr<const Chunk>> searched;
+  searched.clear();
+
+  struct Entry { int32_t node; float dist2; };
+  Entry stack[8 * 64];
+  int top = 0;
+  if (!octree.empty()) stack[top++] = {0, boxDistance2(octree[0].bounds, hitpoint)};
+
+  while (top > 0) {
+    const Entry entry = stack[--top];
+    if (entry.dist2 >= closest.maxDist2()) continue;
+    const Node &node = octree[entry.node];
+
+    if (node.chunk >= 0) {
+      auto data = chunk(node.chunk);
+      // the chunk's slot goes in the upper half of the point IDs
+      kdtree::OffsetCandidates<Candidates> tagged{closest, static_cast<int64_t>(searched.size()) << 32};
+      kdtree::knn<kdtree::OffsetCandidates<Candidates>, PhotonNode, PhotonNode_traits>(
+        tagged, hitpoint, data->nodes.data(), data->nodes.size());
+      searched.push_back(std::move(data));
+      continue;
+    }
+
+    // pushed furthest first, so the nearest child is searched next
+    Entry children[8];
+    for (int c = 0; c < node.numChildren; c++) {
+      Entry child{node.firstChild + c, boxDistance2(octree[node.firstChild + c].bounds, hitpoint)};
+      int i = c;
+      for (; i > 0 && children[i - 1].dist2 < child.dist2; i--) children[i] = children[i - 1];
+      children[i] = child;
+    }
+    for (int c = 0; c < node.numChildren; c++) {
+      if (children[c].dist2 < closest.maxDist2()) stack[top++] = children[c];
+    }
+  }
+
+  const float query_area_radius_squared = closest.maxDist2();
+  auto in_flux = vec3f(0.f);
+  for (int p = 0; p < closest.count; p++) {
+    const Chunk &data = *searched[closest.pointID[p] >> 32];
+    const auto id = closest.pointID[p] & 0xffffffff;
+
+    const auto photon_distance = norm(data.nodes[id].pos - hitpoint);
+    const auto photon_weight = 1 - (photon_distance / std::sqrt(query_area_radius_squared) * CONE_FILTER_C);
+
+    in_flux += diffuse_brdf
+      * photon_weight
+      * photon_storage::decodeRGBE(data.flux[id]);
+  }
+  searched.clear();
+
+  return in_flux / (CONE_FILTER_NORMALISATION * 2*PI*query_area_radius_squared);
+}
@@ -0,0 +1,218 @@
+#include "../include/irradianceCache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include "../../common/src/trace.h"
+
+using namespace owl;
+
+#define IRRADIANCE_CACHE_MAGIC 0x43524931u /* "1IRC" */
+#define IRRADIANCE_CACHE_VERSION 1u
+/* Directions closer to the tangent plane than this are clamped in the
+ * rotational gradient, whose terms go with tan(theta). */
+#define MIN_SAMPLE_COSINE 0.1f
+
+namespace {
+  int childIndex(const box3f &bounds, const vec3f &p) {
+    const vec3f c = bounds.center();
+    return (p.x > c.x ? 1 : 0) | (p.y > c.y ? 2 : 0) | (p.z > c.z ? 4 : 0);
+  }
+
+  box3f childBounds(const box3f &bounds, int child) {
+    const vec3f c = bounds.center();
+    box3f result;
+    result.lower = vec3f((child & 1) ? c.x : bounds.lower.x, (child & 2) ? c.y : bounds.lower.y, (child & 4) ? c.z : bounds.lower.z);
+    result.upper = vec3f((child & 1) ? bounds.upper.x : c.x, (child & 2) ? bounds.upper.y : c.y, (child & 4) ? bounds.upper.z : c.z);
+    return result;
+  }
+
+  bool containsGrown(const box3f &bounds, const vec3f &p) {
+    const vec3f grow = 0.5f * (bounds.upper - bounds.lower);
+    return p.x >= bounds.lower.x - grow.x && p.x <= bounds.upper.x + grow.x
+        && p.y >= bounds.lower.y - grow.y && p.y <= bounds.upper.y + grow.y
+        && p.z >= bounds.lower.z - grow.z && p.z <= bounds.upper.z + grow.z;
+  }
+}
+
+cpu::IrradianceCache::IrradianceCache(const box3f &sceneBounds, const IrradianceCacheSettings &settings)
+  : settings(settings) {
+  // cube around the scene, so all nodes are cubes
+  const vec3f extent = sceneBounds.upper - sceneBounds.lower;
+  const float size = std::max(extent.x, std::max(extent.y, extent.z)) * 1.01f + 1e-3f;
+  rootBounds.lower = sceneBounds.center() - vec3f(0.5f * size);
+  rootBounds.upper = sceneBounds.center() + vec3f(0.5f * size);
+  clear();
+}
+
+void cpu::IrradianceCache::clear() {
+  nodes.clear();
+  records.clear();
+
+  Node root;
+  root.bounds = rootBounds;
+  std::fill(std::begin(root.children), std::end(root.children), -1);
+  nodes.push_back(root);
+}
+
+size_t cpu::IrradianceCache::size() const {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  return records.size();
+}
+
+bool cpu::IrradianceCache::lookup(const vec3f &pos, const vec3f &normal, vec3f &irradiance) const {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  vec3f sum(0.f);
+  float weightSum = 0.f;
+
+  // depth-first, so each level leaves at most 7 siblings on the stack
+  int32_t stack[7 * IRRADIANCE_CACHE_MAX_DEPTH + 1];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node &node = nodes[stack[--top]];
+
+    for (const uint32_t id : node.records) {
+      const IrradianceRecord &r = records[id];
+      const vec3f offset = pos - r.pos;
+
+      // Ward's error; the record is valid while it stays below a
+      const float error = length(offset) / r.radius + std::sqrt(std::max(0.f, 1.f - dot(normal, r.normal)));
+      if (error >= settings.accuracy) continue;
+      // the record lies in front of the query point
+      if (dot(offset, 0.5f * (normal + r.normal)) < -0.05f * r.radius) continue;
+
+      const float weight = 1.f / std::max(error, 1e-4f);
+      const vec3f rotation = cross(r.normal, normal);
+      const vec3f extrapolated(
+        r.irradiance.x + dot(rotation, r.rotationGradient[0]) + dot(offset, r.translationGradient[0]),
+        r.irradiance.y + dot(rotation, r.rotationGradient[1]) + dot(offset, r.translationGradient[1]),
+        r.irradiance.z + dot(rotation, r.rotationGradient[2]) + dot(offset, r.translationGradient[2]));
+      sum += weight * max(extrapolated, vec3f(0.f));
+      weightSum += weight;
+    }
+
+    for (const int32_t child : node.children) {
+      if (child >= 0 && containsGrown(nodes[child].bounds, pos)) stack[top++] = child;
+    }
+  }
+
+  if (weightSum <= 0.f) return false;
+  irradiance = sum / weightSum;
+  return true;
+}
+
+vec3f cpu::IrradianceCache::insert(const vec3f &pos, const vec3f &normal, const std::vector<IrradianceSample> &samples) {
+  if (samples.empty()) return vec3f(0.f);
+
+  IrradianceRecord record;
+  record.pos = pos;
+  record.normal = normal;
+  record.irradiance = vec3f(0.f);
+  for (int c = 0; c < 3; c++) {
+    record.translationGradient[c] = vec3f(0.f);
+    record.rotationGradient[c] = vec3f(0.f);
+  }
+  const float invN = 1.f / static_cast<float>(samples.size());
+
+  float invDistanceSum = 0.f;
+  for (const auto &s : samples) {
+    const float distance = std::max(s.distance, settings.minRadius);
+    const float cosine = std::max(dot(normal, s.direction), MIN_SAMPLE_COSINE);
+
+    record.irradiance += invN * s.radiance;
+    invDistanceSum += 1.f / distance;
+
+    // d/d(rotation): the cosine weight of each sample changes with
+    // dot(axis, cross(n, w)), relative to the cosine it was sampled with
+    const vec3f rotation = invN * cross(normal, s.direction) / cosine;
+    // d/d(translation), approximated: a facing surface at distance r
+    // contributes ~cos/r^2, which changes by 3 dot(t, w) / r per unit
+    // tangential move (not Ward & Heckbert's stratified estimate)
+    const vec3f tangential = s.direction - dot(normal, s.direction) * normal;
+    const vec3f translation = invN * 3.f * tangential / distance;
+
+    for (int c = 0; c < 3; c++) {
+      record.rotationGradient[c] += s.radiance[c] * rotation;
+      record.translationGradient[c] += s.radiance[c] * translation;
+    }
+  }
+  record.radius = std::clamp(static_cast<float>(samples.size()) / invDistanceSum, settings.minRadius, settings.maxRadius);
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  insertRecord(record);
+  return record.irradiance;
+}
+
+void cpu::IrradianceCache::insertRecord(const IrradianceRecord &record) {
+  const uint32_t id = static_cast<uint32_t>(records.size());
+  records.push_back(record);
+
+  // descend while the child would still be at least twice the validity radius
+  const float influence = record.radius * settings.accuracy;
+  int32_t current = 0;
+  for (int depth = 0; depth < IRRADIANCE_CACHE_MAX_DEPTH; depth++) {
+    const box3f bounds = nodes[current].bounds;
+    const float childSize = 0.5f * (bounds.upper.x - bounds.lower.x);
+    if (childSize < 2.f * influence) break;
+
+    const int child = childIndex(bounds, record.pos);
+    if (nodes[current].children[child] < 0) {
+      Node node;
+      node.bounds = childBounds(bounds, child);
+      std::fill(std::begin(node.children), std::end(node.children), -1);
+      nodes[current].children[child] = static_cast<int32_t>(nodes.size());
+      nodes.push_back(node);
+    }
+    current = nodes[current].children[child];
+  }
+  nodes[current].records.push_back(id);
+}
+
+bool cpu::IrradianceCache::save(const std::string &filename) const {
+  TRACE_SCOPE("IrradianceCache::save", "io");
+  std::shared_lock<std::shared_mutex> lock(mutex);
+
+  std::ofstream out(filename, std::ios::binary);
+  if (!out.is_open()) return false;
+
+  const uint32_t header[2] = {IRRADIANCE_CACHE_MAGIC, IRRADIANCE_CACHE_VERSION};
+  const uint64_t count = records.size();
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(&settings), sizeof(settings));
+  out.write(reinterpret_cast<const char *>(&rootBounds), sizeof(rootBounds));
+  out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+  out.write(reinterpret_cast<const char *>(records.data()), count * sizeof(IrradianceRecord));
+  return out.good();
+}
+
+bool cpu::IrradianceCache::load(const std::string &filename) {
+  TRACE_SCOPE("IrradianceCache::load", "io");
+  std::ifstream in(filename, std::ios::binary);
+  if (!in.is_open()) return false;
+
+  uint32_t header[2];
+  IrradianceCacheSettings fileSettings;
+  box3f fileBounds;
+  uint64_t count = 0;
+  in.read(reinterpret_cast<char *>(header), sizeof(header));
+  in.read(reinterpret_cast<char *>(&fileSettings), sizeof(fileSettings));
+  in.read(reinterpret_cast<char *>(&fileBounds), sizeof(fileBounds));
+  in.read(reinterpret_cast<char *>(&count), sizeof(count));
+  if (!in || header[0] != IRRADIANCE_CACHE_MAGIC || header[1] != IRRADIANCE_CACHE_VERSION) return false;
+  if (std::memcmp(&fileSettings, &settings, sizeof(settings)) != 0) return false;
+  if (std::memcmp(&fileBounds, &rootBounds, sizeof(rootBounds)) != 0) return false;
+
+  std::vector<IrradianceRecord> loaded(count);
+  in.read(reinterpret_cast<char *>(loaded.data()), count * sizeof(IrradianceRecord));
+  if (!in) return false;
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  clear();
+  for (const auto &record : loaded) insertRecord(record);
+  return true;
+}
@@ -0,0 +1,155 @@
+#include "../include/photonMap.h"
+
+#include <cmath>
+
+#include "../include/chunkedPhotonMap.h"
+#include "../../common/src/kdTree.h"
+#include "../../common/src/precomputedIrradiance.h"
+#include "../../common/src/shadingMath.h"
+#include "../../common/src/trace.h"
+#include "../../ray-tracer/include/renderConstants.h"
+
+using namespace owl;
+
+namespace {
+  const float CONE_FILTER_NORMALISATION = 1 - (2.f/3.f) * (1.f/CONE_FILTER_C);
+
+  /* Over the K nearest photons of `map`, and of `extra` too if given, as
+   * if they were one tree. IDs from `extra` start at map.nodes.size(). */
+  vec3f gatherNearest(const cpu::PhotonMap &map, const cpu::PhotonMap *extra, const vec3f &hitpoint, const float diffuse_brdf) {
+    using Candidates = kdtree::CandidateList<K_NEAREST_NEIGHBOURS>;
+    Candidates closest(K_MAX_DISTANCE);
+    float query_area_radius_squared = kdtree::knn<Candidates, cpu::PhotonNode, cpu::PhotonNode_traits>(
+      closest, hitpoint, map.nodes.data(), map.nodes.size());
+    if (extra) {
+      kdtree::OffsetCandidates<Candidates> shared{closest, static_cast<int64_t>(map.nodes.size())};
+      query_area_radius_squared = kdtree::knn<kdtree::OffsetCandidates<Candidates>, cpu::PhotonNode, cpu::PhotonNode_traits>(
+        shared, hitpoint, extra->nodes.data(), extra->nodes.size());
+    }
+
+    auto in_flux = vec3f(0.f);
+    for (int p = 0; p < closest.count; p++) {
+      auto id = static_cast<size_t>(closest.pointID[p]);
+      const cpu::PhotonMap &owner = id < map.nodes.size() ? map : *extra;
+      if (id >= map.nodes.size()) id -= map.nodes.size();
+
+      const auto photon_distance = norm(owner.nodes[id].pos - hitpoint);
+      const auto photon_weight = 1 - (photon_distance / std::sqrt(query_area_radius_squared) * CONE_FILTER_C);
+
+      in_flux += diffuse_brdf
+        * photon_weight
+        * photon_storage::decodeRGBE(owner.flux[id]);
+    }
+
+    return in_flux / (CONE_FILTER_NORMALISATION * 2*PI*query_area_radius_squared);
+  }
+
+  vec3f gatherInRadius(const cpu::PhotonMap &map, const vec3f &hitpoint, const float diffuse_brdf) {
+    auto in_flux = vec3f(0.f);
+    const hash_grid::HashGrid grid{map.cellStart.data(), static_cast<uint32_t>(map.cellStart.size() - 1), map.cellSize};
+    hash_grid::forEachInRadius(grid, map.nodes.data(), hitpoint, map.gatherRadius, [&](uint32_t id, float dist2) {
+      const auto photon_weight = 1 - (std::sqrt(dist2) / map.gatherRadius * CONE_FILTER_C);
+      in_flux += diffuse_brdf
+        * photon_weight
+        * photon_storage::decodeRGBE(map.flux[id]);
+    });
+
+    return in_flux / (CONE_FILTER_NORMALISATION * 2*PI*map.gatherRadius*map.gatherRadius);
+  }
+}
+
+void cpu::rebuildPhotonMap(const std::vector<photon_storage::PhotonRecord> &records, PhotonMap &map) {
+  map.nodes.resize(records.size());
+  map.flux.resize(records.size());
+
+  if (map.lookup == hash_grid::HASH_GRID) {
+    const uint32_t tableSize = hash_grid::tableSizeFor(records.size());
+    map.cellStart.resize(tableSize + 1);
+    map.cellSize = hash_grid::cellSizeFor(map.gatherRadius);
+
+    hash_grid::build(records, map.cellSize, tableSize, map.nodes.data(), map.cellStart.data());
+    map.bounds = box3f();
+    for (const auto &record : records) map.bounds.extend(record.pos);
+  } else {
+    photon_storage::prepareNodes(records, map.nodes.data());
+    map.bounds = kdtree::buildTree<PhotonNode, PhotonNode_traits>(map.nodes.data(), map.nodes.size());
+  }
+
+  photon_storage::packPayloads(records, map.nodes.data(), map.flux.data());
+}
+
+std::vector<photon_storage::PhotonRecord> cpu::globalPhotonRecords(const std::vector<Photon> &nonCaustic,
+                                                                   const std::vector<Photon> &caustic) {
+  std::vector<photon_storage::PhotonRecord> records;
+  records.reserve(nonCaustic.size() + caustic.size());
+  for (const auto &photon : nonCaustic) {
+    records.push_back({photon.pos, photon.dir, photon.color * PHOTON_POWER});
+  }
+  for (const auto &photon : caustic) {
+    records.push_back({photon.pos, photon.dir, photon.color * CAUSTICS_PHOTON_POWER});
+  }
+  return records;
+}
+
+cpu::PhotonMaps cpu::buildPhotonMaps(const std::vector<Photon> &nonCaustic, const std::vector<Photon> &caustic,
+                                     const PhotonMapSettings &settings) {
+  TRACE_SCOPE("cpu::buildPhotonMaps");
+  const auto globalRecords = globalPhotonRecords(nonCaustic, caustic);
+  const std::vector<photon_storage::PhotonRecord> nonCausticRecords(globalRecords.begin(), globalRecords.begin() + nonCaustic.size());
+  const std::vector<photon_storage::PhotonRecord> causticRecords(globalRecords.begin() + nonCaustic.size(), globalRecords.end());
+
+  PhotonMaps maps;
+  for (PhotonMap *map : {&maps.global, &maps.caustic}) {
+    map->lookup = settings.lookup;
+    map->gatherRadius = settings.gatherRadius;
+  }
+  rebuildPhotonMap(nonCausticRecords, maps.global);
+  rebuildPhotonMap(causticRecords, maps.caustic);
+
+  if (settings.precomputeIrradiance) {
+    precomputed_irradiance::Settings irradianceSettings;
+    irradianceSettings.stride = settings.irradianceStride;
+    irradianceSettings.maxRadius = K_MAX_DISTANCE;
+    irradianceSettings.coneFilterC = CONE_FILTER_C;
+    irradianceSettings.numThreads = settings.numThreads;
+    rebuildPhotonMap(precomputed_irradiance::estimate<K_NEAREST_NEIGHBOURS>(globalRecords, irradianceSettings), maps.irradiance);
+  }
+  return maps;
+}
+
+vec3f cpu::gatherPhotons(const PhotonMap &map, const vec3f &hitpoint, const vec3f &normal, const float diffuse_brdf) {
+  if (map.lookup == hash_grid::HASH_GRID) return gatherInRadius(map, hitpoint, diffuse_brdf);
+  return gatherNearest(map, nullptr, hitpoint, diffuse_brdf);
+}
+
+vec3f cpu::gatherGlobal(const PhotonMaps &maps, const vec3f &hitpoint, const vec3f &normal, const float diffuse_brdf) {
+  if (maps.global.lookup == hash_grid::HASH_GRID) {
+    // a fixed radius gathers the same photons from both maps as from their union
+    return gatherInRadius(maps.global, hitpoint, diffuse_brdf) + gatherInRadius(maps.caustic, hitpoint, diffuse_brdf);
+  }
+  return gatherNearest(maps.global, &maps.caustic, hitpoint, diffuse_brdf);
+}
+
+vec3f cpu::gatherIrradiance(const PhotonMaps &maps, const vec3f &hitpoint, const vec3f &normal, const float diffuse_brdf) {
+  if (maps.globalChunks) return maps.globalChunks->gather(hitpoint, diffuse_brdf);
+
+  const auto &map = maps.irradiance;
+  if (map.nodes.empty()) return gatherGlobal(maps, hitpoint, normal, diffuse_brdf);
+
+  kdtree::CandidateList<IRRADIANCE_CANDIDATES> closest(K_MAX_DISTANCE);
+  kdtree::knn<kdtree::CandidateList<IRRADIANCE_CANDIDATES>, PhotonNode, PhotonNode_traits>(
+    closest, hitpoint, map.nodes.data(), map.nodes.size());
+
+  int64_t best = -1;
+  float bestDist2 = INFTY;
+  for (int p = 0; p < closest.count; p++) {
+    const auto id = closest.pointID[p];
+    if (closest.dist2[p] >= bestDist2) continue;
+    if (dot(photon_storage::direction(map.nodes[id]), normal) < IRRADIANCE_NORMAL_COS) continue;
+    best = id;
+    bestDist2 = closest.dist2[p];
+  }
+
+  if (best < 0) return gatherGlobal(maps, hitpoint, normal, diffuse_brdf);
+  return diffuse_brdf * photon_storage::decodeRGBE(map.flux[best]);
+}
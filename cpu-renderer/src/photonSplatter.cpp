@@ -0,0 +1,212 @@
+#include "../include/photonSplatter.h"
+
+#include <cmath>
+
+#define SPLAT_BAND_ROWS 16
+#define SPLAT_TRIANGLE_CHUNK 4096
+/* ratio of the brightest to the faintest value the density and heat maps
+ * still tell apart from black */
+#define SPLAT_LOG_RANGE 1000.f
+
+using namespace owl;
+
+namespace {
+  /* A triangle after clipping, in continuous pixel space: x to the right,
+   * y up from the bottom of the frame buffer. */
+  struct ScreenTriangle {
+    vec2f p[3];
+    float invW[3];
+    float minY, maxY;
+  };
+
+  glm::vec4 toClip(const glm::mat4 &m, const vec3f &p) {
+    return m * glm::vec4(p.x, p.y, p.z, 1.f);
+  }
+
+  /* Clips against the near plane (z >= -w) and emits the 1 or 2 screen
+   * triangles of what is left. */
+  void projectTriangle(const glm::vec4 (&clip)[3], const vec2i &size, std::vector<ScreenTriangle> &out) {
+    glm::vec4 polygon[4];
+    int count = 0;
+    for (int i = 0; i < 3; i++) {
+      const glm::vec4 &a = clip[i];
+      const glm::vec4 &b = clip[(i + 1) % 3];
+      const float da = a.z + a.w;
+      const float db = b.z + b.w;
+      if (da >= 0.f) polygon[count++] = a;
+      if ((da >= 0.f) != (db >= 0.f)) polygon[count++] = a + (b - a) * (da / (da - db));
+    }
+    if (count < 3) return;
+
+    vec2f screen[4];
+    float invW[4];
+    for (int i = 0; i < count; i++) {
+      // on the near plane w is positive, so this is finite
+      invW[i] = 1.f / polygon[i].w;
+      screen[i] = vec2f((polygon[i].x * invW[i] + 1.f) * 0.5f * size.x,
+                        (polygon[i].y * invW[i] + 1.f) * 0.5f * size.y);
+    }
+
+    for (int i = 1; i + 1 < count; i++) {
+      ScreenTriangle tri;
+      const int corners[3] = {0, i, i + 1};
+      for (int k = 0; k < 3; k++) {
+        tri.p[k] = screen[corners[k]];
+        tri.invW[k] = invW[corners[k]];
+      }
+      tri.minY = std::min(tri.p[0].y, std::min(tri.p[1].y, tri.p[2].y));
+      tri.maxY = std::max(tri.p[0].y, std::max(tri.p[1].y, tri.p[2].y));
+      const float minX = std::min(tri.p[0].x, std::min(tri.p[1].x, tri.p[2].x));
+      const float maxX = std::max(tri.p[0].x, std::max(tri.p[1].x, tri.p[2].x));
+      if (maxX < 0.f || minX > size.x || tri.maxY < 0.f || tri.minY > size.y + 1.f) continue;
+      out.push_back(tri);
+    }
+  }
+
+  /* Pixel indices in [lo, hi] from a screen space bound, clamped before the
+   * conversion, which is undefined for the huge values of triangles that
+   * reach close to the camera. */
+  int clampedIndex(float value, int lo, int hi) {
+    return static_cast<int>(owl::clamp(value, static_cast<float>(lo - 1), static_cast<float>(hi + 1)));
+  }
+
+  /* The rows the triangle covers, see rasterise(). */
+  void rowRange(const ScreenTriangle &tri, const vec2i &size, int &first, int &last) {
+    first = std::max(0, clampedIndex(std::ceil(size.y + 0.5f - tri.maxY), 0, size.y - 1));
+    last = std::min(size.y - 1, clampedIndex(std::floor(size.y + 0.5f - tri.minY), 0, size.y - 1));
+  }
+
+  float edge(const vec2f &a, const vec2f &b, const vec2f &p) {
+    return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+  }
+
+  /* The same edge evaluated in the same order from both triangles sharing
+   * it, so rounding can't leave a crack between them. */
+  float sharedEdge(const vec2f &a, const vec2f &b, const vec2f &p) {
+    if (a.x < b.x || (a.x == b.x && a.y < b.y)) return edge(a, b, p);
+    return -edge(b, a, p);
+  }
+
+  /* Pixel (x, y) covers [x, x + 1) by [H - y, H - y + 1) in screen space
+   * (see splatPhotons) and is sampled at its centre. */
+  void rasterise(const ScreenTriangle &tri, const vec2i &size, int rowBegin, int rowEnd, float *depth) {
+    const float area = edge(tri.p[0], tri.p[1], tri.p[2]);
+    if (std::fabs(area) < 1e-12f) return;
+    const float invArea = 1.f / area;
+
+    int firstRow, lastRow;
+    rowRange(tri, size, firstRow, lastRow);
+    firstRow = std::max(firstRow, rowBegin);
+    lastRow = std::min(lastRow, rowEnd - 1);
+    const float minX = std::min(tri.p[0].x, std::min(tri.p[1].x, tri.p[2].x));
+    const float maxX = std::max(tri.p[0].x, std::max(tri.p[1].x, tri.p[2].x));
+    const int firstColumn = std::max(0, clampedIndex(std::ceil(minX - 0.5f), 0, size.x - 1));
+    const int lastColumn = std::min(size.x - 1, clampedIndex(std::floor(maxX - 0.5f), 0, size.x - 1));
+
+    for (int y = firstRow; y <= lastRow; y++) {
+      for (int x = firstColumn; x <= lastColumn; x++) {
+        const vec2f sample(x + 0.5f, size.y - y + 0.5f);
+        // barycentrics; both windings are drawn
+        const float b0 = sharedEdge(tri.p[1], tri.p[2], sample) * invArea;
+        const float b1 = sharedEdge(tri.p[2], tri.p[0], sample) * invArea;
+        const float b2 = sharedEdge(tri.p[0], tri.p[1], sample) * invArea;
+        if (b0 < 0.f || b1 < 0.f || b2 < 0.f) continue;
+
+        const float invW = b0 * tri.invW[0] + b1 * tri.invW[1] + b2 * tri.invW[2];
+        float &stored = depth[x + static_cast<size_t>(size.x) * y];
+        stored = std::max(stored, invW);
+      }
+    }
+  }
+
+  struct TriangleChunk {
+    int instance;
+    size_t begin, end;
+  };
+
+  float logScale(double value, double max) {
+    if (!(max > 0.0) || !(value > 0.0)) return 0.f;
+    return static_cast<float>(std::log1p(SPLAT_LOG_RANGE * value / max) / std::log1p(SPLAT_LOG_RANGE));
+  }
+
+  /* black, red, yellow, white */
+  vec3f heatRamp(float t) {
+    return vec3f(owl::clamp(3.f * t, 0.f, 1.f), owl::clamp(3.f * t - 1.f, 0.f, 1.f), owl::clamp(3.f * t - 2.f, 0.f, 1.f));
+  }
+}
+
+cpu::DepthBuffer::DepthBuffer(const World &world, const glm::mat4 &viewProjection, const vec2i &size, int numThreads)
+    : projection(viewProjection), fbSize(size), depth(static_cast<size_t>(size.x) * size.y, 0.f) {
+  TRACE_SCOPE("rasterise depth");
+
+  std::vector<TriangleChunk> chunks;
+  for (size_t i = 0; i < world.instances.size(); i++) {
+    const size_t count = world.meshes[world.instances[i].meshID].indices.size();
+    for (size_t begin = 0; begin < count; begin += SPLAT_TRIANGLE_CHUNK) {
+      chunks.push_back({static_cast<int>(i), begin, std::min(begin + SPLAT_TRIANGLE_CHUNK, count)});
+    }
+  }
+
+  std::vector<std::vector<ScreenTriangle>> projected(chunks.size());
+  parallel::forEach(chunks.size(), [&](size_t c) {
+    const auto &instance = world.instances[chunks[c].instance];
+    const auto &mesh = world.meshes[instance.meshID];
+    for (size_t t = chunks[c].begin; t < chunks[c].end; t++) {
+      const vec3i &index = mesh.indices[t];
+      const glm::vec4 clip[3] = {
+        toClip(projection, xfmPoint(instance.transform, mesh.vertices[index.x])),
+        toClip(projection, xfmPoint(instance.transform, mesh.vertices[index.y])),
+        toClip(projection, xfmPoint(instance.transform, mesh.vertices[index.z])),
+      };
+      projectTriangle(clip, fbSize, projected[c]);
+    }
+  }, numThreads);
+
+  // bands of rows own their part of the buffer, so they need no locking
+  const int numBands = (fbSize.y + SPLAT_BAND_ROWS - 1) / SPLAT_BAND_ROWS;
+  std::vector<std::vector<const ScreenTriangle*>> bands(numBands);
+  for (const auto &chunk : projected) {
+    for (const auto &tri : chunk) {
+      int firstRow, lastRow;
+      rowRange(tri, fbSize, firstRow, lastRow);
+      if (firstRow > lastRow) continue;
+      for (int band = firstRow / SPLAT_BAND_ROWS; band <= lastRow / SPLAT_BAND_ROWS; band++) {
+        bands[band].push_back(&tri);
+      }
+    }
+  }
+
+  parallel::forEach(bands.size(), [&](size_t band) {
+    const int rowBegin = static_cast<int>(band) * SPLAT_BAND_ROWS;
+    const int rowEnd = std::min(rowBegin + SPLAT_BAND_ROWS, fbSize.y);
+    for (const auto *tri : bands[band]) rasterise(*tri, fbSize, rowBegin, rowEnd, depth.data());
+  }, numThreads);
+}
+
+uint32_t cpu::splatRGBA(const vec3f &colour) {
+  const auto r = static_cast<uint32_t>(owl::clamp(colour.x, 0.f, 1.f) * 255.9f);
+  const auto g = static_cast<uint32_t>(owl::clamp(colour.y, 0.f, 1.f) * 255.9f);
+  const auto b = static_cast<uint32_t>(owl::clamp(colour.z, 0.f, 1.f) * 255.9f);
+  return r | (g << 8) | (b << 16) | (0xffu << 24);
+}
+
+std::vector<uint32_t> cpu::resolveSplats(const std::atomic<uint64_t> *values, size_t numPixels, SplatMode mode) {
+  std::vector<double> totals(numPixels);
+  double max = 0.0;
+  for (size_t p = 0; p < numPixels; p++) {
+    const uint64_t bits = values[p].load(std::memory_order_relaxed);
+    if (mode == SPLAT_DENSITY) {
+      totals[p] = static_cast<double>(bits);
+    } else {
+      std::memcpy(&totals[p], &bits, sizeof(double));
+    }
+    max = std::max(max, totals[p]);
+  }
+
+  std::vector<uint32_t> image(numPixels);
+  for (size_t p = 0; p < numPixels; p++) {
+    const float t = logScale(totals[p], max);
+    image[p] = splatRGBA(mode == SPLAT_DENSITY ? vec3f(t) : heatRamp(t));
+  }
+  return image;
+}
@@ -0,0 +1,149 @@
+#include "../include/photonTracer.h"
+
+#include "../../common/src/parallel.h"
+#include "../../common/src/shadingMath.h"
+#include "../../common/src/trace.h"
+
+#define PHOTONS_PER_TASK 4096
+
+using namespace owl;
+
+namespace {
+  enum RayEvent {
+    MISS = 0,
+    ABSORBED = 1,
+    SCATTER_DIFFUSE = 2,
+    SCATTER_SPECULAR = 4,
+    SCATTER_REFRACT = 8,
+  };
+
+  struct PhotonState {
+    Random random;
+    vec3f color;
+    RayEvent event;
+    struct {
+      vec3f origin;
+      vec3f direction;
+      vec3f color;
+    } scattered;
+  };
+
+  /* Mirrors triangleMeshClosestHit / miss of the photon mapper. */
+  void trace(const World &world, const cpu::Bvh &bvh, cpu::TextureCache *textures, const vec3f &org, const vec3f &dir, PhotonState &prd) {
+    cpu::Hit hit;
+    if (!cpu::intersect(bvh, org, dir, EPS, INFTY, hit)) {
+      prd.event = MISS;
+      return;
+    }
+
+    const Material &material = world.materials[world.meshes[hit.meshID].materialID];
+    const vec3f hitPoint = org + hit.t * dir;
+    const vec3f normal = cpu::shadingNormal(bvh, world, hit, cpu::geometricNormal(bvh, hit));
+
+    const float diffuseProb = material.diffuse;
+    const float specularProb = material.specular + diffuseProb;
+    const float transmissionProb = material.transmission + specularProb;
+
+    const float randomProb = prd.random();
+    if (randomProb < diffuseProb) {
+      prd.event = SCATTER_DIFFUSE;
+      prd.scattered.direction = reflectDiffuse(normal, prd.random);
+    } else if (randomProb < specularProb) {
+      prd.event = SCATTER_SPECULAR;
+      prd.scattered.direction = reflect(dir, normal);
+    } else if (randomProb < transmissionProb) {
+      prd.event = SCATTER_REFRACT;
+      prd.scattered.direction = refract(dir, normal, material.refraction_idx);
+    } else {
+      prd.event = ABSORBED;
+      return;
+    }
+    prd.scattered.origin = hitPoint;
+    prd.scattered.color = multiplyColor(cpu::albedo(material, textures, cpu::hitUV(world, hit), 0.f), prd.color);
+  }
+
+  void savePhoton(const PhotonState &prd, std::vector<cpu::Photon> &out) {
+    cpu::Photon photon{};
+    photon.color = prd.color;
+    photon.pos = prd.scattered.origin;
+    photon.dir = prd.scattered.direction;
+    out.push_back(photon);
+  }
+
+  /* Returns the number of rays traced. `power` is the largest component of
+   * the emitted colour. */
+  int shootPhoton(const World &world, const cpu::Bvh &bvh, const cpu::PhotonTracerSettings &settings, bool causticsMode,
+                  float power, vec3f org, vec3f dir, PhotonState &prd, std::vector<cpu::Photon> &out) {
+    int rays = 0;
+    for (int i = 0; i < settings.maxDepth; i++) {
+      trace(world, bvh, settings.textures, org, dir, prd);
+      rays++;
+
+      if (causticsMode) {
+        if (i > 0 && prd.event == SCATTER_DIFFUSE) savePhoton(prd, out);
+        if (!(prd.event & (SCATTER_SPECULAR | SCATTER_REFRACT))) break;
+      } else {
+        if (prd.event != SCATTER_DIFFUSE) break;
+        if (i > 0) savePhoton(prd, out);
+      }
+
+      org = prd.scattered.origin;
+      dir = prd.scattered.direction;
+      prd.color = prd.scattered.color;
+      if (!russianRoulette(prd.color, power, i + 1, settings.rrMinDepth, prd.random)) break;
+    }
+    return rays;
+  }
+
+  std::vector<cpu::Photon> shootFromLights(const World &world, const cpu::Bvh &bvh,
+                                           const cpu::PhotonTracerSettings &settings,
+                                           int64_t photonsPerWatt, bool causticsMode, uint64_t &numRays) {
+    std::vector<cpu::Photon> result;
+
+    for (const auto &light : world.light_sources) {
+      const int64_t initialPhotons = light.power * photonsPerWatt;
+      const size_t numTasks = (initialPhotons + PHOTONS_PER_TASK - 1) / PHOTONS_PER_TASK;
+
+      // every task collects into its own buffer so the output order is fixed
+      std::vector<std::vector<cpu::Photon>> taskPhotons(numTasks);
+      std::vector<uint64_t> taskRays(numTasks, 0);
+      const float power = std::max(light.rgb.x, std::max(light.rgb.y, light.rgb.z));
+      parallel::forEach(numTasks, [&](size_t task) {
+        TRACE_SCOPE(causticsMode ? "trace caustic photons" : "trace photons", "worker");
+        const int64_t begin = static_cast<int64_t>(task) * PHOTONS_PER_TASK;
+        const int64_t end = std::min<int64_t>(initialPhotons, begin + PHOTONS_PER_TASK);
+        for (int64_t i = begin; i < end; i++) {
+          PhotonState prd;
+          prd.random.init(static_cast<uint32_t>(i), settings.seed + static_cast<uint32_t>(i >> 32));
+          prd.color = light.rgb;
+
+          const vec3f dir = randomPointInUnitSphere(prd.random);
+          taskRays[task] += shootPhoton(world, bvh, settings, causticsMode, power, light.pos, dir, prd, taskPhotons[task]);
+        }
+      }, settings.numThreads);
+
+      for (const auto &photons : taskPhotons) {
+        result.insert(result.end(), photons.begin(), photons.end());
+      }
+      for (const uint64_t rays : taskRays) numRays += rays;
+    }
+    return result;
+  }
+}
+
+cpu::TracedPhotons cpu::tracePhotons(const World &world, const Bvh &bvh, const PhotonTracerSettings &settings) {
+  TRACE_SCOPE("cpu::tracePhotons");
+
+  double totalWatts = 0;
+  for (const auto &light : world.light_sources) {
+    totalWatts += light.power;
+  }
+
+  const int64_t photonsPerWatt = settings.castedDiffusePhotons / totalWatts;
+  const int64_t causticsPhotonsPerWatt = settings.castedCausticsPhotons / totalWatts;
+
+  TracedPhotons traced;
+  traced.global = shootFromLights(world, bvh, settings, photonsPerWatt, false, traced.globalRays);
+  traced.caustic = shootFromLights(world, bvh, settings, causticsPhotonsPerWatt, true, traced.causticRays);
+  return traced;
+}
@@ -0,0 +1,273 @@
+#include "../include/renderer.h"
+
+#include <algorithm>
+
+#include "../../common/src/parallel.h"
+#include "../../common/src/shadingMath.h"
+#include "../../common/src/trace.h"
+#include "../../ray-tracer/include/renderConstants.h"
+#include "../../ray-tracer/include/scattering.h"
+
+#define TILE_SIZE 16
+
+using namespace owl;
+
+namespace {
+  struct Scene {
+    const World &world;
+    const cpu::Bvh &bvh;
+    const cpu::PhotonMaps &photonMaps;
+    const cpu::RenderSettings &settings;
+    /* empty unless settings.lightSampling is LIGHT_TREE */
+    const std::vector<light_tree::Node> &lightTree;
+    /* angle a pixel subtends, the spread of the ray cones that pick the
+     * texture mip levels */
+    float pixelSpread;
+  };
+
+  struct HitRecord {
+    vec3f hitpoint;
+    // Always points opposite to the incident ray.
+    vec3f normal_at_hitpoint;
+    vec2f uv;
+    const Material *material;
+    /* material albedo, textured if it has a texture */
+    vec3f albedo;
+    /* length of the path from the camera */
+    float distance;
+  };
+
+  /* `distance` is the length of the path up to org. */
+  bool closestHit(const Scene &scene, const vec3f &org, const vec3f &dir, float tmin, float distance, HitRecord &record) {
+    cpu::Hit hit;
+    if (!cpu::intersect(scene.bvh, org, dir, tmin, INFTY, hit)) return false;
+
+    record.material = &scene.world.materials[scene.world.meshes[hit.meshID].materialID];
+    record.hitpoint = org + dir * hit.t;
+
+    const auto normal = cpu::geometricNormal(scene.bvh, hit);
+    const auto shading_normal = cpu::shadingNormal(scene.bvh, scene.world, hit, normal);
+    record.normal_at_hitpoint = normalize((dot(dir, normal) < 0.f) ? shading_normal : -shading_normal);
+    record.uv = cpu::hitUV(scene.world, hit);
+    record.distance = distance + hit.t;
+
+    // footprint of the ray cone in texture space
+    const float footprint = scene.pixelSpread * record.distance * cpu::uvDensity(scene.bvh, scene.world, hit);
+    record.albedo = cpu::albedo(*record.material, scene.settings.textures, record.uv, footprint);
+    return true;
+  }
+
+  /* Mean over NUM_DIFFUSE_SAMPLES cosine-distributed rays of the photon
+   * estimate at the surfaces they hit, or the cached value when an
+   * irradiance cache is in use and valid here. */
+  vec3f indirectDiffuse(const Scene &scene, const HitRecord &record, Random &random) {
+    const vec3f normal = normalize(record.normal_at_hitpoint);
+    cpu::IrradianceCache *cache = scene.settings.irradianceCache;
+
+    vec3f cached;
+    if (cache && cache->lookup(record.hitpoint, normal, cached)) return cached;
+
+    std::vector<cpu::IrradianceSample> samples;
+    if (cache) samples.reserve(NUM_DIFFUSE_SAMPLES);
+
+    vec3f diffuse_term = 0.f;
+    for (int s = 0; s < NUM_DIFFUSE_SAMPLES; s++) {
+      vec3f random_vec, random_direction;
+      do {
+        randomUnitVector(random, random_vec);
+        random_direction = normal + random_vec;
+      } while (nearZero(random_direction));
+      random_direction = normalize(random_direction);
+
+      cpu::IrradianceSample sample{random_direction, vec3f(0.f), INFTY};
+
+      HitRecord diffuse_record;
+      if (closestHit(scene, record.hitpoint, random_direction, 3*EPS, record.distance, diffuse_record)) {
+        sample.distance = length(diffuse_record.hitpoint - record.hitpoint);
+        if (diffuse_record.material->diffuse > 0.f) {
+          const float scattered_diffuse_brdf = diffuse_record.material->diffuse / PI;
+          const vec3f diffuse_colour = cpu::gatherIrradiance(scene.photonMaps, diffuse_record.hitpoint,
+                                                             diffuse_record.normal_at_hitpoint, scattered_diffuse_brdf);
+          sample.radiance = diffuse_colour * diffuse_record.albedo;
+        }
+      }
+
+      diffuse_term += sample.radiance;
+      if (cache) samples.push_back(sample);
+    }
+
+    if (cache) return cache->insert(record.hitpoint, normal, samples);
+    return diffuse_term / (float)NUM_DIFFUSE_SAMPLES;
+  }
+
+  /* ray_colour of the device code. Returns false when the ray escaped. */
+  bool rayColour(const Scene &scene, const vec3f &org, const vec3f &dir, float distance, Random &random,
+                 HitRecord &record, vec3f &colour) {
+    if (!closestHit(scene, org, dir, EPS, distance, record)) {
+      colour = scene.settings.skyColour;
+      return false;
+    }
+
+    const auto albedo = record.albedo;
+    const auto diffuse_brdf = record.material->diffuse / PI;
+
+    // Direct light
+    vec3f direct_illumination = 0.f;
+    const bool sample_lights = !scene.lightTree.empty();
+    const int num_light_samples = sample_lights ? scene.settings.lightSamples
+                                                : static_cast<int>(scene.world.light_sources.size());
+    for (int l = 0; l < num_light_samples; l++) {
+      int light_id = l;
+      float light_weight = 1.f;
+      if (sample_lights) {
+        float light_pdf;
+        light_id = light_tree::sample(scene.lightTree.data(), record.hitpoint, record.normal_at_hitpoint, random(), light_pdf);
+        if (light_id < 0) break;
+        light_weight = 1.f / (light_pdf * num_light_samples);
+      }
+      const auto &current_light = scene.world.light_sources[light_id];
+      const auto shadow_ray_org = record.hitpoint;
+      auto light_dir = current_light.pos - shadow_ray_org;
+      const auto distance_to_light = norm(light_dir);
+      light_dir = normalize(light_dir);
+
+      const auto light_dot_norm = dot(light_dir, record.normal_at_hitpoint);
+      if (light_dot_norm < 0.f) continue; // light hits "behind" triangle
+
+      if (cpu::occluded(scene.bvh, shadow_ray_org, light_dir, EPS, distance_to_light * (1.f - EPS))) continue;
+
+      const auto specular_brdf = specularBrdf(record.material->specular, light_dir, dir, record.normal_at_hitpoint);
+
+      direct_illumination += light_weight
+        * static_cast<float>(current_light.power)
+        * light_dot_norm
+        * (1.f / (distance_to_light * distance_to_light))
+        * (diffuse_brdf + specular_brdf)
+        * current_light.rgb;
+    }
+    const auto direct_term = albedo * direct_illumination;
+
+    // Caustics
+    const vec3f caustics_term = cpu::gatherPhotons(scene.photonMaps.caustic, record.hitpoint,
+                                                   record.normal_at_hitpoint, diffuse_brdf);
+
+    // Diffuse term
+    vec3f diffuse_term = 0.f;
+    if (diffuse_brdf > 0.f) diffuse_term = indirectDiffuse(scene, record, random);
+    diffuse_term *= albedo;
+
+    colour = DIFFUSE_FACTOR*diffuse_term + CAUSTICS_FACTOR*caustics_term + DIRECT_LIGHT_FACTOR*direct_term;
+    return true;
+  }
+
+  vec3f tracePath(const Scene &scene, vec3f org, vec3f dir, Random &random, uint64_t &segments) {
+    vec3f colour = 0.f;
+    vec3f attenuation = 1.f;
+    float distance = 0.f;
+    for (int d = 0; d < scene.settings.maxDepth; d++) {
+      segments++;
+      HitRecord record;
+      vec3f ray_colour;
+      const bool hit = rayColour(scene, org, dir, distance, random, record, ray_colour);
+      colour += ray_colour * attenuation;
+      if (!hit) break;
+
+      bool absorbed;
+      float coefficient;
+      const auto out_dir = reflect_or_refract_ray(
+        *record.material, dir,
+        record.normal_at_hitpoint, random,
+        absorbed, coefficient
+      );
+
+      if (absorbed) break;
+      attenuation *= coefficient * record.albedo;
+      if (!russianRoulette(attenuation, 1.f, d + 1, scene.settings.rrMinDepth, random)) break;
+
+      org = record.hitpoint;
+      dir = out_dir;
+      distance = record.distance;
+    }
+    return colour;
+  }
+
+  /* Interleaves the low 16 bits of x and y. */
+  uint32_t mortonCode(uint32_t x, uint32_t y) {
+    const auto spread = [](uint32_t v) {
+      v &= 0xffffu;
+      v = (v | (v << 8)) & 0x00ff00ffu;
+      v = (v | (v << 4)) & 0x0f0f0f0fu;
+      v = (v | (v << 2)) & 0x33333333u;
+      v = (v | (v << 1)) & 0x55555555u;
+      return v;
+    };
+    return spread(x) | (spread(y) << 1);
+  }
+
+  /* Tiles in Z order, so the tiles handed out around the same time are
+   * close on screen and gather from the same photons: a chunked photon map
+   * then pages in each chunk about once instead of once per row of tiles. */
+  std::vector<vec2i> tileOrder(const vec2i &numTiles) {
+    std::vector<vec2i> tiles;
+    tiles.reserve(numTiles.x * numTiles.y);
+    for (int y = 0; y < numTiles.y; y++) {
+      for (int x = 0; x < numTiles.x; x++) tiles.emplace_back(x, y);
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const vec2i &a, const vec2i &b) {
+      return mortonCode(a.x, a.y) < mortonCode(b.x, b.y);
+    });
+    return tiles;
+  }
+
+  uint32_t toRGBA(const vec3f &colour) {
+    const auto r = static_cast<uint32_t>(owl::clamp(colour.x, 0.f, 1.f) * 255.9f);
+    const auto g = static_cast<uint32_t>(owl::clamp(colour.y, 0.f, 1.f) * 255.9f);
+    const auto b = static_cast<uint32_t>(owl::clamp(colour.z, 0.f, 1.f) * 255.9f);
+    return r | (g << 8) | (b << 16) | (0xffu << 24);
+  }
+}
+
+std::vector<uint32_t> cpu::render(const World &world, const Bvh &bvh, const PhotonMaps &photonMaps,
+                                  const Camera &camera, const RenderSettings &settings) {
+  TRACE_SCOPE("cpu::render", "render");
+  const auto lightTree = settings.lightSampling == light_tree::LIGHT_TREE
+    ? light_tree::build(world.light_sources) : std::vector<light_tree::Node>();
+  const float pixelSpread = length(camera.dir_dv)
+    / (settings.fbSize.y * length(camera.dir_00 + 0.5f * (camera.dir_du + camera.dir_dv)));
+  const Scene scene{world, bvh, photonMaps, settings, lightTree, pixelSpread};
+  const vec2i fbSize = settings.fbSize;
+  std::vector<uint32_t> fb(fbSize.x * fbSize.y);
+
+  const vec2i numTiles((fbSize.x + TILE_SIZE - 1) / TILE_SIZE, (fbSize.y + TILE_SIZE - 1) / TILE_SIZE);
+  const auto tiles = tileOrder(numTiles);
+  parallel::forEach(tiles.size(), [&](size_t tile) {
+    TRACE_SCOPE("tile", "worker");
+    const vec2i tileOrigin = tiles[tile] * TILE_SIZE;
+    uint64_t segments = 0;
+
+    for (int py = tileOrigin.y; py < std::min(tileOrigin.y + TILE_SIZE, fbSize.y); py++) {
+      for (int px = tileOrigin.x; px < std::min(tileOrigin.x + TILE_SIZE, fbSize.x); px++) {
+        const vec2i pixelID(px, py);
+        Random random;
+        random.init(pixelID.x, pixelID.y + settings.seed * fbSize.y);
+
+        auto final_colour = vec3f(0.f);
+        for (int sample = 0; sample < settings.samplesPerPixel; sample++) {
+          const auto random_eps = vec2f(random(), random());
+          const vec2f screen = (vec2f(pixelID)+random_eps) / vec2f(fbSize);
+
+          const vec3f direction = normalize(camera.dir_00
+                                            + screen.x * camera.dir_du
+                                            + screen.y * camera.dir_dv);
+          final_colour += tracePath(scene, camera.pos, direction, random, segments);
+        }
+        final_colour = final_colour * (1.f / settings.samplesPerPixel);
+
+        fb[px + fbSize.x * (fbSize.y - 1 - py)] = toRGBA(final_colour);
+      }
+    }
+    if (settings.stats) settings.stats->pathSegments += segments;
+  }, settings.numThreads);
+
+  return fb;
+}
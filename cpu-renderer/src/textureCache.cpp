@@ -0,0 +1,303 @@
+#include "../include/textureCache.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#include <unistd.h>
+
+#include "../../common/src/trace.h"
+
+// private copy of the decoder; the executables may bring their own
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#include "../../externals/stb/stb_image.h"
+
+using namespace owl;
+
+#define TEXTURE_TILES_MAGIC 0x53454c54u /* "TLES" */
+#define TEXTURE_TILES_VERSION 1u
+#define TEXTURE_TILES_HEADER_WORDS 6
+
+namespace {
+  float srgbToLinear(float c) {
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+  }
+
+  uint32_t linearToSrgb8(float c) {
+    c = std::clamp(c, 0.f, 1.f);
+    const float s = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.f / 2.4f) - 0.055f;
+    return static_cast<uint32_t>(s * 255.f + 0.5f);
+  }
+
+  const std::array<float, 256> &srgbTable() {
+    static const std::array<float, 256> table = [] {
+      std::array<float, 256> t;
+      for (int i = 0; i < 256; i++) t[i] = srgbToLinear(i / 255.f);
+      return t;
+    }();
+    return table;
+  }
+
+  vec3f unpack(uint32_t texel) {
+    const auto &table = srgbTable();
+    return vec3f(table[texel & 0xff], table[(texel >> 8) & 0xff], table[(texel >> 16) & 0xff]);
+  }
+
+  uint64_t tileKey(int id, int level, int tx, int ty) {
+    return (static_cast<uint64_t>(id) << 48) | (static_cast<uint64_t>(level) << 40)
+         | (static_cast<uint64_t>(ty) << 20) | static_cast<uint64_t>(tx);
+  }
+
+  int wrap(int i, int n) {
+    const int r = i % n;
+    return r < 0 ? r + n : r;
+  }
+
+  /* Width and height of every level, down to 1x1. */
+  std::vector<int> levelSizes(int width, int height) {
+    std::vector<int> sizes;
+    while (true) {
+      sizes.push_back(width);
+      sizes.push_back(height);
+      if (width == 1 && height == 1) break;
+      width = std::max(1, width / 2);
+      height = std::max(1, height / 2);
+    }
+    return sizes;
+  }
+
+  /* 2x2 box filter, clamping at odd edges. */
+  std::vector<vec3f> downsample(const std::vector<vec3f> &src, int width, int height, int dstWidth, int dstHeight) {
+    std::vector<vec3f> dst(static_cast<size_t>(dstWidth) * dstHeight);
+    for (int y = 0; y < dstHeight; y++) {
+      for (int x = 0; x < dstWidth; x++) {
+        const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+        const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+        dst[x + static_cast<size_t>(dstWidth) * y] = 0.25f * (src[x0 + static_cast<size_t>(width) * y0] + src[x1 + static_cast<size_t>(width) * y0]
+                                                            + src[x0 + static_cast<size_t>(width) * y1] + src[x1 + static_cast<size_t>(width) * y1]);
+      }
+    }
+    return dst;
+  }
+}
+
+cpu::TextureCache::TextureCache(const std::vector<std::string> &files, const TextureCacheSettings &settings)
+  : settings(settings), textures(files.size()), prepared(new std::once_flag[files.size()]) {
+  for (size_t i = 0; i < files.size(); i++) textures[i].file = files[i];
+}
+
+cpu::TextureCache::~TextureCache() {
+  for (auto &texture : textures) {
+    if (texture.tiles) std::fclose(texture.tiles);
+  }
+}
+
+size_t cpu::TextureCache::residentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return bytes;
+}
+
+void cpu::TextureCache::prepare(int id) {
+  TRACE_SCOPE("TextureCache::prepare", "io");
+  namespace fs = std::filesystem;
+  Texture &texture = textures[id];
+  const int tileSize = settings.tileSize;
+
+  std::error_code error;
+  const fs::path directory = settings.directory.empty() ? fs::temp_directory_path(error) : fs::path(settings.directory);
+  const size_t pathHash = std::hash<std::string>()(fs::absolute(texture.file, error).string());
+  const fs::path tiledPath = directory / ("texture-" + std::to_string(pathHash) + "-" + std::to_string(tileSize) + ".tiles");
+
+  const auto setLevels = [&](int width, int height) {
+    const std::vector<int> sizes = levelSizes(width, height);
+    uint64_t firstTile = 0;
+    for (size_t l = 0; l < sizes.size(); l += 2) {
+      Level level;
+      level.width = sizes[l];
+      level.height = sizes[l + 1];
+      level.tilesX = (level.width + tileSize - 1) / tileSize;
+      level.tilesY = (level.height + tileSize - 1) / tileSize;
+      level.firstTile = firstTile;
+      firstTile += static_cast<uint64_t>(level.tilesX) * level.tilesY;
+      texture.levels.push_back(level);
+    }
+  };
+  const auto fileBytes = [&] {
+    const Level &last = texture.levels.back();
+    const uint64_t numTiles = last.firstTile + static_cast<uint64_t>(last.tilesX) * last.tilesY;
+    return TEXTURE_TILES_HEADER_WORDS * sizeof(uint32_t) + numTiles * tileSize * tileSize * sizeof(uint32_t);
+  };
+
+  // reuse the tiles of an earlier run unless the image changed since
+  const bool upToDate = fs::exists(tiledPath, error) && fs::exists(texture.file, error)
+    && fs::last_write_time(tiledPath, error) >= fs::last_write_time(texture.file, error);
+  if (upToDate) {
+    texture.tiles = std::fopen(tiledPath.string().c_str(), "rb");
+    uint32_t header[TEXTURE_TILES_HEADER_WORDS];
+    if (texture.tiles && std::fread(header, sizeof(header), 1, texture.tiles) == 1
+        && header[0] == TEXTURE_TILES_MAGIC && header[1] == TEXTURE_TILES_VERSION
+        && header[2] == static_cast<uint32_t>(tileSize)) {
+      setLevels(static_cast<int>(header[3]), static_cast<int>(header[4]));
+      // a file cut short would otherwise read as white tiles forever
+      texture.valid = !texture.levels.empty() && texture.levels.size() == header[5]
+                      && fs::file_size(tiledPath, error) == fileBytes() && !error;
+      if (texture.valid) return;
+    }
+    if (texture.tiles) std::fclose(texture.tiles);
+    texture.tiles = nullptr;
+    texture.levels.clear();
+  }
+
+  int width, height, channels;
+  stbi_uc *pixels = stbi_load(texture.file.c_str(), &width, &height, &channels, 4);
+  if (!pixels) {
+    std::cerr << "Warning: Unable to load texture " << texture.file << ": " << stbi_failure_reason() << std::endl;
+    return;
+  }
+  setLevels(width, height);
+
+  std::vector<vec3f> level(static_cast<size_t>(width) * height);
+  const auto &table = srgbTable();
+  for (size_t i = 0; i < level.size(); i++) {
+    level[i] = vec3f(table[pixels[4 * i]], table[pixels[4 * i + 1]], table[pixels[4 * i + 2]]);
+  }
+  stbi_image_free(pixels);
+
+  // written under a name of this process and renamed into place, so neither
+  // a killed run nor another process preparing the same texture leaves a
+  // partial file behind at tiledPath
+  const std::string temporary = tiledPath.string() + ".tmp" + std::to_string(::getpid());
+  FILE *out = std::fopen(temporary.c_str(), "wb");
+  if (!out) {
+    std::cerr << "Warning: Unable to write " << temporary << std::endl;
+    texture.levels.clear();
+    return;
+  }
+  const uint32_t header[TEXTURE_TILES_HEADER_WORDS] = {TEXTURE_TILES_MAGIC, TEXTURE_TILES_VERSION, static_cast<uint32_t>(tileSize),
+                                                       static_cast<uint32_t>(width), static_cast<uint32_t>(height),
+                                                       static_cast<uint32_t>(texture.levels.size())};
+  bool ok = std::fwrite(header, sizeof(header), 1, out) == 1;
+
+  Tile tile(static_cast<size_t>(tileSize) * tileSize);
+  for (size_t l = 0; l < texture.levels.size(); l++) {
+    const Level &info = texture.levels[l];
+    if (l > 0) level = downsample(level, texture.levels[l - 1].width, texture.levels[l - 1].height, info.width, info.height);
+
+    for (int ty = 0; ty < info.tilesY; ty++) {
+      for (int tx = 0; tx < info.tilesX; tx++) {
+        // texels past the edge repeat the last row and column
+        for (int y = 0; y < tileSize; y++) {
+          for (int x = 0; x < tileSize; x++) {
+            const int sx = std::min(tx * tileSize + x, info.width - 1);
+            const int sy = std::min(ty * tileSize + y, info.height - 1);
+            const vec3f &c = level[sx + static_cast<size_t>(info.width) * sy];
+            tile[x + static_cast<size_t>(tileSize) * y] = linearToSrgb8(c.x) | (linearToSrgb8(c.y) << 8)
+                                                        | (linearToSrgb8(c.z) << 16) | (0xffu << 24);
+          }
+        }
+        ok = ok && std::fwrite(tile.data(), sizeof(uint32_t), tile.size(), out) == tile.size();
+      }
+    }
+  }
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok || std::rename(temporary.c_str(), tiledPath.string().c_str()) != 0) {
+    std::cerr << "Warning: Unable to write " << tiledPath.string() << std::endl;
+    std::remove(temporary.c_str());
+    texture.levels.clear();
+    return;
+  }
+
+  texture.tiles = std::fopen(tiledPath.string().c_str(), "rb");
+  texture.valid = texture.tiles != nullptr;
+}
+
+std::shared_ptr<const cpu::TextureCache::Tile> cpu::TextureCache::tile(int id, int level, int tx, int ty) {
+  const uint64_t key = tileKey(id, level, tx, ty);
+  std::lock_guard<std::mutex> lock(mutex);
+
+  const auto found = resident.find(key);
+  if (found != resident.end()) {
+    lru.splice(lru.begin(), lru, found->second.lru);
+    cacheStats.tileHits++;
+    return found->second.tile;
+  }
+
+  cacheStats.tileMisses++;
+  const Texture &texture = textures[id];
+  const Level &info = texture.levels[level];
+  const size_t tileTexels = static_cast<size_t>(settings.tileSize) * settings.tileSize;
+  auto loaded = std::make_shared<Tile>(tileTexels, 0xffffffffu);
+
+  const uint64_t index = info.firstTile + static_cast<uint64_t>(ty) * info.tilesX + tx;
+  const long offset = static_cast<long>(TEXTURE_TILES_HEADER_WORDS * sizeof(uint32_t) + index * tileTexels * sizeof(uint32_t));
+  if (std::fseek(texture.tiles, offset, SEEK_SET) != 0
+      || std::fread(loaded->data(), sizeof(uint32_t), tileTexels, texture.tiles) != tileTexels) {
+    std::cerr << "Warning: Short read from the tiles of " << texture.file << std::endl;
+  }
+
+  lru.push_front(key);
+  resident.emplace(key, Resident{loaded, lru.begin()});
+  bytes += tileTexels * sizeof(uint32_t);
+
+  // always keep the tile just loaded, even over budget
+  while (bytes > settings.memoryBudget && lru.size() > 1) {
+    resident.erase(lru.back());
+    lru.pop_back();
+    bytes -= tileTexels * sizeof(uint32_t);
+    cacheStats.evictions++;
+  }
+  return loaded;
+}
+
+vec3f cpu::TextureCache::bilinear(int id, int level, const vec2f &uv) {
+  const Level &info = textures[id].levels[level];
+  const int tileSize = settings.tileSize;
+
+  const float x = uv.x * info.width - 0.5f;
+  const float y = uv.y * info.height - 0.5f;
+  const int x0 = static_cast<int>(std::floor(x));
+  const int y0 = static_cast<int>(std::floor(y));
+  const float fx = x - x0, fy = y - y0;
+
+  // neighbouring texels mostly share a tile, so keep the last one
+  std::shared_ptr<const Tile> current;
+  int currentX = -1, currentY = -1;
+  const auto texel = [&](int px, int py) {
+    px = wrap(px, info.width);
+    py = wrap(py, info.height);
+    const int tx = px / tileSize, ty = py / tileSize;
+    if (tx != currentX || ty != currentY) {
+      current = tile(id, level, tx, ty);
+      currentX = tx;
+      currentY = ty;
+    }
+    return unpack((*current)[(px - tx * tileSize) + static_cast<size_t>(tileSize) * (py - ty * tileSize)]);
+  };
+
+  return (1.f - fy) * ((1.f - fx) * texel(x0, y0) + fx * texel(x0 + 1, y0))
+       + fy * ((1.f - fx) * texel(x0, y0 + 1) + fx * texel(x0 + 1, y0 + 1));
+}
+
+vec3f cpu::TextureCache::sample(int id, const vec2f &uv, float footprint) {
+  if (id < 0 || id >= static_cast<int>(textures.size())) return vec3f(1.f);
+  std::call_once(prepared[id], [&] { prepare(id); });
+  const Texture &texture = textures[id];
+  if (!texture.valid) return vec3f(1.f);
+
+  // texture images have v going down
+  const vec2f st(uv.x, 1.f - uv.y);
+
+  const int numLevels = static_cast<int>(texture.levels.size());
+  const float texels = footprint * static_cast<float>(std::max(texture.levels[0].width, texture.levels[0].height));
+  const float lod = std::clamp(std::log2(std::max(texels, 1.f)), 0.f, static_cast<float>(numLevels - 1));
+  const int level = static_cast<int>(lod);
+  const float blend = lod - level;
+
+  vec3f colour = bilinear(id, level, st);
+  if (blend > 0.f && level + 1 < numLevels) colour = (1.f - blend) * colour + blend * bilinear(id, level + 1, st);
+  return colour;
+}
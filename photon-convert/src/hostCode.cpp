@@ -0,0 +1,76 @@
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "../../common/src/photonFile.h"
+
+/* One-shot converter between the text and binary photon file formats (see
+ * photonFile.h).
+ *
+ * usage: photonConvert [--to-text] [--threads N] INPUT OUTPUT
+ *
+ * The input may be in either format. The output is binary unless
+ * --to-text is given. Both are streamed, so files far larger than memory
+ * convert at the speed of the parser.
+ */
+
+struct Float3 {
+  float x, y, z;
+};
+
+struct Photon {
+  Float3 pos;
+  Float3 dir;
+  Float3 color;
+};
+
+int main(int ac, char **av) {
+  bool toText = false;
+  int numThreads = 0;
+  std::string paths[2];
+  int numPaths = 0;
+  for (int i = 1; i < ac; i++) {
+    const std::string arg = av[i];
+    if (arg == "--to-text") toText = true;
+    else if (arg == "--threads" && i + 1 < ac) numThreads = std::stoi(av[++i]);
+    else if (numPaths < 2) paths[numPaths++] = arg;
+    else numPaths = 3;
+  }
+  if (numPaths != 2) {
+    std::cerr << "usage: photonConvert [--to-text] [--threads N] INPUT OUTPUT" << std::endl;
+    return 1;
+  }
+
+  std::ofstream out(paths[1], toText ? std::ios::out : std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Error opening file: " << paths[1] << std::endl;
+    return 1;
+  }
+
+  // the binary header is rewritten with the count at the end
+  uint64_t count = 0;
+  if (toText) out << std::fixed << std::setprecision(6);
+  else photon_file::writeBinaryHeader(out, count);
+
+  const bool opened = photon_file::forEachBlock<Photon>(paths[0], [&](const Photon *photons, size_t n) {
+    if (toText) photon_file::writeLines(out, photons, n);
+    else photon_file::writeBinaryPhotons(out, photons, n);
+    count += n;
+  }, numThreads);
+  if (!opened) return 1;
+
+  if (!toText) {
+    out.seekp(0);
+    photon_file::writeBinaryHeader(out, count);
+  }
+  out.close();
+  if (!out) {
+    std::cerr << "Error writing file: " << paths[1] << std::endl;
+    return 1;
+  }
+
+  std::cout << "Converted " << count << " photons to " << (toText ? "text" : "binary") << ": " << paths[1] << std::endl;
+  return 0;
+}
@@ -22,20 +22,23 @@ inline __device__ void updateScatteredRay(Ray &ray, PhotonMapperPRD &prd) {
   prd.color = prd.scattered.color;
 }
 
-inline __device__ void shootPhoton(const PhotonMapperRGD &self, Ray &ray, PhotonMapperPRD &prd) {
+/* `power` is the largest component of the emitted colour; the roulette keeps
+ * the surviving photons close to it. */
+inline __device__ void shootPhoton(const PhotonMapperRGD &self, Ray &ray, PhotonMapperPRD &prd, const float power) {
   for (int i = 0; i < self.maxDepth; i++) {
     owl::traceRay(self.world, ray, prd);
 
     if (prd.event == SCATTER_DIFFUSE) {
       if (i > 0) savePhoton(self, prd);
       updateScatteredRay(ray, prd);
+      if (!russianRoulette(prd.color, power, i + 1, self.rrMinDepth, prd.random)) break;
     } else {
       break;
     }
   }
 }
 
-inline __device__ void shootCausticsPhoton(const PhotonMapperRGD &self, Ray &ray, PhotonMapperPRD &prd) {
+inline __device__ void shootCausticsPhoton(const PhotonMapperRGD &self, Ray &ray, PhotonMapperPRD &prd, const float power) {
   for (int i = 0; i < self.maxDepth; i++) {
     owl::traceRay(self.world, ray, prd);
 
@@ -45,6 +48,7 @@ inline __device__ void shootCausticsPhoton(const PhotonMapperRGD &self, Ray &ray
 
     if (prd.event & (SCATTER_SPECULAR | SCATTER_REFRACT)) {
       updateScatteredRay(ray, prd);
+      if (!russianRoulette(prd.color, power, i + 1, self.rrMinDepth, prd.random)) break;
     } else {
       break;
     }
@@ -56,7 +60,10 @@ OPTIX_RAYGEN_PROGRAM(pointLightRayGen)(){
   const vec2i id = owl::getLaunchIndex();
 
   PhotonMapperPRD prd;
-  prd.random.init(id.x, id.y);
+  // the upper half of the 64-bit photon index goes into the second seed,
+  // so streams only start to differ from a 32-bit index past 2^32 photons
+  const uint64_t photonIndex = self.photonOffset + id.x;
+  prd.random.init(static_cast<uint32_t>(photonIndex), id.y + static_cast<uint32_t>(photonIndex >> 32));
   prd.color = self.color;
 
   Ray ray;
@@ -64,10 +71,11 @@ OPTIX_RAYGEN_PROGRAM(pointLightRayGen)(){
   ray.direction = randomPointInUnitSphere(prd.random);
   ray.tmin = EPS;
 
+  const float power = fmaxf(self.color.x, fmaxf(self.color.y, self.color.z));
   if (self.causticsMode) {
-    shootCausticsPhoton(self, ray, prd);
+    shootCausticsPhoton(self, ray, prd, power);
   } else {
-    shootPhoton(self, ray, prd);
+    shootPhoton(self, ray, prd, power);
   }
 }
 
@@ -76,7 +84,7 @@ inline __device__ void scatterDiffuse(PhotonMapperPRD &prd, const TrianglesGeomD
   const vec3f rayOrg = optixGetWorldRayOrigin();
   const vec3f hitPoint = rayOrg + optixGetRayTmax() * rayDir;
 
-  const vec3f normal = getPrimitiveNormal(self);
+  const vec3f normal = getShadingNormal(self, getPrimitiveNormal(self));
 
   prd.event = SCATTER_DIFFUSE;
   prd.scattered.origin = hitPoint;
@@ -89,7 +97,7 @@ inline __device__ void scatterSpecular(PhotonMapperPRD &prd, const TrianglesGeom
   const vec3f rayOrg = optixGetWorldRayOrigin();
   const vec3f hitPoint = rayOrg + optixGetRayTmax() * rayDir;
 
-  const vec3f normal = getPrimitiveNormal(self);
+  const vec3f normal = getShadingNormal(self, getPrimitiveNormal(self));
 
   prd.event = SCATTER_SPECULAR;
   prd.scattered.origin = hitPoint;
@@ -102,7 +110,7 @@ inline __device__ void scatterRefract(PhotonMapperPRD &prd, const TrianglesGeomD
   const vec3f rayOrg = optixGetWorldRayOrigin();
   const vec3f hitPoint = rayOrg + optixGetRayTmax() * rayDir;
 
-  const vec3f normal = getPrimitiveNormal(self);
+  const vec3f normal = getShadingNormal(self, getPrimitiveNormal(self));
 
   prd.event = SCATTER_REFRACT;
   prd.scattered.origin = hitPoint;
@@ -11,6 +11,8 @@ struct PhotonMapperRGD
     int *photonsCount;
     OptixTraversableHandle world;
     int maxDepth;
+    /* bounces before Russian roulette starts, negative disables it */
+    int rrMinDepth;
     bool causticsMode;
 };
 
@@ -19,6 +21,9 @@ struct PointLightRGD: public PhotonMapperRGD
     owl::vec3f position;
     owl::vec3f color;
     float intensity;
+    /* index of the first photon of a launch, so batched launches emit the
+     * same photons as one launch over all of them */
+    uint64_t photonOffset;
 };
 
 enum RayEvent
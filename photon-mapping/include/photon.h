@@ -6,6 +6,5 @@ struct Photon
 {
     owl::vec3f pos;
     owl::vec3f dir;
-    int power;
     owl::vec3f color;
 };
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include "owl/owl.h"
 #include "../../common/src/camera.h"
 #include "photon.h"
@@ -22,8 +24,15 @@ struct Program {
     OWLBuffer causticsPhotonsCount;
 
     int maxDepth;
-    int castedCausticsPhotons;
-    int castedDiffusePhotons;
-    int photonsPerWatt;
-    int causticsPhotonsPerWatt;
+    /* bounces before Russian roulette starts, -1 disables it */
+    int rrMinDepth;
+    /* 64-bit, so a run can emit more than 2^31 photons across its launches */
+    int64_t castedCausticsPhotons;
+    int64_t castedDiffusePhotons;
+    int64_t photonsPerWatt;
+    int64_t causticsPhotonsPerWatt;
+    /* emitted photons per launch; the photon buffers hold one launch */
+    int photonsPerLaunch;
+    /* full blocks waiting for the photon writer thread */
+    int writerQueueDepth;
 };
\ No newline at end of file
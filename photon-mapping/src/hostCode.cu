@@ -1,6 +1,7 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <iostream>
-#include <fstream>
-#include <iomanip>
 // public owl node-graph API
 #include "owl/owl.h"
 // our device-side data structures
@@ -13,6 +14,8 @@
 #include "assimp/Importer.hpp"
 #include "../include/program.h"
 #include "../../common/src/configLoader.h"
+#include "../../common/src/trace.h"
+#include "../../common/src/photonWriter.h"
 
 #define LOG(message)                                            \
   std::cout << OWL_TERMINAL_BLUE;                               \
@@ -28,36 +31,18 @@ auto outFileName = "result.png";
 
 extern "C" char deviceCode_ptx[];
 
-void writeAlivePhotons(const Photon* photons, int count, const std::string& filename) {
-  std::ofstream outFile(filename);
-
-  if (!outFile.is_open()) {
-    std::cerr << "Error opening file: " << filename << std::endl;
-    return;
-  }
-
-  outFile << std::fixed << std::setprecision(6);
-
-  for (int i = 0; i < count; i++) {
-    auto photon = photons[i];
-    outFile << photon.pos.x << " " << photon.pos.y << " " << photon.pos.z << " "
-            << photon.dir.x << " " << photon.dir.y << " " << photon.dir.z << " "
-            << photon.color.x << " " << photon.color.y << " " << photon.color.z << "\n";
-  }
-
-  outFile.close();
-}
-
 void setupPointLightRayGenProgram(Program &program) {
   OWLVarDecl rayGenVars[] = {
           { "photons",OWL_BUFPTR,OWL_OFFSETOF(PointLightRGD,photons)},
           { "photonsCount",OWL_BUFPTR,OWL_OFFSETOF(PointLightRGD,photonsCount)},
           { "maxDepth",OWL_INT,OWL_OFFSETOF(PointLightRGD, maxDepth)},
+          { "rrMinDepth",OWL_INT,OWL_OFFSETOF(PointLightRGD, rrMinDepth)},
           {"causticsMode", OWL_BOOL, OWL_OFFSETOF(PointLightRGD, causticsMode)},
           { "world",OWL_GROUP,OWL_OFFSETOF(PointLightRGD,world)},
           { "position",OWL_FLOAT3,OWL_OFFSETOF(PointLightRGD,position)},
           { "color",OWL_FLOAT3,OWL_OFFSETOF(PointLightRGD,color)},
           { "intensity",OWL_FLOAT,OWL_OFFSETOF(PointLightRGD,intensity)},
+          { "photonOffset",OWL_ULONG,OWL_OFFSETOF(PointLightRGD,photonOffset)},
           { /* sentinel to mark end of list */ }
   };
 
@@ -67,34 +52,56 @@ void setupPointLightRayGenProgram(Program &program) {
 
   owlRayGenSetGroup(program.rayGen,"world",program.geometryData.worldGroup);
   owlRayGenSet1i(program.rayGen,"maxDepth",program.maxDepth);
+  owlRayGenSet1i(program.rayGen,"rrMinDepth",program.rrMinDepth);
 }
 
-void runPointLightRayGen(Program &program, const LightSource &light, bool causticsMode) {
+/* Traces the light's photons in launches of photonsPerLaunch. Each launch
+ * is handed to the writer, whose thread writes it out while the next one is
+ * traced, so the photon buffer only ever holds one launch. The photon count
+ * and offsets are 64-bit; only the per-launch counter is 32-bit, which
+ * photonsPerLaunch keeps from overflowing. */
+void runPointLightRayGen(Program &program, const LightSource &light, bool causticsMode,
+                         photon_file::AsyncWriter<Photon> &writer) {
+  TRACE_SCOPE(causticsMode ? "trace caustic photons" : "trace photons", "render");
   owlRayGenSet1b(program.rayGen,"causticsMode",causticsMode);
   owlRayGenSet3f(program.rayGen,"position",reinterpret_cast<const owl3f&>(light.pos));
   owlRayGenSet3f(program.rayGen,"color",reinterpret_cast<const owl3f&>(light.rgb));
   owlRayGenSet1f(program.rayGen,"intensity",light.power);
 
-  if (causticsMode) {
-    owlRayGenSetBuffer(program.rayGen,"photons",program.causticsPhotonsBuffer);
-    owlRayGenSetBuffer(program.rayGen,"photonsCount",program.causticsPhotonsCount);
-  } else {
-    owlRayGenSetBuffer(program.rayGen,"photons",program.photonsBuffer);
-    owlRayGenSetBuffer(program.rayGen,"photonsCount",program.photonsCount);
-  }
+  const OWLBuffer photons = causticsMode ? program.causticsPhotonsBuffer : program.photonsBuffer;
+  const OWLBuffer photonsCount = causticsMode ? program.causticsPhotonsCount : program.photonsCount;
+  owlRayGenSetBuffer(program.rayGen,"photons",photons);
+  owlRayGenSetBuffer(program.rayGen,"photonsCount",photonsCount);
+
+  const int64_t initialPhotons = light.power * (causticsMode ? program.causticsPhotonsPerWatt : program.photonsPerWatt);
 
-  const int initialPhotons = light.power * (causticsMode ? program.causticsPhotonsPerWatt : program.photonsPerWatt);
+  for (int64_t offset = 0; offset < initialPhotons; offset += program.photonsPerLaunch) {
+    const int launchSize = static_cast<int>(std::min<int64_t>(program.photonsPerLaunch, initialPhotons - offset));
+    owlRayGenSet1ul(program.rayGen,"photonOffset",static_cast<uint64_t>(offset));
+    owlBufferClear(photonsCount);
 
-  owlBuildSBT(program.owlContext);
-  owlRayGenLaunch2D(program.rayGen,initialPhotons,1);
+    owlBuildSBT(program.owlContext);
+    owlRayGenLaunch2D(program.rayGen,launchSize,1);
+
+    auto *fb = static_cast<const Photon*>(owlBufferGetPointer(photons, 0));
+    const auto count = *static_cast<const int*>(owlBufferGetPointer(photonsCount, 0));
+    writer.write(fb, static_cast<size_t>(count));
+  }
 }
 
+/* Every emitted photon stores at most maxDepth photons, so the buffers hold
+ * one launch of photonsPerLaunch. That is clamped so the buffer size and
+ * the device's int photon counter stay below INT_MAX. */
 void initPhotonBuffers(Program &program) {
-  program.photonsBuffer = owlHostPinnedBufferCreate(program.owlContext, OWL_USER_TYPE(Photon), program.castedDiffusePhotons * program.maxDepth);
+  program.photonsPerLaunch = std::min(program.photonsPerLaunch, std::max(1, INT_MAX / std::max(program.maxDepth, 1)));
+
+  const size_t diffuseLaunch = std::min<int64_t>(program.castedDiffusePhotons, program.photonsPerLaunch);
+  program.photonsBuffer = owlHostPinnedBufferCreate(program.owlContext, OWL_USER_TYPE(Photon), diffuseLaunch * program.maxDepth);
   program.photonsCount = owlHostPinnedBufferCreate(program.owlContext, OWL_INT, 1);
   owlBufferClear(program.photonsCount);
 
-  program.causticsPhotonsBuffer = owlHostPinnedBufferCreate(program.owlContext,OWL_USER_TYPE(Photon),program.castedCausticsPhotons * program.maxDepth);
+  const size_t causticsLaunch = std::min<int64_t>(program.castedCausticsPhotons, program.photonsPerLaunch);
+  program.causticsPhotonsBuffer = owlHostPinnedBufferCreate(program.owlContext,OWL_USER_TYPE(Photon),causticsLaunch * program.maxDepth);
   program.causticsPhotonsCount = owlHostPinnedBufferCreate(program.owlContext, OWL_INT, 1);
   owlBufferClear(program.causticsPhotonsCount);
 }
@@ -109,32 +116,41 @@ void computePhotonsPerWatt(Program &program) {
   program.causticsPhotonsPerWatt = program.castedCausticsPhotons / totalWatts;
 }
 
-void runNormal(Program &program, const std::string &output_filename) {
+/* Returns false if the photon file couldn't be written in full. */
+bool runNormal(Program &program, const std::string &output_filename) {
   LOG("launching normal photons ...")
 
+  photon_file::AsyncWriter<Photon> writer(output_filename, program.writerQueueDepth);
+  if (!writer.valid()) return false;
   for (auto light : program.world->light_sources) {
-    runPointLightRayGen(program, light, false);
+    runPointLightRayGen(program, light, false, writer);
   }
 
-  LOG("done with launch, writing photons ...")
-  auto *fb = static_cast<const Photon*>(owlBufferGetPointer(program.photonsBuffer, 0));
-  auto count = *(int*)owlBufferGetPointer(program.photonsCount, 0);
-
-  writeAlivePhotons(fb, count, output_filename);
+  LOG("done with launch, flushing photons ...")
+  if (!writer.close()) {
+    std::cerr << "Error writing file: " << output_filename << std::endl;
+    return false;
+  }
+  LOG_OK("wrote " << writer.count() << " photons")
+  return true;
 }
 
-void runCaustics(Program &program, const std::string &output_filename) {
+bool runCaustics(Program &program, const std::string &output_filename) {
   LOG("launching caustics photons ...")
 
+  photon_file::AsyncWriter<Photon> writer(output_filename, program.writerQueueDepth);
+  if (!writer.valid()) return false;
   for (auto light : program.world->light_sources) {
-    runPointLightRayGen(program, light, true);
+    runPointLightRayGen(program, light, true, writer);
   }
 
-  LOG("done with launch, writing caustics photons ...")
-  auto *fb = static_cast<const Photon*>(owlBufferGetPointer(program.causticsPhotonsBuffer, 0));
-  auto count = *(int*)owlBufferGetPointer(program.causticsPhotonsCount, 0);
-
-  writeAlivePhotons(fb, count, output_filename);
+  LOG("done with launch, flushing caustics photons ...")
+  if (!writer.close()) {
+    std::cerr << "Error writing file: " << output_filename << std::endl;
+    return false;
+  }
+  LOG_OK("wrote " << writer.count() << " caustics photons")
+  return true;
 }
 
 int main(int ac, char **av)
@@ -149,6 +165,7 @@ int main(int ac, char **av)
   LOG("Loading Config file...")
 
   auto cfg = parse_config();
+  start_trace_from_config(cfg);
 
   auto photons_filename = cfg["data"]["photons_file"].as_string();
   auto caustics_photons_filename = cfg["data"]["caustics_photons_file"].as_string();
@@ -156,13 +173,23 @@ int main(int ac, char **av)
   program.castedDiffusePhotons = cfg["photon-mapper"]["casted_diffuse_photons"].as_integer();
   program.castedCausticsPhotons = cfg["photon-mapper"]["casted_caustics_photons"].as_integer();
   program.maxDepth = cfg["photon-mapper"]["max_depth"].as_integer();
+  program.rrMinDepth = toml::find_or<bool>(cfg, "photon-mapper", "russian_roulette", false)
+    ? toml::find_or<int>(cfg, "photon-mapper", "russian_roulette_min_depth", 2) : -1;
+  program.photonsPerLaunch = std::max(1, toml::find_or<int>(cfg, "photon-mapper", "photons_per_launch", 1 << 20));
+  program.writerQueueDepth = std::max(1, toml::find_or<int>(cfg, "photon-mapper", "writer_queue_depth", 4));
 
   auto *ai_importer = new Assimp::Importer;
   program.world =  assets::import_scene(ai_importer, model_path);
 
+  // the device photon pass ignores Material::albedoTexture
+  if (!program.world->textures.empty()) {
+    std::cerr << "Error: " << model_path << " uses textured materials, which only the CPU renderer supports" << std::endl;
+    return 1;
+  }
+
   LOG_OK("Loaded world.")
 
-  program.geometryData = loadGeometry(program.owlContext, program.world);
+  program.geometryData = loadGeometry(program.owlContext, program.world, toml::find_or<bool>(cfg, "data", "precomputed_normals", false));
 
   owlGeomTypeSetClosestHit(program.geometryData.trianglesGeomType, 0, program.owlModule,"triangleMeshClosestHit");
   owlMissProgCreate(program.owlContext, program.owlModule, "miss", 0, nullptr, -1);
@@ -172,16 +199,20 @@ int main(int ac, char **av)
 
   setupPointLightRayGenProgram(program);
 
-  owlBuildPrograms(program.owlContext);
-  owlBuildPipeline(program.owlContext);
+  {
+    TRACE_SCOPE("build pipeline");
+    owlBuildPrograms(program.owlContext);
+    owlBuildPipeline(program.owlContext);
+  }
 
   LOG("launching ...")
 
-  runNormal(program, photons_filename);
-  runCaustics(program, caustics_photons_filename);
+  const bool written = runNormal(program, photons_filename) && runCaustics(program, caustics_photons_filename);
 
   LOG("destroying devicegroup ...");
   owlContextDestroy(program.owlContext);
+  trace::finish();
+  if (!written) return 1;
 
   LOG_OK("seems all went OK; app is done, this should be the last output ...");
   return 0;
@@ -13,12 +13,10 @@ OPTIX_RAYGEN_PROGRAM(photonViewerRayGen)()
   const int photonId = owl::getLaunchIndex().x;
   const Photon photon = self.photons[photonId];
 
+  // off-screen photons are culled on the host before upload
   if(photon.pixel.x < 0 || photon.pixel.x >= self.frameBufferSize.x ||
      photon.pixel.y < 0 || photon.pixel.y >= self.frameBufferSize.y)
-  {
-    printf("x: %d, y: %d\n", photon.pixel.x, photon.pixel.y);
     return;
-  }
 
   const auto direction = photon.pos - self.cameraPos;
 
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "owl/common/math/vec.h"
+#include "../../common/src/parallel.h"
+#include "../../common/src/trace.h"
+
+/* Host-side projection of a photon map onto the viewer's frame buffer.
+ *
+ * Photons are handled in blocks of PROJECTION_BLOCK, spread over all cores.
+ * Each block first gathers its positions into structure-of-arrays scratch,
+ * so the projection itself is a branch-free loop over contiguous floats
+ * that the compiler vectorises. Photons behind the near plane or outside
+ * the frame buffer are culled there, and the visible ones are compacted in
+ * their original order: nothing off-screen is uploaded or drawn.
+ */
+#define PROJECTION_BLOCK 4096
+
+namespace photon_projection {
+    /* Appends the photons of [begin, end) that land in the frame buffer to
+     * `visible`, with their pixel set. `viewProjection` is a glm
+     * (column-major) matrix; PhotonT needs `pos` and `pixel`. */
+    template<typename PhotonT>
+    void projectBlock(const PhotonT *photons, size_t begin, size_t end, const glm::mat4 &viewProjection,
+                      const owl::vec2i &size, std::vector<PhotonT> &visible) {
+        float x[PROJECTION_BLOCK], y[PROJECTION_BLOCK], z[PROJECTION_BLOCK];
+        int px[PROJECTION_BLOCK], py[PROJECTION_BLOCK];
+        const int count = static_cast<int>(end - begin);
+
+        for (int i = 0; i < count; i++) {
+            const auto &pos = photons[begin + i].pos;
+            x[i] = pos.x;
+            y[i] = pos.y;
+            z[i] = pos.z;
+        }
+
+        const glm::mat4 &m = viewProjection;
+        const float width = static_cast<float>(size.x);
+        const float height = static_cast<float>(size.y);
+        for (int i = 0; i < count; i++) {
+            const float cx = m[0][0] * x[i] + m[1][0] * y[i] + m[2][0] * z[i] + m[3][0];
+            const float cy = m[0][1] * x[i] + m[1][1] * y[i] + m[2][1] * z[i] + m[3][1];
+            const float cz = m[0][2] * x[i] + m[1][2] * y[i] + m[2][2] * z[i] + m[3][2];
+            const float cw = m[0][3] * x[i] + m[1][3] * y[i] + m[2][3] * z[i] + m[3][3];
+
+            // clamped before the conversion, which is undefined out of range
+            // (NaN fails the first comparison and is culled at -1)
+            float sx = (cx / cw + 1.f) * 0.5f * width;
+            float sy = (cy / cw + 1.f) * 0.5f * height;
+            sx = sx > -1.f ? sx : -1.f;
+            sx = sx < width + 1.f ? sx : width + 1.f;
+            sy = sy > -1.f ? sy : -1.f;
+            sy = sy < height + 1.f ? sy : height + 1.f;
+            const int pixelX = static_cast<int>(sx);
+            const int pixelY = size.y - static_cast<int>(sy);
+
+            // & rather than && keeps the loop free of branches
+            const bool inside = (cw > 0.f) & (cz >= -cw) &
+                                (pixelX >= 0) & (pixelX < size.x) & (pixelY >= 0) & (pixelY < size.y);
+            px[i] = inside ? pixelX : -1;
+            py[i] = inside ? pixelY : -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (px[i] < 0) continue;
+            visible.push_back(photons[begin + i]);
+            visible.back().pixel = owl::vec2i(px[i], py[i]);
+        }
+    }
+
+    /* The photons that land in the frame buffer, with their pixel set, in
+     * the order of `photons`. */
+    template<typename PhotonT>
+    std::vector<PhotonT> projectVisible(const std::vector<PhotonT> &photons, const glm::mat4 &viewProjection,
+                                        const owl::vec2i &size, int workers = 0) {
+        const size_t numBlocks = (photons.size() + PROJECTION_BLOCK - 1) / PROJECTION_BLOCK;
+        std::vector<std::vector<PhotonT>> blocks(numBlocks);
+
+        {
+            TRACE_SCOPE("project and cull");
+            parallel::forEach(numBlocks, [&](size_t b) {
+                const size_t begin = b * PROJECTION_BLOCK;
+                const size_t end = std::min(begin + PROJECTION_BLOCK, photons.size());
+                projectBlock(photons.data(), begin, end, viewProjection, size, blocks[b]);
+            }, workers);
+        }
+
+        std::vector<size_t> offsets(numBlocks + 1, 0);
+        for (size_t b = 0; b < numBlocks; b++) offsets[b + 1] = offsets[b] + blocks[b].size();
+
+        TRACE_SCOPE("compact visible");
+        std::vector<PhotonT> visible(offsets[numBlocks]);
+        parallel::forEach(numBlocks, [&](size_t b) {
+            std::copy(blocks[b].begin(), blocks[b].end(), visible.begin() + offsets[b]);
+            blocks[b] = {};
+        }, workers);
+        return visible;
+    }
+}
@@ -1,13 +1,17 @@
 #pragma once
 
+#include <memory>
+
 #include "owl/owl.h"
 #include "photon.h"
 #include "../../common/src/world.h"
 #include "owl/common/math/vec.h"
 #include "glm/glm.hpp"
+#include "../../cpu-renderer/include/photonSplatter.h"
 
 struct Program {
-    OWLContext owlContext;
+    /* nullptr when the maps are splatted on the CPU */
+    OWLContext owlContext = nullptr;
     OWLModule owlModule;
     OWLRayGen rayGen;
 
@@ -16,8 +20,17 @@ struct Program {
 
     GeometryData geometryData;
 
-    OWLBuffer photonsBuffer;
-    int numPhotons;
+    /* reused by every photon map the viewer renders */
+    OWLBuffer photonsBuffer = nullptr;
+    int numPhotons = 0;
+
+    /* view-projection of the camera, computed once with the scene */
+    glm::mat4 projection;
+
+    /* renderer = "cpu": the scene's depth, rasterised once, replaces the
+     * OWL context and the occlusion rays */
+    std::unique_ptr<cpu::DepthBuffer> depthBuffer;
+    cpu::SplatSettings splatSettings;
 
     struct {
         owl::vec3f lookAt;
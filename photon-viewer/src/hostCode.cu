@@ -1,5 +1,6 @@
+#include <algorithm>
 #include <iostream>
-#include <fstream>
+#include <utility>
 #include <vector>
 #include <string>
 // public owl node-graph API
@@ -13,65 +14,35 @@
 #include "../../externals/stb/stb_image_write.h"
 #include "assimp/Importer.hpp"
 #include "../include/program.h"
+#include "../include/photonProjection.h"
 #include "../../common/src/common.h"
 #include "glm/ext/matrix_transform.hpp"
 #include "glm/ext/matrix_clip_space.hpp"
 #include "../../common/src/configLoader.h"
+#include "../../common/src/trace.h"
+#include "../../common/src/photonFile.h"
 
 #define RGBA_BLACK 0xFF000000
 
 extern "C" char deviceCode_ptx[];
 
-Photon* readPhotonsFromFile(const std::string& filename, int& count) {
-  std::ifstream file(filename);
-  std::vector<Photon> tempPhotons;
-
-  if (!file.is_open()) {
-    std::cerr << "Error opening file: " << filename << std::endl;
-    count = 0;
-    return nullptr;
-  }
-
-  Photon photon;
-  while (file >> photon.pos.x >> photon.pos.y >> photon.pos.z
-              >> photon.dir.x >> photon.dir.y >> photon.dir.z
-              >> photon.color.x >> photon.color.y >> photon.color.z) {
-    tempPhotons.push_back(photon);
-  }
-
-  count = tempPhotons.size();
-  if (count == 0) {
-    return nullptr;
-  }
-
-  Photon* photonArray = new Photon[count];
-  std::copy(tempPhotons.begin(), tempPhotons.end(), photonArray);
-
-  return photonArray;
-}
-
+/* Projects the photons of one map with the view-projection matrix computed
+ * at scene setup and uploads the visible ones into the photon buffer, which
+ * is reused (resized) across maps. */
 void loadPhotons(Program &program, const std::string& filename) {
-  auto photons = readPhotonsFromFile(filename, program.numPhotons);
-
-  auto viewMatrix = glm::lookAt(glm::vec3(program.camera.lookFrom.x, program.camera.lookFrom.y, program.camera.lookFrom.z),
-                                glm::vec3(program.camera.lookAt.x, program.camera.lookAt.y, program.camera.lookAt.z),
-                                glm::vec3(program.camera.lookUp.x, program.camera.lookUp.y, program.camera.lookUp.z));
-  auto perspectiveMatrix = glm::perspective(program.camera.fovy, program.frameBufferSize.x / static_cast<float>(program.frameBufferSize.y), 0.1f, 1000.f);
-  auto projectionMatrix = perspectiveMatrix * viewMatrix;
-
-  for (int i = 0; i < program.numPhotons; i++) {
-    auto photon = &photons[i];
-    auto screenPos = projectionMatrix * glm::vec4(photon->pos.x, photon->pos.y, photon->pos.z, 1.f);
-    if (screenPos.z < 0) {
-      photon->pixel.x = -1;
-      photon->pixel.y = -1;
-    }else {
-      photon->pixel.x = static_cast<int>((screenPos.x / screenPos.w + 1.f) * 0.5f * program.frameBufferSize.x);
-      photon->pixel.y = program.frameBufferSize.y -  static_cast<int>((screenPos.y / screenPos.w + 1.f) * 0.5f * program.frameBufferSize.y);
-    }
+  auto photons = photon_file::read<Photon>(filename);
+  const auto visible = photon_projection::projectVisible(photons, program.projection, program.frameBufferSize);
+  LOG(visible.size() << " of " << photons.size() << " photons visible")
+  program.numPhotons = static_cast<int>(visible.size());
+  photons = {};
+
+  TRACE_SCOPE("upload photons");
+  if (program.photonsBuffer == nullptr) {
+    program.photonsBuffer = owlDeviceBufferCreate(program.owlContext, OWL_USER_TYPE(Photon), program.numPhotons, visible.data());
+  } else {
+    owlBufferResize(program.photonsBuffer, program.numPhotons);
+    if (program.numPhotons > 0) owlBufferUpload(program.photonsBuffer, visible.data());
   }
-
-  program.photonsBuffer = owlDeviceBufferCreate(program.owlContext, OWL_USER_TYPE(Photon), program.numPhotons, photons);
 }
 
 void setupMissProgram(Program &program) {
@@ -102,55 +73,99 @@ void setupRaygenProgram(Program &program) {
   owlRayGenSet2i(program.rayGen,"frameBufferSize",reinterpret_cast<const owl2i&>(program.frameBufferSize));
   owlRayGenSetGroup(program.rayGen,"world",program.geometryData.worldGroup);
   owlRayGenSet3f(program.rayGen,"cameraPos",reinterpret_cast<const owl3f&>(program.camera.lookFrom));
-  owlRayGenSetBuffer(program.rayGen,"photons",program.photonsBuffer);
-  owlRayGenSet1i(program.rayGen,"numPhotons",program.numPhotons);
 }
 
-void run(toml::value &cfg, const std::string &photons_filename, const std::string &output_filename) {
-  Program program;
-  program.owlContext = owlContextCreate(nullptr,1);
-  program.owlModule = owlModuleCreate(program.owlContext, deviceCode_ptx);
-  owlContextSetRayTypeCount(program.owlContext, 1);
+/* "color" (last photon per pixel), "density" or "heat" (flux). */
+cpu::SplatMode parse_splat_mode(const std::string &name) {
+  if (name == "density") return cpu::SPLAT_DENSITY;
+  if (name == "heat") return cpu::SPLAT_HEATMAP;
+  if (name != "color") std::cerr << "Unknown splat_mode \"" << name << "\", using color\n";
+  return cpu::SPLAT_COLOR;
+}
 
+/* Everything that does not depend on the photon map: the scene and the
+ * camera projection, and either the OWL context with the acceleration
+ * structures and programs or the CPU depth buffer. Done once, however many
+ * maps are rendered. */
+void setupScene(Program &program, toml::value &cfg) {
+  TRACE_SCOPE("setup scene");
   program.camera.lookAt = toml_to_vec3f(cfg["camera"]["look_at"]);
   program.camera.lookFrom = toml_to_vec3f(cfg["camera"]["look_from"]);
   program.camera.lookUp = toml_to_vec3f(cfg["camera"]["look_up"]);
   program.camera.fovy = static_cast<float>(cfg["camera"]["fovy"].as_floating());
 
   program.frameBufferSize = toml_to_vec2i(cfg["photon-viewer"]["fb_size"]);
-  program.frameBuffer = owlHostPinnedBufferCreate(program.owlContext,OWL_INT,program.frameBufferSize.x * program.frameBufferSize.y);
 
-  auto *ai_importer = new Assimp::Importer;
-  auto world =  assets::import_scene(ai_importer, cfg["data"]["model_path"].as_string());
+  auto viewMatrix = glm::lookAt(glm::vec3(program.camera.lookFrom.x, program.camera.lookFrom.y, program.camera.lookFrom.z),
+                                glm::vec3(program.camera.lookAt.x, program.camera.lookAt.y, program.camera.lookAt.z),
+                                glm::vec3(program.camera.lookUp.x, program.camera.lookUp.y, program.camera.lookUp.z));
+  auto perspectiveMatrix = glm::perspective(program.camera.fovy, program.frameBufferSize.x / static_cast<float>(program.frameBufferSize.y), 0.1f, 1000.f);
+  program.projection = perspectiveMatrix * viewMatrix;
+
+  Assimp::Importer ai_importer;
+  auto world =  assets::import_scene(&ai_importer, cfg["data"]["model_path"].as_string());
 
   LOG_OK("Loaded world.");
 
-  int frameBufferLength = program.frameBufferSize.x * program.frameBufferSize.y;
-  int *initialFrameBuffer = new int[frameBufferLength];
-  for (int i = 0; i < frameBufferLength; i++) {
-    initialFrameBuffer[i] = RGBA_BLACK;
+  if (toml::find_or<std::string>(cfg, "photon-viewer", "renderer", "gpu") == "cpu") {
+    program.splatSettings.mode = parse_splat_mode(toml::find_or<std::string>(cfg, "photon-viewer", "splat_mode", "color"));
+    program.splatSettings.depthBias = toml::find_or<float>(cfg, "photon-viewer", "depth_bias", 0.01f);
+    program.depthBuffer = std::make_unique<cpu::DepthBuffer>(*world, program.projection, program.frameBufferSize);
+    return;
   }
-  owlBufferUpload(program.frameBuffer,initialFrameBuffer);
-  delete[] initialFrameBuffer;
 
-  program.geometryData = loadGeometry(program.owlContext, world);
+  program.owlContext = owlContextCreate(nullptr,1);
+  program.owlModule = owlModuleCreate(program.owlContext, deviceCode_ptx);
+  owlContextSetRayTypeCount(program.owlContext, 1);
+  program.frameBuffer = owlHostPinnedBufferCreate(program.owlContext,OWL_INT,program.frameBufferSize.x * program.frameBufferSize.y);
 
-  loadPhotons(program, photons_filename);
+  program.geometryData = loadGeometry(program.owlContext, world, toml::find_or<bool>(cfg, "data", "precomputed_normals", false));
 
   setupMissProgram(program);
   setupClosestHitProgram(program);
   setupRaygenProgram(program);
 
-  owlBuildPrograms(program.owlContext);
-  owlBuildPipeline(program.owlContext);
+  {
+    TRACE_SCOPE("build pipeline");
+    owlBuildPrograms(program.owlContext);
+    owlBuildPipeline(program.owlContext);
+  }
+}
+
+void writePng(const Program &program, const std::string &output_filename, const uint32_t *fb) {
+  TRACE_SCOPE("write png", "io");
+  stbi_write_png(output_filename.c_str(),program.frameBufferSize.x,program.frameBufferSize.y,4,fb,program.frameBufferSize.x*sizeof(uint32_t));
+}
+
+/* Renders one photon map against the scene of setupScene(). On the GPU only
+ * the photon buffer and the raygen record change between maps; on the CPU
+ * the map is depth tested against the depth buffer and splatted. */
+void renderPhotonMap(Program &program, const std::string &photons_filename, const std::string &output_filename) {
+  TRACE_SCOPE("render photon map");
+  if (program.depthBuffer) {
+    const auto photons = photon_file::read<Photon>(photons_filename);
+    const auto image = cpu::splatPhotons(*program.depthBuffer, photons, program.splatSettings);
+    writePng(program, output_filename, image.data());
+    return;
+  }
+
+  loadPhotons(program, photons_filename);
+
+  owlRayGenSetBuffer(program.rayGen,"photons",program.photonsBuffer);
+  owlRayGenSet1i(program.rayGen,"numPhotons",program.numPhotons);
   owlBuildSBT(program.owlContext);
 
-  owlRayGenLaunch2D(program.rayGen, program.numPhotons, 1);
+  {
+    auto *fb = static_cast<uint32_t*>(const_cast<void*>(owlBufferGetPointer(program.frameBuffer, 0)));
+    std::fill(fb, fb + program.frameBufferSize.x * program.frameBufferSize.y, RGBA_BLACK);
+  }
 
-  auto *fb = static_cast<const uint32_t*>(owlBufferGetPointer(program.frameBuffer, 0));
-  stbi_write_png(output_filename.c_str(),program.frameBufferSize.x,program.frameBufferSize.y,4,fb,program.frameBufferSize.x*sizeof(uint32_t));
+  if (program.numPhotons > 0) {
+    TRACE_SCOPE("render", "render");
+    owlRayGenLaunch2D(program.rayGen, program.numPhotons, 1);
+  }
 
-  owlContextDestroy(program.owlContext);
+  writePng(program, output_filename, static_cast<const uint32_t*>(owlBufferGetPointer(program.frameBuffer, 0)));
 }
 
 int main(int ac, char **av)
@@ -159,20 +174,29 @@ int main(int ac, char **av)
   LOG("Loading Config file...")
 
   auto cfg = parse_config();
+  start_trace_from_config(cfg);
 
-  auto photons_filename = cfg["data"]["photons_file"].as_string();
-  auto caustics_photons_filename = cfg["data"]["caustics_photons_file"].as_string();
+  // the global and caustic maps, then any listed under [[photon-viewer.maps]]
+  std::vector<std::pair<std::string, std::string>> maps = {
+    { cfg["data"]["photons_file"].as_string(), cfg["photon-viewer"]["output_filename"].as_string() },
+    { cfg["data"]["caustics_photons_file"].as_string(), cfg["photon-viewer"]["caustics_output_filename"].as_string() },
+  };
+  for (const auto &map : toml::find_or<toml::array>(cfg, "photon-viewer", "maps", toml::array{})) {
+    maps.emplace_back(toml::find<std::string>(map, "photons_file"), toml::find<std::string>(map, "output_filename"));
+  }
 
-  auto output_filename = cfg["photon-viewer"]["output_filename"].as_string();
-  auto caustics_output_filename = cfg["photon-viewer"]["caustics_output_filename"].as_string();
+  LOG("Loading scene...")
+  Program program;
+  setupScene(program, cfg);
 
-  LOG("Running photon viewer...")
-  run(cfg, photons_filename, output_filename);
-  LOG_OK("Done with photon viewer.")
+  for (const auto &map : maps) {
+    LOG("Rendering " << map.first << "...")
+    renderPhotonMap(program, map.first, map.second);
+    LOG_OK("Wrote " << map.second << ".")
+  }
 
-  LOG("Running caustics viewer...")
-  run(cfg, caustics_photons_filename, caustics_output_filename);
-  LOG_OK("Done with caustics viewer.")
+  if (program.owlContext) owlContextDestroy(program.owlContext);
+  trace::finish();
 
   return 0;
 }
\ No newline at end of file
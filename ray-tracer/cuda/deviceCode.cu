@@ -7,13 +7,6 @@
 #include "owl/RayGen.h"
 #include <cukd/knn.h>
 
-#define DIRECT_LIGHT_FACTOR 0.8f
-#define CAUSTICS_FACTOR 0.08f
-#define DIFFUSE_FACTOR 0.2f
-#define SPECULAR_FACTOR 1.f
-
-#define NUM_DIFFUSE_SAMPLES 20
-
 using namespace owl;
 
 // Work-around to adding up vec3f throwing a CUDA runtime error.
@@ -48,13 +41,24 @@ MyColour ray_colour(const RayGenData &self, Ray &ray, PerRayData &prd) {
     return c;
   }
 
-  auto albedo = prd.hit_record.material.albedo;
-  auto diffuse_brdf = prd.hit_record.material.diffuse / PI;
+  const Material &material = self.materials[prd.hit_record.materialID];
+  auto albedo = material.albedo;
+  auto diffuse_brdf = material.diffuse / PI;
 
   // Direct light
   vec3f direct_illumination = 0.f;
-  for (int l = 0; l < self.numLights; l++) {
-    auto current_light = self.lights[l];
+  const bool sample_lights = self.lightSampling == light_tree::LIGHT_TREE;
+  const int num_light_samples = sample_lights ? self.lightSamples : self.numLights;
+  for (int l = 0; l < num_light_samples; l++) {
+    int light_id = l;
+    float light_weight = 1.f;
+    if (sample_lights) {
+      float light_pdf;
+      light_id = light_tree::sample(self.lightTree, prd.hit_record.hitpoint, prd.hit_record.normal_at_hitpoint, prd.random(), light_pdf);
+      if (light_id < 0) break;
+      light_weight = 1.f / (light_pdf * num_light_samples);
+    }
+    auto current_light = self.lights[light_id];
 
     auto shadow_ray_org = prd.hit_record.hitpoint;
     auto light_dir = current_light.pos - shadow_ray_org;
@@ -84,12 +88,13 @@ MyColour ray_colour(const RayGenData &self, Ray &ray, PerRayData &prd) {
       u0, u1
     );
 
-    auto specular_brdf = specularBrdf(prd.hit_record.material.specular,
+    auto specular_brdf = specularBrdf(material.specular,
       light_dir,
       ray.direction,
       prd.hit_record.normal_at_hitpoint);
 
-    direct_illumination += light_visibility
+    direct_illumination += light_weight
+      * light_visibility
       * static_cast<float>(current_light.power)
       * light_dot_norm
       * (1.f / (distance_to_light * distance_to_light))
@@ -103,8 +108,7 @@ MyColour ray_colour(const RayGenData &self, Ray &ray, PerRayData &prd) {
   MyColour final_colour;
 
   // Caustics
-  vec3f caustics_term = gatherPhotons(prd.hit_record.hitpoint, prd.hit_record.normal_at_hitpoint, self.causticPhotons,
-                                      self.numCausticPhotons, diffuse_brdf, self.causticPhotonsBounds);
+  vec3f caustics_term = gatherFromPhotonMap(self, true, prd.hit_record.hitpoint, prd.hit_record.normal_at_hitpoint, diffuse_brdf);
 
   // Diffuse term
   vec3f diffuse_term = 0.f;
@@ -141,14 +145,16 @@ MyColour ray_colour(const RayGenData &self, Ray &ray, PerRayData &prd) {
     );
 
     vec3f diffuse_colour = 0.f;
-    if (diffuse_prd.hit_record.material.diffuse > 0.f)
+    if (diffuse_prd.ray_missed) continue;
+    const Material &scattered_material = self.materials[diffuse_prd.hit_record.materialID];
+    if (scattered_material.diffuse > 0.f)
     {
-      float scattered_diffuse_brdf = diffuse_prd.hit_record.material.diffuse / PI;
+      float scattered_diffuse_brdf = scattered_material.diffuse / PI;
 
-      diffuse_colour = gatherPhotons(diffuse_prd.hit_record.hitpoint, diffuse_prd.hit_record.normal_at_hitpoint,
-                                     self.globalPhotons, self.numGlobalPhotons, scattered_diffuse_brdf, self.globalPhotonsBounds);
+      diffuse_colour = gatherIrradiance(self, diffuse_prd.hit_record.hitpoint, diffuse_prd.hit_record.normal_at_hitpoint,
+                                        scattered_diffuse_brdf);
 
-      diffuse_term += diffuse_colour * diffuse_prd.hit_record.material.albedo;
+      diffuse_term += diffuse_colour * scattered_material.albedo;
     }
   }
   diffuse_term /= (float)NUM_DIFFUSE_SAMPLES;
@@ -170,17 +176,21 @@ vec3f tracePath(const RayGenData &self, Ray &ray, PerRayData &prd, const int dep
     // Diffuse terms
     const auto [r, g, b] = ray_colour(self, ray, prd);
     colour += vec3f(r, g, b) * attenuation;
+    // no hit record to continue from
+    if (prd.ray_missed) break;
 
+    const Material &material = self.materials[prd.hit_record.materialID];
     bool absorbed;
     float coefficient;
     auto out_dir = reflect_or_refract_ray(
-      prd.hit_record.material, ray.direction,
+      material, ray.direction,
       prd.hit_record.normal_at_hitpoint, prd.random,
       absorbed, coefficient
     );
 
     if (absorbed) break;
-    attenuation *= coefficient * prd.hit_record.material.albedo;
+    attenuation *= coefficient * material.albedo;
+    if (!russianRoulette(attenuation, 1.f, d + 1, self.rr_min_depth, prd.random)) break;
 
     ray = Ray(prd.hit_record.hitpoint, out_dir, EPS, INFTY);
   }
@@ -234,7 +244,7 @@ inline __device__ void closestHit() {
   auto &prd = owl::getPRD<PerRayData>();
   const auto self = owl::getProgramData<TrianglesGeomData>();
 
-  prd.hit_record.material = *self.material;
+  prd.hit_record.materialID = self.materialID;
 
   const vec3f rayDir = optixGetWorldRayDirection();
   const vec3f rayOrg = optixGetWorldRayOrigin();
@@ -242,10 +252,11 @@ inline __device__ void closestHit() {
 
   prd.hit_record.hitpoint = rayOrg + rayDir * tmax;
 
-  // Calculate normal at hitpoint and flip if it's pointing
-  // in the same direction as the incident ray.
+  // Calculate normal at hitpoint and flip if the surface faces away from
+  // the incident ray; the shading normal follows the geometric one.
   const auto normal = getPrimitiveNormal(self);
-  prd.hit_record.normal_at_hitpoint = (dot(rayDir, normal) < 0.f) ? normal : -normal;
+  const auto shading_normal = getShadingNormal(self, normal);
+  prd.hit_record.normal_at_hitpoint = (dot(rayDir, normal) < 0.f) ? shading_normal : -shading_normal;
   prd.hit_record.normal_at_hitpoint = normalize(prd.hit_record.normal_at_hitpoint);
 
   prd.colour = 0.f;
@@ -3,120 +3,142 @@
 #include <cukd/knn.h>
 #include "../../common/cuda/helpers.h"
 #include "../include/deviceCode.h"
-
-#define K_NEAREST_NEIGHBOURS 50
-#define K_MAX_DISTANCE 100
-#define CONE_FILTER_C 1.1f
-
-inline __device__
-cukd::HeapCandidateList<K_NEAREST_NEIGHBOURS> KNearestPhotons(float3 queryPoint, cukd::box_t<float3>* worldBounds, Photon* photons, int numPoints, float& sqrDistOfFurthestOneInClosest) {
-    cukd::HeapCandidateList<K_NEAREST_NEIGHBOURS> closest(K_MAX_DISTANCE);
-    sqrDistOfFurthestOneInClosest = cukd::stackBased::knn<
-        cukd::HeapCandidateList<K_NEAREST_NEIGHBOURS>,Photon, Photon_traits
-    >(closest,queryPoint,photons,numPoints); // add worldBounds
- return closest;
-}
-
+#include "../include/renderConstants.h"
+#include "../include/scattering.h"
+
+/* One of the KD-trees a gather runs over. */
+struct PhotonMapPart {
+    const PhotonNode* photons;
+    const uint32_t* flux;
+    int count;
+};
+
+/* Forwards to a candidate list shared by two trees, offsetting the point
+ * IDs of the second so the merged list can tell the trees apart. Like
+ * kdtree::OffsetCandidates on the host. */
+template<typename CandidateList>
+struct OffsetCandidates {
+    CandidateList& list;
+    int offset;
+
+    inline __device__ float initialCullDist2() const { return list.initialCullDist2(); }
+    inline __device__ float processCandidate(int candPrimID, float candDist2) { return list.processCandidate(candPrimID + offset, candDist2); }
+    inline __device__ float returnValue() const { return list.returnValue(); }
+};
+
+/* The K nearest photons of `first` and `second` together, as if they were
+ * one tree. IDs from `second` start at first.count. */
 inline __device__
-owl::vec3f calculate_refracted(const Material& material,
-                               const owl::vec3f& ray_dir,
-                               const owl::vec3f& normal,
-                               Random rand)
-{
-    using namespace owl;
-
-    vec3f outward_normal, refracted;
-    float ni_over_nt, reflection_coefficient, cosine;
-
-    if (dot(ray_dir, normal) > 0.f) {
-        outward_normal = -normal;
-        ni_over_nt = material.refraction_idx;
-        cosine = dot(ray_dir, normal);
-        cosine = sqrtf(1.f - material.refraction_idx*material.refraction_idx*(1.f-cosine*cosine));
-    } else {
-        outward_normal = normal;
-        ni_over_nt = 1.f / material.refraction_idx;
-        cosine = -dot(ray_dir, normal);
+cukd::HeapCandidateList<K_NEAREST_NEIGHBOURS> KNearestPhotons(float3 queryPoint, const PhotonMapPart& first, const PhotonMapPart& second, float& sqrDistOfFurthestOneInClosest) {
+    using Candidates = cukd::HeapCandidateList<K_NEAREST_NEIGHBOURS>;
+    Candidates closest(K_MAX_DISTANCE);
+    sqrDistOfFurthestOneInClosest = cukd::stackBased::knn<Candidates, PhotonNode, PhotonNode_traits>(
+      closest, queryPoint, first.photons, first.count);
+    if (second.count > 0) {
+      OffsetCandidates<Candidates> shared{closest, first.count};
+      sqrDistOfFurthestOneInClosest = cukd::stackBased::knn<OffsetCandidates<Candidates>, PhotonNode, PhotonNode_traits>(
+        shared, queryPoint, second.photons, second.count);
     }
-
-    if (refract(ray_dir, outward_normal, ni_over_nt, refracted))
-        reflection_coefficient = schlickFresnelAprox(cosine, material.refraction_idx);
-    else
-        reflection_coefficient = 1.f;
-
-    vec3f scattered_dir;
-    if (rand() < reflection_coefficient) {
-        scattered_dir = reflect(ray_dir, normal);
-    } else {
-        scattered_dir = refracted;
-    }
-
-    return scattered_dir;
+    return closest;
 }
 
+/* Cone-filtered estimate over the K nearest photons of one map, or of two
+ * maps at once (pass an empty `second` for one). */
 inline __device__
-owl::vec3f reflect_or_refract_ray(const Material& material,
-                                                    const owl::vec3f& ray_dir,
-                                                    const owl::vec3f& normal,
-                                                    Random rand,
-                                                    bool& absorbed,
-                                                    float& coef)
-{
-    absorbed = false;
-
-    auto r = rand();
-    if (r < material.specular) {
-        coef = material.specular;
-        return reflect(ray_dir, normal);
-    }
-    if (r < material.specular + material.transmission) {
-        coef = material.transmission;
-        return calculate_refracted(material, ray_dir, normal, rand);
-    }
-
-    coef = 0.f;
-    absorbed = true;
-    return 0.f;
-}
-
-inline __device__ float specularBrdf(const float specular_coefficient,
-                                      const owl::vec3f& incoming_light_dir,
-                                      const owl::vec3f& outgoing_light_dir,
-                                      const owl::vec3f& normal) {
-    if (const auto reflected_incoming = reflect(incoming_light_dir, normal);
-        nearZero(reflected_incoming - outgoing_light_dir))
-        return specular_coefficient;
-
-    return 0;
-}
-
-inline __device__
-owl::vec3f gatherPhotons(const owl::vec3f& hitpoint, const owl::vec3f& normal, Photon* photons, const int num_photons,const float diffuse_brdf, cukd::box_t<float3>* worldBounds) {
+owl::vec3f gatherPhotons(const owl::vec3f& hitpoint, const owl::vec3f& normal, const PhotonMapPart& first, const PhotonMapPart& second, const float diffuse_brdf) {
      using namespace owl;
      float query_area_radius_squared = 0.f;
      auto k_nearest = KNearestPhotons(
-       hitpoint, worldBounds, photons, num_photons, query_area_radius_squared
+       hitpoint, first, second, query_area_radius_squared
      );
 
      auto in_flux = vec3f(0.f);
      #pragma unroll
      for (int p = 0; p < K_NEAREST_NEIGHBOURS; p++) {
-         const auto photonID = k_nearest.get_pointID(p);
-         if (photonID < 0 || photonID > num_photons) continue;
-         auto photon = photons[photonID];
+         int photonID = k_nearest.get_pointID(p);
+         if (photonID < 0 || photonID >= first.count + second.count) continue;
+         const PhotonMapPart& part = photonID < first.count ? first : second;
+         if (photonID >= first.count) photonID -= first.count;
+         const auto photon_pos = part.photons[photonID].pos;
 
-         // auto w_prime = normalize(vec3f(photon.dir));
+         // auto w_prime = photon_storage::direction(part.photons[photonID]);
          // if (dot(w_prime, normal) < 0.f) w_prime = -w_prime;
          // const auto w_prime_dot_n = dot(w_prime, normal);
-         const auto photon_power = photon.power; //* ((w_prime_dot_n < EPS) ? w_prime_dot_n : 1.f);
-         const auto photon_distance = norm(vec3f(photon.pos) - hitpoint);
+         // colour and power are stored premultiplied
+         const auto photon_flux = photon_storage::decodeRGBE(part.flux[photonID]); //* ((w_prime_dot_n < EPS) ? w_prime_dot_n : 1.f);
+         const auto photon_distance = norm(photon_pos - hitpoint);
          const auto photon_weight = 1 - (photon_distance / sqrtf(query_area_radius_squared) * CONE_FILTER_C);
 
          in_flux += diffuse_brdf
-           * photon_power * photon_weight
-           * vec3f(photon.color);
+           * photon_weight
+           * photon_flux;
      }
 
      return in_flux / ((1 - (2.f/3.f) * (1.f/CONE_FILTER_C)) * 2*PI*query_area_radius_squared);
  }
 
+inline __device__
+owl::vec3f gatherPhotonsInRadius(const owl::vec3f& hitpoint, const PhotonNode* photons, const uint32_t* photons_flux,
+                                 const hash_grid::HashGrid& grid, const float radius, const float diffuse_brdf) {
+     using namespace owl;
+     auto in_flux = vec3f(0.f);
+     hash_grid::forEachInRadius(grid, photons, hitpoint, radius, [&](uint32_t photonID, float dist2) {
+         const auto photon_weight = 1 - (sqrtf(dist2) / radius * CONE_FILTER_C);
+         in_flux += diffuse_brdf
+           * photon_weight
+           * photon_storage::decodeRGBE(photons_flux[photonID]);
+     });
+
+     return in_flux / ((1 - (2.f/3.f) * (1.f/CONE_FILTER_C)) * 2*PI*radius*radius);
+ }
+
+/* Density estimate from the caustic map, or from the global one, which is
+ * the non-caustic map and the caustic map together (every photon is only
+ * stored once). Uses the lookup selected on the host. */
+inline __device__
+owl::vec3f gatherFromPhotonMap(const RayGenData& self, bool caustics, const owl::vec3f& hitpoint, const owl::vec3f& normal, const float diffuse_brdf) {
+     if (self.photonLookup == hash_grid::HASH_GRID) {
+         // a fixed radius gathers the same photons from both maps as from their union
+         const owl::vec3f causticsTerm = gatherPhotonsInRadius(hitpoint, self.causticPhotons, self.causticPhotonsFlux,
+                                                               self.causticPhotonsGrid, self.gatherRadius, diffuse_brdf);
+         return caustics
+           ? causticsTerm
+           : causticsTerm + gatherPhotonsInRadius(hitpoint, self.globalPhotons, self.globalPhotonsFlux, self.globalPhotonsGrid, self.gatherRadius, diffuse_brdf);
+     }
+
+     const PhotonMapPart causticMap{self.causticPhotons, self.causticPhotonsFlux, self.numCausticPhotons};
+     const PhotonMapPart globalMap{self.globalPhotons, self.globalPhotonsFlux, self.numGlobalPhotons};
+     return caustics
+       ? gatherPhotons(hitpoint, normal, causticMap, PhotonMapPart{nullptr, nullptr, 0}, diffuse_brdf)
+       : gatherPhotons(hitpoint, normal, globalMap, causticMap, diffuse_brdf);
+ }
+
+/* Final gather lookup: the precomputed irradiance at the nearest point whose
+ * normal matches, falling back to a full estimate on the global map. */
+inline __device__
+owl::vec3f gatherIrradiance(const RayGenData& self, const owl::vec3f& hitpoint, const owl::vec3f& normal, const float diffuse_brdf) {
+     using namespace owl;
+     if (self.numIrradiancePoints == 0) return gatherFromPhotonMap(self, false, hitpoint, normal, diffuse_brdf);
+
+     cukd::HeapCandidateList<IRRADIANCE_CANDIDATES> closest(K_MAX_DISTANCE);
+     cukd::stackBased::knn<cukd::HeapCandidateList<IRRADIANCE_CANDIDATES>, PhotonNode, PhotonNode_traits>(
+       closest, hitpoint, self.irradiancePoints, self.numIrradiancePoints);
+
+     int best = -1;
+     float best_dist2 = INFTY;
+     #pragma unroll
+     for (int p = 0; p < IRRADIANCE_CANDIDATES; p++) {
+         const auto pointID = closest.get_pointID(p);
+         if (pointID < 0 || pointID >= self.numIrradiancePoints) continue;
+         const auto point = self.irradiancePoints[pointID];
+         const auto offset = point.pos - hitpoint;
+         const auto dist2 = dot(offset, offset);
+         if (dist2 >= best_dist2) continue;
+         if (dot(photon_storage::direction(point), normal) < IRRADIANCE_NORMAL_COS) continue;
+         best = pointID;
+         best_dist2 = dist2;
+     }
+
+     if (best < 0) return gatherFromPhotonMap(self, false, hitpoint, normal, diffuse_brdf);
+     return diffuse_brdf * photon_storage::decodeRGBE(self.irradiancePointsFlux[best]);
+ }
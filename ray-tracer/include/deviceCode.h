@@ -5,6 +5,7 @@
 #include "owl/include/owl/common/math/random.h"
 #include "photon.h"
 #include "../../common/src/world.h"
+#include "../../common/src/lightTree.h"
 
 /* variables for the ray generation program */
 struct RayGenData
@@ -12,19 +13,46 @@ struct RayGenData
     uint32_t *fbPtr;
     owl::vec2i  fbSize;
     OptixTraversableHandle world;
+    /* the scene's material table, indexed by hit_record.materialID */
+    Material* materials;
 
     LightSource* lights;
     int numLights;
+    /* light_tree::LightSampling; LIGHT_TREE samples lightSamples lights
+     * per hit from lightTree instead of looping over all of them */
+    int lightSampling;
+    int lightSamples;
+    light_tree::Node* lightTree;
 
-    Photon* globalPhotons;
+    /* the non-caustic photons; global gathers merge them with the caustic
+     * map, so no photon is stored twice */
+    PhotonNode* globalPhotons;
+    uint32_t* globalPhotonsFlux;
     cukd::box_t<float3>* globalPhotonsBounds;
+    /* int is enough on the device: a map holds under PHOTON_MAX_COUNT
+     * photons, larger photon sets go through the chunked CPU map */
     int numGlobalPhotons;
-    Photon* causticPhotons;
+    PhotonNode* causticPhotons;
+    uint32_t* causticPhotonsFlux;
     cukd::box_t<float3>* causticPhotonsBounds;
     int numCausticPhotons;
 
+    /* hash_grid::PhotonLookup; the grids are only set for HASH_GRID */
+    int photonLookup;
+    float gatherRadius;
+    hash_grid::HashGrid globalPhotonsGrid;
+    hash_grid::HashGrid causticPhotonsGrid;
+
+    /* precomputed irradiance points, numIrradiancePoints == 0 if disabled */
+    PhotonNode* irradiancePoints;
+    uint32_t* irradiancePointsFlux;
+    cukd::box_t<float3>* irradiancePointsBounds;
+    int numIrradiancePoints;
+
     int samples_per_pixel;
     int max_ray_depth;
+    /* bounces before Russian roulette starts, negative disables it */
+    int rr_min_depth;
 
     struct {
         owl::vec3f pos;
@@ -59,6 +87,6 @@ struct PerRayData {
         owl::vec3f hitpoint;
         // Always points opposite to the incident ray.
         owl::vec3f normal_at_hitpoint;
-        Material material;
+        uint32_t materialID = 0;
     } hit_record;
 };
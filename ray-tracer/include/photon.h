@@ -7,34 +7,26 @@
 #include <owl/common/math/random.h>
 #include <cukd/data.h>
 #include "../../common/src/world.h"
+#include "../../common/src/photonStorage.h"
+#include "../../common/src/hashGrid.h"
 
-struct Photon {
-    // Data for the photon
-    float3 pos;
-    float3 dir;
-    float3 color;
-    float power;
+using photon_storage::PhotonNode;
 
-    // Data for KD-tree
-    uint8_t quantized_normal[3];
-    uint8_t split_dim;
-};
-
-struct Photon_traits : public cukd::default_data_traits<float3> {
+struct PhotonNode_traits : public cukd::default_data_traits<float3> {
     using point_t = float3;
     enum { has_explicit_dim = true };
 
     static inline __device__ __host__
-    float3 get_point(const Photon &data) { return data.pos; }
+    float3 get_point(const PhotonNode &data) { return data.pos; }
 
     static inline __device__ __host__
-    float get_coord(const Photon &data, int dim)
+    float get_coord(const PhotonNode &data, int dim)
     { return cukd::get_coord(get_point(data),dim); }
 
     // "Optimized" KD-tree functions
-    static inline __device__ int get_dim(const Photon &p)
-    { return p.split_dim; }
+    static inline __device__ __host__ int get_dim(const PhotonNode &p)
+    { return photon_storage::getDim(p); }
 
-    static inline __device__ void set_dim(Photon &p, int dim)
-    { p.split_dim = dim; }
-};
\ No newline at end of file
+    static inline __device__ __host__ void set_dim(PhotonNode &p, int dim)
+    { photon_storage::setDim(p, dim); }
+};
@@ -6,6 +6,7 @@
 #include "../../common/src/world.h"
 #include "owl/common/math/vec.h"
 #include <cukd/box.h>
+#include <string>
 
 struct Program {
     OWLContext owlContext;
@@ -17,18 +18,44 @@ struct Program {
 
     GeometryData geometryData;
 
-    Photon* globalPhotons;
+    /* non-caustic photons only, see RayGenData */
+    PhotonNode* globalPhotons;
+    uint32_t* globalPhotonsFlux;
     cukd::box_t<float3>* globalPhotonsBounds;
     int numGlobalPhotons;
-    Photon* causticPhotons;
+    PhotonNode* causticPhotons;
+    uint32_t* causticPhotonsFlux;
     cukd::box_t<float3>* causticPhotonsBounds;
     int numCausticPhotons;
 
+    /* hash_grid::PhotonLookup; the grids are only set for HASH_GRID */
+    int photonLookup;
+    float gatherRadius;
+    hash_grid::HashGrid globalPhotonsGrid;
+    hash_grid::HashGrid causticPhotonsGrid;
+
+    /* precomputed irradiance points, numIrradiancePoints == 0 if disabled */
+    PhotonNode* irradiancePoints;
+    uint32_t* irradiancePointsFlux;
+    cukd::box_t<float3>* irradiancePointsBounds;
+    int numIrradiancePoints;
+    /* every n-th global photon gets an irradiance point, 0 disables them */
+    int irradianceStride;
+    /* file the KD-tree photon maps are kept in between runs, empty to
+     * always build them */
+    std::string photonMapCache;
+
     OWLBuffer lightsBuffer;
     int numLights;
+    /* light_tree::LightSampling, and the lights sampled per hit for LIGHT_TREE */
+    int lightSampling;
+    int lightSamples;
+    OWLBuffer lightTreeBuffer;
 
     int samplesPerPixel;
     int maxDepth;
+    /* bounces before Russian roulette starts, -1 disables it */
+    int rrMinDepth;
 
     Camera camera;
 };
\ No newline at end of file
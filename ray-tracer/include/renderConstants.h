@@ -0,0 +1,23 @@
+#pragma once
+
+/* Shading constants shared by the OptiX ray tracer and the CPU reference
+ * renderer, so both estimate the same image. */
+
+#define DIRECT_LIGHT_FACTOR 0.8f
+#define CAUSTICS_FACTOR 0.08f
+#define DIFFUSE_FACTOR 0.2f
+#define SPECULAR_FACTOR 1.f
+
+#define NUM_DIFFUSE_SAMPLES 20
+
+#define K_NEAREST_NEIGHBOURS 50
+#define K_MAX_DISTANCE 100
+#define CONE_FILTER_C 1.1f
+
+/* Precomputed irradiance lookups: nearest candidates examined, and the
+ * minimum cosine between the stored and the query normal. */
+#define IRRADIANCE_CANDIDATES 4
+#define IRRADIANCE_NORMAL_COS 0.9f
+
+#define PHOTON_POWER (1.f)
+#define CAUSTICS_PHOTON_POWER (float(PHOTON_POWER) * 0.5f)
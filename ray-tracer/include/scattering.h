@@ -0,0 +1,80 @@
+#pragma once
+
+#include "../../common/src/mesh.h"
+#include "../../common/src/shadingMath.h"
+
+/* Camera-path scattering shared by the OptiX ray tracer and the CPU
+ * reference renderer. */
+
+inline __both__
+owl::vec3f calculate_refracted(const Material& material,
+                               const owl::vec3f& ray_dir,
+                               const owl::vec3f& normal,
+                               Random rand)
+{
+    using namespace owl;
+
+    vec3f outward_normal, refracted;
+    float ni_over_nt, reflection_coefficient, cosine;
+
+    if (dot(ray_dir, normal) > 0.f) {
+        outward_normal = -normal;
+        ni_over_nt = material.refraction_idx;
+        cosine = dot(ray_dir, normal);
+        cosine = sqrtf(1.f - material.refraction_idx*material.refraction_idx*(1.f-cosine*cosine));
+    } else {
+        outward_normal = normal;
+        ni_over_nt = 1.f / material.refraction_idx;
+        cosine = -dot(ray_dir, normal);
+    }
+
+    if (refract(ray_dir, outward_normal, ni_over_nt, refracted))
+        reflection_coefficient = schlickFresnelAprox(cosine, material.refraction_idx);
+    else
+        reflection_coefficient = 1.f;
+
+    vec3f scattered_dir;
+    if (rand() < reflection_coefficient) {
+        scattered_dir = reflect(ray_dir, normal);
+    } else {
+        scattered_dir = refracted;
+    }
+
+    return scattered_dir;
+}
+
+inline __both__
+owl::vec3f reflect_or_refract_ray(const Material& material,
+                                                    const owl::vec3f& ray_dir,
+                                                    const owl::vec3f& normal,
+                                                    Random rand,
+                                                    bool& absorbed,
+                                                    float& coef)
+{
+    absorbed = false;
+
+    auto r = rand();
+    if (r < material.specular) {
+        coef = material.specular;
+        return reflect(ray_dir, normal);
+    }
+    if (r < material.specular + material.transmission) {
+        coef = material.transmission;
+        return calculate_refracted(material, ray_dir, normal, rand);
+    }
+
+    coef = 0.f;
+    absorbed = true;
+    return 0.f;
+}
+
+inline __both__ float specularBrdf(const float specular_coefficient,
+                                      const owl::vec3f& incoming_light_dir,
+                                      const owl::vec3f& outgoing_light_dir,
+                                      const owl::vec3f& normal) {
+    if (const auto reflected_incoming = reflect(incoming_light_dir, normal);
+        nearZero(reflected_incoming - outgoing_light_dir))
+        return specular_coefficient;
+
+    return 0;
+}
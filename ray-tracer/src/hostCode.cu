@@ -1,5 +1,4 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
 // public owl node-graph API
@@ -13,103 +12,188 @@
 #include "../../common/src/configLoader.h"
 #include <assimp/Importer.hpp>
 #include "../include/program.h"
+#include "../include/renderConstants.h"
 #include "../../common/src/common.h"
+#include "../../common/src/trace.h"
+#include "../../common/src/photonFile.h"
+#include "../../common/src/photonMapFile.h"
+#include "../../common/src/precomputedIrradiance.h"
 #include <cukd/builder.h>
 #include <cukd/knn.h>
 #include <chrono>
 
-#define PHOTON_POWER (1.f)
-#define CAUSTICS_PHOTON_POWER (float(PHOTON_POWER) * 0.5f)
 
 extern "C" char deviceCode_ptx[];
 
-Photon* readPhotonsFromFile(const std::string& filename, int& count) {
-  std::ifstream file(filename);
-  std::vector<Photon> tempPhotons;
-
-  if (!file.is_open()) {
-    std::cerr << "Error opening file: " << filename << std::endl;
-    count = 0;
-    return nullptr;
+/* Builds one photon map: positions go through the KD-tree build, then the
+ * packed payloads are gathered into tree order. */
+void buildPhotonMap(const std::vector<photon_storage::PhotonRecord> &records, PhotonNode *&nodes, uint32_t *&flux,
+                    cukd::box_t<float3> *&bounds) {
+  if (records.size() >= PHOTON_MAX_COUNT) {
+    throw std::runtime_error("Too many photons for the photon map: " + std::to_string(records.size()));
   }
 
-  Photon photon{};
-  while (file >> photon.pos.x >> photon.pos.y >> photon.pos.z
-              >> photon.dir.x >> photon.dir.y >> photon.dir.z
-              >> photon.color.x >> photon.color.y >> photon.color.z) {
-    tempPhotons.push_back(photon);
-  }
+  CUKD_CUDA_CALL(MallocManaged((void **)&nodes, records.size() * sizeof(PhotonNode)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&flux, records.size() * sizeof(uint32_t)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&bounds, sizeof(*bounds)));
+
+  photon_storage::prepareNodes(records, nodes);
+  cukd::buildTree<PhotonNode,PhotonNode_traits>(nodes, static_cast<int>(records.size()), bounds);
+  CUKD_CUDA_CALL(DeviceSynchronize());
+  photon_storage::packPayloads(records, nodes, flux);
+}
 
-  count = tempPhotons.size();
-  if (count == 0) {
-    return nullptr;
+/* Same as buildPhotonMap, but bucketed into a hashed grid for fixed-radius
+ * gathers. Built on the host in O(N). */
+void buildPhotonGrid(const std::vector<photon_storage::PhotonRecord> &records, float gatherRadius,
+                     PhotonNode *&nodes, uint32_t *&flux, hash_grid::HashGrid &grid) {
+  if (records.size() >= PHOTON_MAX_COUNT) {
+    throw std::runtime_error("Too many photons for the photon map: " + std::to_string(records.size()));
   }
 
-  auto* photonArray = new Photon[count];
-  std::copy(tempPhotons.begin(), tempPhotons.end(), photonArray);
+  grid.tableSize = hash_grid::tableSizeFor(records.size());
+  grid.cellSize = hash_grid::cellSizeFor(gatherRadius);
+
+  uint32_t *cellStart = nullptr;
+  CUKD_CUDA_CALL(MallocManaged((void **)&nodes, records.size() * sizeof(PhotonNode)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&flux, records.size() * sizeof(uint32_t)));
+  CUKD_CUDA_CALL(MallocManaged((void **)&cellStart, (grid.tableSize + 1) * sizeof(uint32_t)));
+  grid.cellStart = cellStart;
 
-  return photonArray;
+  hash_grid::build(records, grid.cellSize, grid.tableSize, nodes, cellStart);
+  photon_storage::packPayloads(records, nodes, flux);
 }
 
-void loadPhotons(Program &program, const std::string& globalPhotonsFilename, const std::string& causticsPhotonsFilename) {
-  int nonCausticPhotonsNum = 0;
-  auto globalPhotonsFromFile = readPhotonsFromFile(globalPhotonsFilename, nonCausticPhotonsNum);
-  auto causticPhotonsFromFile = readPhotonsFromFile(causticsPhotonsFilename, program.numCausticPhotons);
-  program.numGlobalPhotons = nonCausticPhotonsNum + program.numCausticPhotons;
-  printf("Loaded %d photons (non-caustic %d, caustic %d)\n.", program.numGlobalPhotons, nonCausticPhotonsNum, program.numCausticPhotons);
-
-  CUKD_CUDA_CALL(MallocManaged((void **)&program.causticPhotons, program.numCausticPhotons * sizeof(Photon)));
-  CUKD_CUDA_CALL(MallocManaged((void **)&program.globalPhotons,  program.numGlobalPhotons  * sizeof(Photon)));
-
-  // Load in non Caustic photons to global map
-  for (int i=0; i < nonCausticPhotonsNum; i++) {
-    program.globalPhotons[i].pos = globalPhotonsFromFile[i].pos;
-    program.globalPhotons[i].dir = globalPhotonsFromFile[i].dir;
-    program.globalPhotons[i].color = globalPhotonsFromFile[i].color;
-    program.globalPhotons[i].power = PHOTON_POWER;
+/* Reads both KD-tree photon maps from the photon map cache if it was
+ * built from the current photon files. */
+bool loadCachedPhotonMaps(Program &program, uint64_t sourceKey) {
+  photon_map_file::Reader cache(program.photonMapCache, sourceKey, 2);
+  if (!cache.valid()) return false;
+
+  TRACE_SCOPE("load photon map cache", "io");
+  PhotonNode **nodes[] = {&program.globalPhotons, &program.causticPhotons};
+  uint32_t **flux[] = {&program.globalPhotonsFlux, &program.causticPhotonsFlux};
+  cukd::box_t<float3> **bounds[] = {&program.globalPhotonsBounds, &program.causticPhotonsBounds};
+  for (int map = 0; map < 2; map++) {
+    const uint32_t count = cache.count(map);
+    CUKD_CUDA_CALL(MallocManaged((void **)nodes[map], count * sizeof(PhotonNode)));
+    CUKD_CUDA_CALL(MallocManaged((void **)flux[map], count * sizeof(uint32_t)));
+    CUKD_CUDA_CALL(MallocManaged((void **)bounds[map], sizeof(cukd::box_t<float3>)));
+    const owl::box3f &box = cache.bounds(map);
+    (*bounds[map])->lower = make_float3(box.lower.x, box.lower.y, box.lower.z);
+    (*bounds[map])->upper = make_float3(box.upper.x, box.upper.y, box.upper.z);
+    if (!cache.read(map, *nodes[map], *flux[map])) {
+      throw std::runtime_error("Error reading photon map cache: " + program.photonMapCache);
+    }
   }
+  program.numGlobalPhotons = static_cast<int>(cache.count(0));
+  program.numCausticPhotons = static_cast<int>(cache.count(1));
+  printf("Loaded pre-built photon maps from %s (non-caustic %d, caustic %d)\n", program.photonMapCache.c_str(),
+         program.numGlobalPhotons, program.numCausticPhotons);
+  return true;
+}
 
-  // Load caustic photons to both maps
-  for (int k=0; k < program.numCausticPhotons; k++) {
-    program.causticPhotons[k].pos   = causticPhotonsFromFile[k].pos;
-    program.causticPhotons[k].dir   = causticPhotonsFromFile[k].dir;
-    program.causticPhotons[k].color = causticPhotonsFromFile[k].color;
-    program.causticPhotons[k].power = CAUSTICS_PHOTON_POWER;
-
-    program.globalPhotons[nonCausticPhotonsNum+k].pos   = causticPhotonsFromFile[k].pos;
-    program.globalPhotons[nonCausticPhotonsNum+k].dir   = causticPhotonsFromFile[k].dir;
-    program.globalPhotons[nonCausticPhotonsNum+k].color = causticPhotonsFromFile[k].color;
-    program.globalPhotons[nonCausticPhotonsNum+k].power = CAUSTICS_PHOTON_POWER;
-  }
+void saveCachedPhotonMaps(const Program &program, uint64_t sourceKey) {
+  auto ref = [](const PhotonNode *nodes, const uint32_t *flux, int count, const cukd::box_t<float3> *bounds) {
+    const owl::box3f box(owl::vec3f(bounds->lower.x, bounds->lower.y, bounds->lower.z),
+                         owl::vec3f(bounds->upper.x, bounds->upper.y, bounds->upper.z));
+    return photon_map_file::MapRef{nodes, flux, static_cast<uint32_t>(count), box};
+  };
+  photon_map_file::write(program.photonMapCache, sourceKey, {
+    ref(program.globalPhotons, program.globalPhotonsFlux, program.numGlobalPhotons, program.globalPhotonsBounds),
+    ref(program.causticPhotons, program.causticPhotonsFlux, program.numCausticPhotons, program.causticPhotonsBounds),
+  });
+}
 
-  cukd::box_t<float3> *globalWorldBounds = NULL;
-  CUKD_CUDA_CALL(MallocManaged((void **)&globalWorldBounds,sizeof(*globalWorldBounds)));
+void loadPhotons(Program &program, const std::string& globalPhotonsFilename, const std::string& causticsPhotonsFilename) {
+  program.globalPhotonsGrid = {};
+  program.causticPhotonsGrid = {};
+  program.globalPhotonsBounds = nullptr;
+  program.causticPhotonsBounds = nullptr;
+  program.irradiancePoints = nullptr;
+  program.irradiancePointsFlux = nullptr;
+  program.irradiancePointsBounds = nullptr;
+  program.numIrradiancePoints = 0;
+
+  // the KD-trees come pre-built from the cache when the photon files are unchanged
+  const bool useCache = program.photonLookup == hash_grid::KD_TREE && !program.photonMapCache.empty();
+  const uint64_t sourceKey = useCache
+    ? photon_map_file::sourceKey({globalPhotonsFilename, causticsPhotonsFilename}, {PHOTON_POWER, CAUSTICS_PHOTON_POWER})
+    : 0;
+  const bool cached = useCache && loadCachedPhotonMaps(program, sourceKey);
+  // the irradiance estimate still needs the photons themselves
+  if (cached && program.irradianceStride == 0) {
+    printf("Photon map memory: %zu bytes per photon\n", sizeof(PhotonNode) + sizeof(uint32_t));
+    return;
+  }
 
-  cukd::box_t<float3> *causticWorldBounds = NULL;
-  CUKD_CUDA_CALL(MallocManaged((void **)&causticWorldBounds,sizeof(*causticWorldBounds)));
+  auto globalPhotonsFromFile = photon_file::read<photon_storage::PhotonRecord>(globalPhotonsFilename);
+  auto causticPhotonsFromFile = photon_file::read<photon_storage::PhotonRecord>(causticsPhotonsFilename);
+  const size_t nonCausticPhotonsNum = globalPhotonsFromFile.size();
+  const size_t numCausticPhotons = causticPhotonsFromFile.size();
+  printf("Loaded %zu photons (non-caustic %zu, caustic %zu)\n.", nonCausticPhotonsNum + numCausticPhotons, nonCausticPhotonsNum, numCausticPhotons);
+
+  // Colour and power are stored premultiplied
+  for (auto &record : globalPhotonsFromFile) record.color *= PHOTON_POWER;
+  for (auto &record : causticPhotonsFromFile) record.color *= CAUSTICS_PHOTON_POWER;
+
+  // each photon is stored once: global gathers merge the non-caustic map with the caustic one
+  if (cached) {
+    // the maps came from the cache, the photons are only read for the irradiance estimate
+  } else if (program.photonLookup == hash_grid::HASH_GRID) {
+    TRACE_SCOPE("build hash grid");
+    auto startGrid = std::chrono::high_resolution_clock::now();
+    buildPhotonGrid(globalPhotonsFromFile, program.gatherRadius, program.globalPhotons, program.globalPhotonsFlux, program.globalPhotonsGrid);
+    buildPhotonGrid(causticPhotonsFromFile, program.gatherRadius, program.causticPhotons, program.causticPhotonsFlux, program.causticPhotonsGrid);
+    auto endGrid = std::chrono::high_resolution_clock::now();
+    auto durationGrid = std::chrono::duration_cast<std::chrono::milliseconds>(endGrid - startGrid);
+    printf("Time taken to build hash grid: %lld ms\n", static_cast<long long>(durationGrid.count()));
+  } else {
+    TRACE_SCOPE("build KD-tree");
+    auto startKDT = std::chrono::high_resolution_clock::now();
+    buildPhotonMap(globalPhotonsFromFile, program.globalPhotons, program.globalPhotonsFlux, program.globalPhotonsBounds);
+    buildPhotonMap(causticPhotonsFromFile, program.causticPhotons, program.causticPhotonsFlux, program.causticPhotonsBounds);
+    auto endKDT = std::chrono::high_resolution_clock::now();
+    auto durationKDT = std::chrono::duration_cast<std::chrono::milliseconds>(endKDT - startKDT);
+    printf("Time taken to build KD-Tree: %d ms\n", durationKDT.count());
+  }
+  if (!cached) {
+    // the builds above throw for maps of PHOTON_MAX_COUNT photons or more
+    program.numCausticPhotons = static_cast<int>(numCausticPhotons);
+    program.numGlobalPhotons = static_cast<int>(nonCausticPhotonsNum);
+    // only KD-trees are cached
+    if (useCache) saveCachedPhotonMaps(program, sourceKey);
+  }
 
-  program.globalPhotonsBounds = globalWorldBounds;
-  program.causticPhotonsBounds = causticWorldBounds;
-  auto startKDT = std::chrono::high_resolution_clock::now();
-  cukd::buildTree<Photon,Photon_traits>(program.globalPhotons,program.numGlobalPhotons, program.globalPhotonsBounds);
-  cukd::buildTree<Photon,Photon_traits>(program.causticPhotons,program.numCausticPhotons, program.causticPhotonsBounds);
-  auto endKDT = std::chrono::high_resolution_clock::now();
-  auto durationKDT = std::chrono::duration_cast<std::chrono::milliseconds>(endKDT - startKDT);
-  printf("Time taken to build KD-Tree: %d ms\n", durationKDT.count());
+  if (program.irradianceStride > 0) {
+    auto startIrradiance = std::chrono::high_resolution_clock::now();
+    precomputed_irradiance::Settings irradianceSettings;
+    irradianceSettings.stride = program.irradianceStride;
+    irradianceSettings.maxRadius = K_MAX_DISTANCE;
+    irradianceSettings.coneFilterC = CONE_FILTER_C;
+    // estimated over all photons, like global gathers
+    std::vector<photon_storage::PhotonRecord> globalRecords = std::move(globalPhotonsFromFile);
+    globalRecords.insert(globalRecords.end(), causticPhotonsFromFile.begin(), causticPhotonsFromFile.end());
+    const auto points = precomputed_irradiance::estimate<K_NEAREST_NEIGHBOURS>(globalRecords, irradianceSettings);
+    buildPhotonMap(points, program.irradiancePoints, program.irradiancePointsFlux, program.irradiancePointsBounds);
+    program.numIrradiancePoints = static_cast<int>(points.size());
+    auto endIrradiance = std::chrono::high_resolution_clock::now();
+    auto durationIrradiance = std::chrono::duration_cast<std::chrono::milliseconds>(endIrradiance - startIrradiance);
+    printf("Precomputed irradiance at %d points in %lld ms\n", program.numIrradiancePoints, static_cast<long long>(durationIrradiance.count()));
+  }
+  printf("Photon map memory: %zu bytes per photon\n", sizeof(PhotonNode) + sizeof(uint32_t));
 }
 void setupCamera(Program &program, const owl::vec3f &lookFrom, const owl::vec3f &lookAt, const owl::vec3f &lookUp, float fovy) {
-  const float aspect = program.frameBufferSize.x / static_cast<float>(program.frameBufferSize.y);
-  const float cosFovy = std::cos(fovy);
-  program.camera.pos = lookFrom;
-  program.camera.dir_00 = normalize(lookAt-lookFrom);
-  program.camera.dir_du = cosFovy * aspect * normalize(cross(program.camera.dir_00, lookUp));
-  program.camera.dir_dv = cosFovy * normalize(cross(program.camera.dir_du, program.camera.dir_00));
-  program.camera.dir_00 -= 0.5f * (program.camera.dir_du + program.camera.dir_dv);
+  program.camera = makeCamera(lookFrom, lookAt, lookUp, fovy, program.frameBufferSize);
 }
 
 void loadLights(Program &program, const std::unique_ptr<World> &world) {
   program.numLights = static_cast<int>(world->light_sources.size());
   program.lightsBuffer =  owlDeviceBufferCreate(program.owlContext, OWL_USER_TYPE(LightSource),world->light_sources.size(), world->light_sources.data());
+
+  const auto lightTree = light_tree::build(world->light_sources);
+  program.lightTreeBuffer = owlDeviceBufferCreate(program.owlContext, OWL_USER_TYPE(light_tree::Node), lightTree.size(), lightTree.data());
+  if (lightTree.empty()) program.lightSampling = light_tree::ALL_LIGHTS;
 }
 
 void setupMissProgram(Program &program, const owl::vec3f &sky_color) {
@@ -136,20 +220,35 @@ void setupRaygenProgram(Program &program) {
           { "fbPtr",         OWL_BUFPTR,      OWL_OFFSETOF(RayGenData,fbPtr)},
           { "fbSize",        OWL_INT2,        OWL_OFFSETOF(RayGenData,fbSize)},
           { "world",         OWL_GROUP,       OWL_OFFSETOF(RayGenData,world)},
+          { "materials",     OWL_BUFPTR,      OWL_OFFSETOF(RayGenData,materials)},
           { "camera.pos",    OWL_FLOAT3,      OWL_OFFSETOF(RayGenData,camera.pos)},
           { "camera.dir_00", OWL_FLOAT3,      OWL_OFFSETOF(RayGenData,camera.dir_00)},
           { "camera.dir_du", OWL_FLOAT3,      OWL_OFFSETOF(RayGenData,camera.dir_du)},
           { "camera.dir_dv", OWL_FLOAT3,      OWL_OFFSETOF(RayGenData,camera.dir_dv)},
           { "lights",        OWL_BUFPTR,      OWL_OFFSETOF(RayGenData,lights)},
           { "numLights",     OWL_INT,         OWL_OFFSETOF(RayGenData,numLights)},
+          { "lightSampling", OWL_INT,         OWL_OFFSETOF(RayGenData,lightSampling)},
+          { "lightSamples",  OWL_INT,         OWL_OFFSETOF(RayGenData,lightSamples)},
+          { "lightTree",     OWL_BUFPTR,      OWL_OFFSETOF(RayGenData,lightTree)},
           { "globalPhotons",      OWL_RAW_POINTER,  OWL_OFFSETOF(RayGenData,globalPhotons)},
+          { "globalPhotonsFlux",  OWL_RAW_POINTER,  OWL_OFFSETOF(RayGenData,globalPhotonsFlux)},
           { "globalPhotonsBounds", OWL_RAW_POINTER,  OWL_OFFSETOF(RayGenData,globalPhotonsBounds)},
           { "numGlobalPhotons",   OWL_INT,          OWL_OFFSETOF(RayGenData,numGlobalPhotons)},
           { "causticPhotons",      OWL_RAW_POINTER,  OWL_OFFSETOF(RayGenData,causticPhotons)},
+          { "causticPhotonsFlux",  OWL_RAW_POINTER,  OWL_OFFSETOF(RayGenData,causticPhotonsFlux)},
           { "causticPhotonsBounds", OWL_RAW_POINTER,  OWL_OFFSETOF(RayGenData,causticPhotonsBounds)},
           { "numCausticPhotons",   OWL_INT,          OWL_OFFSETOF(RayGenData,numCausticPhotons)},
+          { "photonLookup",       OWL_INT,          OWL_OFFSETOF(RayGenData,photonLookup)},
+          { "gatherRadius",       OWL_FLOAT,        OWL_OFFSETOF(RayGenData,gatherRadius)},
+          { "globalPhotonsGrid",  OWL_USER_TYPE(hash_grid::HashGrid), OWL_OFFSETOF(RayGenData,globalPhotonsGrid)},
+          { "causticPhotonsGrid", OWL_USER_TYPE(hash_grid::HashGrid), OWL_OFFSETOF(RayGenData,causticPhotonsGrid)},
+          { "irradiancePoints",       OWL_RAW_POINTER, OWL_OFFSETOF(RayGenData,irradiancePoints)},
+          { "irradiancePointsFlux",   OWL_RAW_POINTER, OWL_OFFSETOF(RayGenData,irradiancePointsFlux)},
+          { "irradiancePointsBounds", OWL_RAW_POINTER, OWL_OFFSETOF(RayGenData,irradiancePointsBounds)},
+          { "numIrradiancePoints",    OWL_INT,         OWL_OFFSETOF(RayGenData,numIrradiancePoints)},
           { "samples_per_pixel", OWL_INT,     OWL_OFFSETOF(RayGenData,samples_per_pixel)},
           { "max_ray_depth", OWL_INT,         OWL_OFFSETOF(RayGenData,max_ray_depth)},
+          { "rr_min_depth",  OWL_INT,         OWL_OFFSETOF(RayGenData,rr_min_depth)},
           { /* sentinel to mark end of list */ }
   };
 
@@ -161,20 +260,35 @@ void setupRaygenProgram(Program &program) {
   owlRayGenSetBuffer(program.rayGen,"fbPtr",        program.frameBuffer);
   owlRayGenSet2i    (program.rayGen,"fbSize",       reinterpret_cast<const owl2i&>(program.frameBufferSize));
   owlRayGenSetGroup (program.rayGen,"world",        program.geometryData.worldGroup);
+  owlRayGenSetBuffer(program.rayGen,"materials",    program.geometryData.materialBuffer);
   owlRayGenSet3f    (program.rayGen,"camera.pos",   reinterpret_cast<const owl3f&>(program.camera.pos));
   owlRayGenSet3f    (program.rayGen,"camera.dir_00",reinterpret_cast<const owl3f&>(program.camera.dir_00));
   owlRayGenSet3f    (program.rayGen,"camera.dir_du",reinterpret_cast<const owl3f&>(program.camera.dir_du));
   owlRayGenSet3f    (program.rayGen,"camera.dir_dv",reinterpret_cast<const owl3f&>(program.camera.dir_dv));
   owlRayGenSetBuffer(program.rayGen,"lights",       program.lightsBuffer);
   owlRayGenSet1i    (program.rayGen,"numLights",    program.numLights);
+  owlRayGenSet1i    (program.rayGen,"lightSampling", program.lightSampling);
+  owlRayGenSet1i    (program.rayGen,"lightSamples",  program.lightSamples);
+  owlRayGenSetBuffer(program.rayGen,"lightTree",     program.lightTreeBuffer);
   owlRayGenSetPointer(program.rayGen,"globalPhotons",     program.globalPhotons);
+  owlRayGenSetPointer(program.rayGen,"globalPhotonsFlux", program.globalPhotonsFlux);
   owlRayGenSetPointer(program.rayGen,"globalPhotonsBounds",program.globalPhotonsBounds);
   owlRayGenSet1i    (program.rayGen,"numGlobalPhotons",   program.numGlobalPhotons);
   owlRayGenSetPointer(program.rayGen,"causticPhotons",    program.causticPhotons);
+  owlRayGenSetPointer(program.rayGen,"causticPhotonsFlux",program.causticPhotonsFlux);
   owlRayGenSetPointer(program.rayGen,"causticPhotonsBounds",program.causticPhotonsBounds);
   owlRayGenSet1i    (program.rayGen,"numCausticPhotons",  program.numCausticPhotons);
+  owlRayGenSet1i    (program.rayGen,"photonLookup",       program.photonLookup);
+  owlRayGenSet1f    (program.rayGen,"gatherRadius",       program.gatherRadius);
+  owlRayGenSetRaw   (program.rayGen,"globalPhotonsGrid",  &program.globalPhotonsGrid);
+  owlRayGenSetRaw   (program.rayGen,"causticPhotonsGrid", &program.causticPhotonsGrid);
+  owlRayGenSetPointer(program.rayGen,"irradiancePoints",       program.irradiancePoints);
+  owlRayGenSetPointer(program.rayGen,"irradiancePointsFlux",   program.irradiancePointsFlux);
+  owlRayGenSetPointer(program.rayGen,"irradiancePointsBounds", program.irradiancePointsBounds);
+  owlRayGenSet1i    (program.rayGen,"numIrradiancePoints",    program.numIrradiancePoints);
   owlRayGenSet1i    (program.rayGen,"samples_per_pixel", program.samplesPerPixel);
   owlRayGenSet1i    (program.rayGen,"max_ray_depth", program.maxDepth);
+  owlRayGenSet1i    (program.rayGen,"rr_min_depth",  program.rrMinDepth);
 }
 
 int main(int ac, char **av)
@@ -189,6 +303,7 @@ int main(int ac, char **av)
   LOG("Loading Config file...")
 
   auto cfg = parse_config();
+  start_trace_from_config(cfg);
 
   auto global_photons_filename = cfg["data"]["photons_file"].as_string();
   auto caustics_photons_filename = cfg["data"]["caustics_photons_file"].as_string();
@@ -204,16 +319,31 @@ int main(int ac, char **av)
   program.frameBufferSize = toml_to_vec2i(cfg["ray-tracer"]["fb_size"]);
   program.samplesPerPixel = static_cast<int>(cfg["ray-tracer"]["samples_per_pixel"].as_integer());
   program.maxDepth = static_cast<int>(cfg["ray-tracer"]["depth"].as_integer());
+  program.photonLookup = parse_photon_lookup(toml::find_or<std::string>(cfg, "ray-tracer", "photon_lookup", "kd_tree"));
+  program.gatherRadius = toml::find_or<float>(cfg, "ray-tracer", "gather_radius", 1.f);
+  program.irradianceStride = toml::find_or<bool>(cfg, "ray-tracer", "precomputed_irradiance", false)
+    ? toml::find_or<int>(cfg, "ray-tracer", "irradiance_stride", 4) : 0;
+  program.photonMapCache = toml::find_or<std::string>(cfg, "ray-tracer", "photon_map_cache", "");
+  program.lightSampling = parse_light_sampling(toml::find_or<std::string>(cfg, "ray-tracer", "light_sampling", "all"));
+  program.lightSamples = std::max(1, toml::find_or<int>(cfg, "ray-tracer", "light_samples", 1));
+  program.rrMinDepth = toml::find_or<bool>(cfg, "ray-tracer", "russian_roulette", false)
+    ? toml::find_or<int>(cfg, "ray-tracer", "russian_roulette_min_depth", 3) : -1;
 
   auto *ai_importer = new Assimp::Importer;
   auto world =  assets::import_scene(ai_importer, model_path);
 
+  // the device shading ignores Material::albedoTexture
+  if (!world->textures.empty()) {
+    std::cerr << "Error: " << model_path << " uses textured materials, which only the CPU renderer supports" << std::endl;
+    return 1;
+  }
+
   LOG_OK("Loaded world.");
 
   LOG_OK("Setting up programs...");
 
   program.frameBuffer = owlHostPinnedBufferCreate(program.owlContext,OWL_INT,program.frameBufferSize.x * program.frameBufferSize.y);
-  program.geometryData = loadGeometry(program.owlContext, world);
+  program.geometryData = loadGeometry(program.owlContext, world, toml::find_or<bool>(cfg, "data", "precomputed_normals", false));
 
   loadLights(program, world);
   loadPhotons(program, global_photons_filename, caustics_photons_filename);
@@ -223,23 +353,33 @@ int main(int ac, char **av)
   setupClosestHitProgram(program);
   setupRaygenProgram(program);
 
-  owlBuildPrograms(program.owlContext);
-  owlBuildPipeline(program.owlContext);
-  owlBuildSBT(program.owlContext);
+  {
+    TRACE_SCOPE("build pipeline");
+    owlBuildPrograms(program.owlContext);
+    owlBuildPipeline(program.owlContext);
+    owlBuildSBT(program.owlContext);
+  }
 
   LOG_OK("Launching...");
   auto startRT = std::chrono::high_resolution_clock::now();
-  owlRayGenLaunch2D(program.rayGen, program.frameBufferSize.x, program.frameBufferSize.y);
+  {
+    TRACE_SCOPE("render", "render");
+    owlRayGenLaunch2D(program.rayGen, program.frameBufferSize.x, program.frameBufferSize.y);
+  }
   auto endRT = std::chrono::high_resolution_clock::now();
   LOG_OK("Saving image...");
 
   auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endRT - startRT);
   printf("Time taken to render: %d ms\n", duration.count());
 
-  auto *fb = static_cast<const uint32_t*>(owlBufferGetPointer(program.frameBuffer, 0));
-  stbi_write_png(output_filename.c_str(),program.frameBufferSize.x,program.frameBufferSize.y,4,fb,program.frameBufferSize.x*sizeof(uint32_t));
+  {
+    TRACE_SCOPE("write png", "io");
+    auto *fb = static_cast<const uint32_t*>(owlBufferGetPointer(program.frameBuffer, 0));
+    stbi_write_png(output_filename.c_str(),program.frameBufferSize.x,program.frameBufferSize.y,4,fb,program.frameBufferSize.x*sizeof(uint32_t));
+  }
 
   owlContextDestroy(program.owlContext);
+  trace::finish();
   LOG_OK("Finished. If all went well, this should be the last output.");
 
   return 0;
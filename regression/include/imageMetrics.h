@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "owl/common/math/vec.h"
+
+/* Image comparison metrics for the golden-image regression harness.
+ * Images hold display-referred (sRGB encoded) values in [0, 1]. */
+namespace metrics {
+    struct Image {
+        int width = 0;
+        int height = 0;
+        std::vector<owl::vec3f> pixels;
+    };
+
+    Image fromRGBA(const std::vector<uint32_t> &rgba, int width, int height);
+    bool loadPNG(const std::string &filename, Image &image);
+    bool savePNG(const std::string &filename, const Image &image);
+
+    /* Root mean squared error over all channels. */
+    float rmse(const Image &test, const Image &reference);
+
+    /* Mean of (test - ref)^2 / (ref^2 + 0.01), which weighs errors in dark
+     * regions as much as in bright ones. */
+    float relativeMse(const Image &test, const Image &reference);
+
+    /* Simplified FLIP: colour differences are taken in a perceptually
+     * uniform space after a spatial (CSF-like) blur, and amplified where
+     * edges differ. Returns the mean per-pixel error in [0, 1] and, when
+     * `errorMap` is given, the per-pixel error as a grey image. */
+    float flip(const Image &test, const Image &reference, Image *errorMap = nullptr);
+}
@@ -0,0 +1,321 @@
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../../externals/stb/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../../externals/stb/stb_image_write.h"
+
+#include "../include/imageMetrics.h"
+#include "../../common/src/assetImporter.h"
+#include "../../common/src/camera.h"
+#include "../../common/src/common.h"
+#include "../../common/src/configLoader.h"
+#include "../../common/src/trace.h"
+#include "../../cpu-renderer/include/bvh.h"
+#include "../../cpu-renderer/include/chunkedPhotonMap.h"
+#include "../../cpu-renderer/include/photonMap.h"
+#include "../../cpu-renderer/include/photonTracer.h"
+#include "../../cpu-renderer/include/renderer.h"
+#include <assimp/Importer.hpp>
+
+/* Golden-image regression harness.
+ *
+ * Renders every case in the cases file with the CPU renderer at a fixed
+ * seed and compares it against the stored reference image. The CPU paths
+ * are deterministic for a given seed regardless of the thread count, so any
+ * difference comes from a change to the algorithms themselves.
+ *
+ * usage: imageRegression [--cases FILE] [--references DIR]
+ *                        [--output-dir DIR] [--threads N] [--update]
+ *
+ * Cases with the irradiance cache start from an empty cache and render on
+ * one thread, since records are added in the order the workers reach them.
+ * They also check that the cache survives save() and load(): the next frame
+ * rendered from the reloaded cache has to match the one rendered from the
+ * cache it was saved from.
+ *
+ * With --update the rendered images replace the references instead of being
+ * compared against them. Exits with 1 if any case is out of tolerance, and
+ * before rendering anything if a case has no reference: references are
+ * only ever written by an explicit --update on a known-good revision.
+ */
+
+namespace fs = std::filesystem;
+
+struct Options {
+  std::string casesFile = "../regression/cases.toml";
+  std::string referencesDir = "../regression/references";
+  std::string outputDir = "regression-output";
+  int numThreads = 0;
+  bool update = false;
+};
+
+struct Tolerances {
+  float rmse;
+  float relativeMse;
+  float flip;
+};
+
+struct CaseResult {
+  std::string name;
+  float rmse;
+  float relativeMse;
+  float flip;
+  bool passed;
+};
+
+Tolerances readTolerances(const toml::value &cfg) {
+  const auto &tbl = cfg.at("tolerances");
+  return {
+    toml::find_or<float>(tbl, "rmse", 0.02f),
+    toml::find_or<float>(tbl, "relative_mse", 0.01f),
+    toml::find_or<float>(tbl, "flip", 0.05f),
+  };
+}
+
+bool withinTolerances(const metrics::Image &image, const metrics::Image &reference, const Tolerances &tolerances) {
+  return metrics::rmse(image, reference) <= tolerances.rmse
+         && metrics::relativeMse(image, reference) <= tolerances.relativeMse
+         && metrics::flip(image, reference) <= tolerances.flip;
+}
+
+metrics::Image renderCase(const toml::value &c, const Options &options, const Tolerances &tolerances) {
+  TRACE_SCOPE("render case");
+
+  Assimp::Importer importer;
+  std::string modelPath = c.at("model_path").as_string();
+  const auto world = assets::import_scene(&importer, modelPath);
+  const auto bvh = cpu::buildBvh(*world);
+  // one cache for the photon and the render pass
+  cpu::TextureCacheSettings textureSettings;
+  textureSettings.memoryBudget = static_cast<size_t>(toml::find_or<int>(c, "texture_cache_mb", 64)) << 20;
+  cpu::TextureCache textures(world->textures, textureSettings);
+
+  const uint32_t seed = static_cast<uint32_t>(toml::find_or<int>(c, "seed", 0));
+  const int rrMinDepth = toml::find_or<bool>(c, "russian_roulette", false)
+    ? toml::find_or<int>(c, "russian_roulette_min_depth", 3) : -1;
+
+  cpu::PhotonTracerSettings photonSettings;
+  photonSettings.maxDepth = c.at("max_photon_depth").as_integer();
+  photonSettings.castedDiffusePhotons = c.at("casted_diffuse_photons").as_integer();
+  photonSettings.castedCausticsPhotons = c.at("casted_caustics_photons").as_integer();
+  photonSettings.seed = seed;
+  photonSettings.numThreads = options.numThreads;
+  photonSettings.rrMinDepth = rrMinDepth;
+  photonSettings.textures = &textures;
+  const auto traced = cpu::tracePhotons(*world, bvh, photonSettings);
+  cpu::PhotonMapSettings photonMapSettings;
+  photonMapSettings.lookup = parse_photon_lookup(toml::find_or<std::string>(c, "photon_lookup", "kd_tree"));
+  photonMapSettings.gatherRadius = toml::find_or<float>(c, "gather_radius", 1.f);
+  photonMapSettings.precomputeIrradiance = toml::find_or<bool>(c, "precomputed_irradiance", false);
+  photonMapSettings.irradianceStride = toml::find_or<int>(c, "irradiance_stride", 4);
+  photonMapSettings.numThreads = options.numThreads;
+  auto photonMaps = cpu::buildPhotonMaps(traced.global, traced.caustic, photonMapSettings);
+
+  // the global map goes through a file and is paged back in chunk by chunk
+  std::unique_ptr<cpu::ChunkedPhotonMap> globalChunks;
+  if (toml::find_or<bool>(c, "chunked_photon_map", false)) {
+    cpu::ChunkedPhotonMapSettings chunkSettings;
+    chunkSettings.chunkCapacity = static_cast<uint32_t>(toml::find_or<int>(c, "photon_chunk_size", 1 << 16));
+    chunkSettings.memoryBudget = static_cast<size_t>(toml::find_or<int>(c, "photon_cache_mb", 256)) << 20;
+    chunkSettings.numThreads = options.numThreads;
+    const std::string chunksFile = options.outputDir + "/" + c.at("name").as_string() + ".pchk";
+    const auto records = cpu::globalPhotonRecords(traced.global, traced.caustic);
+    // failing here rather than falling back, which would test the in-memory map
+    if (!cpu::writeChunkedPhotonMap([&](const auto &fn) { for (const auto &record : records) fn(record); },
+                                    chunksFile, chunkSettings)) {
+      throw std::runtime_error("Error writing chunked photon map: " + chunksFile);
+    }
+    globalChunks = std::make_unique<cpu::ChunkedPhotonMap>(chunksFile, chunkSettings);
+    if (!globalChunks->valid()) throw std::runtime_error("Invalid chunked photon map: " + chunksFile);
+    photonMaps.globalChunks = globalChunks.get();
+  }
+
+  cpu::RenderSettings renderSettings;
+  renderSettings.fbSize = toml_to_vec2i(c.at("fb_size"));
+  renderSettings.samplesPerPixel = c.at("samples_per_pixel").as_integer();
+  renderSettings.maxDepth = c.at("depth").as_integer();
+  renderSettings.skyColour = toml_to_vec3f(c.at("sky_colour"));
+  renderSettings.seed = seed;
+  renderSettings.numThreads = options.numThreads;
+  renderSettings.rrMinDepth = rrMinDepth;
+  renderSettings.lightSampling = parse_light_sampling(toml::find_or<std::string>(c, "light_sampling", "all"));
+  renderSettings.lightSamples = std::max(1, toml::find_or<int>(c, "light_samples", 1));
+  renderSettings.textures = &textures;
+
+  // every run starts from an empty cache, so the image doesn't depend on
+  // earlier runs; one thread keeps the order of the records fixed
+  const bool useIrradianceCache = toml::find_or<bool>(c, "irradiance_cache", false);
+  cpu::IrradianceCacheSettings cacheSettings;
+  cacheSettings.accuracy = toml::find_or<float>(c, "irradiance_cache_accuracy", cacheSettings.accuracy);
+  std::unique_ptr<cpu::IrradianceCache> irradianceCache;
+  if (useIrradianceCache) {
+    irradianceCache = std::make_unique<cpu::IrradianceCache>(bvh.nodes.front().bounds, cacheSettings);
+    renderSettings.irradianceCache = irradianceCache.get();
+    renderSettings.numThreads = 1;
+  }
+
+  const auto camera = makeCamera(toml_to_vec3f(c.at("look_from")),
+                                 toml_to_vec3f(c.at("look_at")),
+                                 toml_to_vec3f(c.at("look_up")),
+                                 static_cast<float>(c.at("fovy").as_floating()),
+                                 renderSettings.fbSize);
+
+  const auto pixels = cpu::render(*world, bvh, photonMaps, camera, renderSettings);
+
+  // like the next frame of a camera sweep: once from the saved and reloaded
+  // cache, once from the cache as it is in memory
+  if (useIrradianceCache) {
+    const std::string cacheFile = options.outputDir + "/" + c.at("name").as_string() + ".irc";
+    cpu::IrradianceCache reloaded(bvh.nodes.front().bounds, cacheSettings);
+    if (!irradianceCache->save(cacheFile) || !reloaded.load(cacheFile) || reloaded.size() != irradianceCache->size()) {
+      throw std::runtime_error("Irradiance cache didn't survive a save and load: " + cacheFile);
+    }
+    const int width = renderSettings.fbSize.x, height = renderSettings.fbSize.y;
+    renderSettings.irradianceCache = &reloaded;
+    const auto fromFile = metrics::fromRGBA(cpu::render(*world, bvh, photonMaps, camera, renderSettings), width, height);
+    renderSettings.irradianceCache = irradianceCache.get();
+    const auto fromMemory = metrics::fromRGBA(cpu::render(*world, bvh, photonMaps, camera, renderSettings), width, height);
+    if (!withinTolerances(fromFile, fromMemory, tolerances)) {
+      throw std::runtime_error("Reloaded irradiance cache renders differently: " + cacheFile);
+    }
+  }
+  return metrics::fromRGBA(pixels, renderSettings.fbSize.x, renderSettings.fbSize.y);
+}
+
+void writeSummary(const std::string &filename, const Tolerances &tolerances, const std::vector<CaseResult> &results) {
+  std::ofstream out(filename);
+  if (!out.is_open()) {
+    std::cerr << "Error opening file: " << filename << std::endl;
+    return;
+  }
+
+  out << "{\n  \"tolerances\": {\"rmse\": " << tolerances.rmse
+      << ", \"relative_mse\": " << tolerances.relativeMse
+      << ", \"flip\": " << tolerances.flip << "},\n  \"cases\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto &r = results[i];
+    out << (i == 0 ? "" : ",") << "\n    {\"name\": \"" << r.name
+        << "\", \"rmse\": " << r.rmse
+        << ", \"relative_mse\": " << r.relativeMse
+        << ", \"flip\": " << r.flip
+        << ", \"passed\": " << (r.passed ? "true" : "false") << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+Options parseOptions(int ac, char **av) {
+  Options options;
+  for (int i = 1; i < ac; i++) {
+    const std::string arg = av[i];
+    if (arg == "--update") {
+      options.update = true;
+      continue;
+    }
+    if (i + 1 >= ac) throw std::runtime_error("Missing value for " + arg);
+    const std::string value = av[++i];
+
+    if (arg == "--cases") options.casesFile = value;
+    else if (arg == "--references") options.referencesDir = value;
+    else if (arg == "--output-dir") options.outputDir = value;
+    else if (arg == "--threads") options.numThreads = std::stoi(value);
+    else throw std::runtime_error("Unknown option " + arg);
+  }
+  return options;
+}
+
+int main(int ac, char **av)
+{
+  const Options options = parseOptions(ac, av);
+
+  const auto cfg = toml::parse(options.casesFile);
+  start_trace_from_config(cfg);
+  const Tolerances tolerances = readTolerances(cfg);
+
+  if (!options.update) {
+    bool missing = false;
+    for (const auto &c : cfg.at("case").as_array()) {
+      const std::string referenceFile = options.referencesDir + "/" + c.at("name").as_string() + ".png";
+      if (!fs::exists(referenceFile)) {
+        std::cerr << "Missing reference: " << referenceFile << std::endl;
+        missing = true;
+      }
+    }
+    if (missing) {
+      std::cerr << "Render the references with --update on a known-good revision and commit them" << std::endl;
+      return 1;
+    }
+  }
+
+  fs::create_directories(options.outputDir);
+  if (options.update) fs::create_directories(options.referencesDir);
+
+  std::vector<CaseResult> results;
+  bool allPassed = true;
+
+  for (const auto &c : cfg.at("case").as_array()) {
+    const std::string name = c.at("name").as_string();
+    LOG("rendering " << name);
+
+    metrics::Image image;
+    try {
+      image = renderCase(c, options, tolerances);
+    } catch (const std::exception &e) {
+      std::cerr << "FAIL " << name << ": " << e.what() << std::endl;
+      results.push_back({name, INFINITY, INFINITY, INFINITY, false});
+      allPassed = false;
+      continue;
+    }
+    const std::string referenceFile = options.referencesDir + "/" + name + ".png";
+    metrics::savePNG(options.outputDir + "/" + name + ".png", image);
+
+    if (options.update) {
+      if (!metrics::savePNG(referenceFile, image)) {
+        std::cerr << "Error writing reference: " << referenceFile << std::endl;
+        allPassed = false;
+      } else {
+        LOG_OK("updated " << referenceFile);
+      }
+      continue;
+    }
+
+    // the reference went through the same 8-bit round trip as the output
+    metrics::Image reference;
+    if (!metrics::loadPNG(referenceFile, reference)) {
+      std::cerr << "Unreadable reference: " << referenceFile << std::endl;
+      results.push_back({name, INFINITY, INFINITY, INFINITY, false});
+      allPassed = false;
+      continue;
+    }
+
+    metrics::Image errorMap;
+    CaseResult result;
+    result.name = name;
+    result.rmse = metrics::rmse(image, reference);
+    result.relativeMse = metrics::relativeMse(image, reference);
+    result.flip = metrics::flip(image, reference, &errorMap);
+    result.passed = result.rmse <= tolerances.rmse
+                    && result.relativeMse <= tolerances.relativeMse
+                    && result.flip <= tolerances.flip;
+    if (!errorMap.pixels.empty()) metrics::savePNG(options.outputDir + "/" + name + "-flip.png", errorMap);
+
+    std::cout << (result.passed ? "PASS " : "FAIL ") << name
+              << ": rmse=" << result.rmse
+              << " relative_mse=" << result.relativeMse
+              << " flip=" << result.flip << std::endl;
+
+    allPassed &= result.passed;
+    results.push_back(result);
+  }
+
+  if (!options.update) writeSummary(options.outputDir + "/summary.json", tolerances, results);
+
+  trace::finish();
+  return allPassed ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+#include "../include/imageMetrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../../externals/stb/stb_image.h"
+#include "../../externals/stb/stb_image_write.h"
+
+using namespace owl;
+
+/* FLIP parameters (Andersson et al. 2020) */
+#define FLIP_QC 0.7f
+#define FLIP_QF 0.5f
+#define FLIP_PC 0.4f
+#define FLIP_PT 0.95f
+/* Std. deviations, in pixels, of the achromatic and chromatic blurs. They
+ * stand in for the contrast sensitivity functions at ~67 pixels/degree. */
+#define ACHROMATIC_SIGMA 0.5f
+#define CHROMATIC_SIGMA 1.5f
+#define EDGE_SIGMA 1.0f
+
+namespace {
+  float srgbToLinear(float c) {
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+  }
+
+  vec3f linearToXyz(const vec3f &c) {
+    return vec3f(0.4124f * c.x + 0.3576f * c.y + 0.1805f * c.z,
+                 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z,
+                 0.0193f * c.x + 0.1192f * c.y + 0.9505f * c.z);
+  }
+
+  const vec3f D65(0.9505f, 1.f, 1.089f);
+
+  float labF(float t) {
+    const float delta = 6.f / 29.f;
+    return t > delta * delta * delta ? std::cbrt(t) : t / (3.f * delta * delta) + 4.f / 29.f;
+  }
+
+  vec3f xyzToLab(const vec3f &xyz) {
+    const float fx = labF(xyz.x / D65.x);
+    const float fy = labF(xyz.y / D65.y);
+    const float fz = labF(xyz.z / D65.z);
+    return vec3f(116.f * fy - 16.f, 500.f * (fx - fy), 200.f * (fy - fz));
+  }
+
+  /* Opponent space in which the spatial filtering happens. */
+  vec3f xyzToYcxcz(const vec3f &xyz) {
+    const float fy = xyz.y / D65.y;
+    return vec3f(116.f * fy - 16.f, 500.f * (xyz.x / D65.x - fy), 200.f * (fy - xyz.z / D65.z));
+  }
+
+  vec3f ycxczToXyz(const vec3f &v) {
+    const float fy = (v.x + 16.f) / 116.f;
+    return vec3f(D65.x * (v.y / 500.f + fy), D65.y * fy, D65.z * (fy - v.z / 200.f));
+  }
+
+  float hyab(const vec3f &a, const vec3f &b) {
+    const vec3f d = a - b;
+    return std::abs(d.x) + std::sqrt(d.y * d.y + d.z * d.z);
+  }
+
+  std::vector<float> gaussianKernel(float sigma) {
+    const int radius = std::max(1, static_cast<int>(std::ceil(3.f * sigma)));
+    std::vector<float> kernel(2 * radius + 1);
+    float sum = 0.f;
+    for (int i = -radius; i <= radius; i++) {
+      kernel[i + radius] = std::exp(-(i * i) / (2.f * sigma * sigma));
+      sum += kernel[i + radius];
+    }
+    for (auto &k : kernel) k /= sum;
+    return kernel;
+  }
+
+  /* Separable blur of one channel with clamped borders. */
+  std::vector<float> blur(const std::vector<float> &src, int w, int h, float sigma) {
+    const auto kernel = gaussianKernel(sigma);
+    const int radius = static_cast<int>(kernel.size() / 2);
+    std::vector<float> tmp(src.size()), dst(src.size());
+
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        float acc = 0.f;
+        for (int k = -radius; k <= radius; k++) {
+          acc += kernel[k + radius] * src[y * w + std::clamp(x + k, 0, w - 1)];
+        }
+        tmp[y * w + x] = acc;
+      }
+    }
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        float acc = 0.f;
+        for (int k = -radius; k <= radius; k++) {
+          acc += kernel[k + radius] * tmp[std::clamp(y + k, 0, h - 1) * w + x];
+        }
+        dst[y * w + x] = acc;
+      }
+    }
+    return dst;
+  }
+
+  /* Gradient magnitude of the blurred, normalised luminance. */
+  std::vector<float> edges(const std::vector<float> &luminance, int w, int h) {
+    const auto smooth = blur(luminance, w, h, EDGE_SIGMA);
+    std::vector<float> result(smooth.size());
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        const float gx = smooth[y * w + std::min(x + 1, w - 1)] - smooth[y * w + std::max(x - 1, 0)];
+        const float gy = smooth[std::min(y + 1, h - 1) * w + x] - smooth[std::max(y - 1, 0) * w + x];
+        result[y * w + x] = 0.5f * std::sqrt(gx * gx + gy * gy);
+      }
+    }
+    return result;
+  }
+
+  struct Filtered {
+    std::vector<vec3f> lab;
+    std::vector<float> edges;
+  };
+
+  Filtered filter(const metrics::Image &image) {
+    const int w = image.width, h = image.height;
+    std::vector<float> channel[3], luminance(image.pixels.size());
+    for (auto &c : channel) c.resize(image.pixels.size());
+
+    for (size_t i = 0; i < image.pixels.size(); i++) {
+      const vec3f &p = image.pixels[i];
+      const vec3f xyz = linearToXyz(vec3f(srgbToLinear(p.x), srgbToLinear(p.y), srgbToLinear(p.z)));
+      const vec3f opp = xyzToYcxcz(xyz);
+      channel[0][i] = opp.x;
+      channel[1][i] = opp.y;
+      channel[2][i] = opp.z;
+      luminance[i] = (opp.x + 16.f) / 116.f;
+    }
+
+    channel[0] = blur(channel[0], w, h, ACHROMATIC_SIGMA);
+    channel[1] = blur(channel[1], w, h, CHROMATIC_SIGMA);
+    channel[2] = blur(channel[2], w, h, CHROMATIC_SIGMA);
+
+    Filtered result;
+    result.lab.resize(image.pixels.size());
+    for (size_t i = 0; i < image.pixels.size(); i++) {
+      const vec3f xyz = ycxczToXyz(vec3f(channel[0][i], channel[1][i], channel[2][i]));
+      result.lab[i] = xyzToLab(vec3f(std::max(xyz.x, 0.f), std::max(xyz.y, 0.f), std::max(xyz.z, 0.f)));
+    }
+    result.edges = edges(luminance, w, h);
+    return result;
+  }
+
+  /* Compresses the colour error so that small differences stay linear and
+   * large ones saturate, as in FLIP. */
+  float remapColourError(float error, float cmax) {
+    const float pccmax = FLIP_PC * cmax;
+    if (error < pccmax) return (FLIP_PT / pccmax) * error;
+    return FLIP_PT + ((error - pccmax) / (cmax - pccmax)) * (1.f - FLIP_PT);
+  }
+
+  bool sameSize(const metrics::Image &a, const metrics::Image &b) {
+    return a.width == b.width && a.height == b.height && !a.pixels.empty();
+  }
+}
+
+metrics::Image metrics::fromRGBA(const std::vector<uint32_t> &rgba, int width, int height) {
+  Image image;
+  image.width = width;
+  image.height = height;
+  image.pixels.resize(rgba.size());
+  for (size_t i = 0; i < rgba.size(); i++) {
+    image.pixels[i] = vec3f((rgba[i] & 0xff) / 255.f, ((rgba[i] >> 8) & 0xff) / 255.f, ((rgba[i] >> 16) & 0xff) / 255.f);
+  }
+  return image;
+}
+
+bool metrics::loadPNG(const std::string &filename, Image &image) {
+  int w, h, n;
+  unsigned char *data = stbi_load(filename.c_str(), &w, &h, &n, 3);
+  if (data == nullptr) return false;
+
+  image.width = w;
+  image.height = h;
+  image.pixels.resize(w * h);
+  for (int i = 0; i < w * h; i++) {
+    image.pixels[i] = vec3f(data[3 * i] / 255.f, data[3 * i + 1] / 255.f, data[3 * i + 2] / 255.f);
+  }
+  stbi_image_free(data);
+  return true;
+}
+
+bool metrics::savePNG(const std::string &filename, const Image &image) {
+  std::vector<unsigned char> data(3 * image.pixels.size());
+  for (size_t i = 0; i < image.pixels.size(); i++) {
+    data[3 * i] = static_cast<unsigned char>(std::clamp(image.pixels[i].x, 0.f, 1.f) * 255.f + 0.5f);
+    data[3 * i + 1] = static_cast<unsigned char>(std::clamp(image.pixels[i].y, 0.f, 1.f) * 255.f + 0.5f);
+    data[3 * i + 2] = static_cast<unsigned char>(std::clamp(image.pixels[i].z, 0.f, 1.f) * 255.f + 0.5f);
+  }
+  return stbi_write_png(filename.c_str(), image.width, image.height, 3, data.data(), 3 * image.width) != 0;
+}
+
+float metrics::rmse(const Image &test, const Image &reference) {
+  if (!sameSize(test, reference)) return INFINITY;
+
+  double sum = 0.0;
+  for (size_t i = 0; i < test.pixels.size(); i++) {
+    const vec3f d = test.pixels[i] - reference.pixels[i];
+    sum += dot(d, d);
+  }
+  return static_cast<float>(std::sqrt(sum / (3.0 * test.pixels.size())));
+}
+
+float metrics::relativeMse(const Image &test, const Image &reference) {
+  if (!sameSize(test, reference)) return INFINITY;
+
+  double sum = 0.0;
+  for (size_t i = 0; i < test.pixels.size(); i++) {
+    for (int c = 0; c < 3; c++) {
+      const float d = test.pixels[i][c] - reference.pixels[i][c];
+      sum += d * d / (reference.pixels[i][c] * reference.pixels[i][c] + 0.01f);
+    }
+  }
+  return static_cast<float>(sum / (3.0 * test.pixels.size()));
+}
+
+float metrics::flip(const Image &test, const Image &reference, Image *errorMap) {
+  if (!sameSize(test, reference)) return INFINITY;
+
+  const Filtered a = filter(test);
+  const Filtered b = filter(reference);
+
+  // largest colour difference: between pure green and pure blue
+  const vec3f green = xyzToLab(linearToXyz(vec3f(0.f, 1.f, 0.f)));
+  const vec3f blue = xyzToLab(linearToXyz(vec3f(0.f, 0.f, 1.f)));
+  const float cmax = std::pow(hyab(green, blue), FLIP_QC);
+
+  if (errorMap) {
+    errorMap->width = test.width;
+    errorMap->height = test.height;
+    errorMap->pixels.resize(test.pixels.size());
+  }
+
+  double sum = 0.0;
+  for (size_t i = 0; i < test.pixels.size(); i++) {
+    const float colourError = remapColourError(std::pow(hyab(a.lab[i], b.lab[i]), FLIP_QC), cmax);
+    const float featureError = std::pow(std::min(1.f, std::abs(a.edges[i] - b.edges[i]) / std::sqrt(2.f)), FLIP_QF);
+    const float error = std::pow(std::min(1.f, colourError), 1.f - featureError);
+
+    sum += error;
+    if (errorMap) errorMap->pixels[i] = vec3f(error);
+  }
+  return static_cast<float>(sum / test.pixels.size());
+}